@@ -0,0 +1,622 @@
+// Standalone benchmarks for the kdtools header library.
+//
+// Build with `make` in this directory and run `./kdbench --help` for
+// options. Results are written to stdout as CSV (default) or JSON, one
+// record per (operation, distribution, n, dim, k, threads) combination.
+
+#include <kdtools.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace kdtools;
+
+using std::array;
+using std::size_t;
+using std::string;
+using std::vector;
+
+struct options
+{
+  vector<size_t> n = {10000, 100000, 1000000};
+  vector<size_t> dim = {2, 3, 5, 9};
+  vector<size_t> k = {1, 10, 100};
+  vector<int> threads = {1, 2, 4};
+  vector<string> dist = {"uniform", "clustered", "duplicate"};
+  size_t queries = 1000;
+  size_t bucket = 1;
+  int reps = 5;
+  unsigned seed = 42;
+  bool json = false;
+  bool dyn = false;
+};
+
+struct record
+{
+  string op, dist;
+  size_t n, dim, k;
+  int threads;
+  size_t queries;
+  double median_s, min_s;
+  size_t checksum;
+};
+
+template <typename T>
+vector<T> parse_list(const string& s)
+{
+  vector<T> res;
+  std::stringstream ss(s);
+  string item;
+  while (std::getline(ss, item, ','))
+  {
+    std::stringstream is(item);
+    double v;
+    if (!(is >> v)) throw std::invalid_argument("bad list: " + s);
+    res.push_back(static_cast<T>(v));
+  }
+  return res;
+}
+
+vector<string> parse_names(const string& s)
+{
+  vector<string> res;
+  std::stringstream ss(s);
+  string item;
+  while (std::getline(ss, item, ',')) res.push_back(item);
+  return res;
+}
+
+void usage()
+{
+  std::cerr <<
+    "usage: kdbench [options]\n"
+    "  --n LIST        number of points (default 1e4,1e5,1e6)\n"
+    "  --dim LIST      dimensions (default 2,3,5,9); above 9 only the\n"
+    "                  runtime-dimension path is run\n"
+    "  --k LIST        neighbors for kNN (default 1,10,100)\n"
+    "  --threads LIST  thread counts (default 1,2,4)\n"
+    "  --dist LIST     uniform,clustered,duplicate\n"
+    "  --queries N     queries per timing (default 1000)\n"
+    "  --bucket N      kd_sort bucket size (default 1)\n"
+    "  --reps N        repetitions per timing (default 5)\n"
+    "  --seed N        random seed (default 42)\n"
+    "  --json          emit JSON instead of CSV\n"
+    "  --dyn           also run the runtime-dimension path at dimensions 1-9\n";
+}
+
+options parse_args(int argc, char** argv)
+{
+  options opt;
+  for (int i = 1; i < argc; ++i)
+  {
+    string a = argv[i];
+    if (a == "--json") { opt.json = true; continue; }
+    if (a == "--dyn") { opt.dyn = true; continue; }
+    if (a == "--help" || a == "-h") { usage(); std::exit(0); }
+    if (i + 1 == argc) { usage(); std::exit(1); }
+    string v = argv[++i];
+    if (a == "--n") opt.n = parse_list<size_t>(v);
+    else if (a == "--dim") opt.dim = parse_list<size_t>(v);
+    else if (a == "--k") opt.k = parse_list<size_t>(v);
+    else if (a == "--threads") opt.threads = parse_list<int>(v);
+    else if (a == "--dist") opt.dist = parse_names(v);
+    else if (a == "--queries") opt.queries = parse_list<size_t>(v).at(0);
+    else if (a == "--bucket") opt.bucket = parse_list<size_t>(v).at(0);
+    else if (a == "--reps") opt.reps = parse_list<int>(v).at(0);
+    else if (a == "--seed") opt.seed = parse_list<unsigned>(v).at(0);
+    else { usage(); std::exit(1); }
+  }
+  // the clustering cases draw their checksums and centers from the data,
+  // and timings are the median of the repetitions
+  for (auto n : opt.n)
+    if (n == 0)
+      throw std::invalid_argument("number of points must be positive");
+  if (opt.reps < 1)
+    throw std::invalid_argument("repetitions must be positive");
+  return opt;
+}
+
+// Row-major coordinates of n points in dim dimensions
+vector<double> make_rows(const string& dist, size_t n, size_t dim,
+                         std::mt19937_64& rng)
+{
+  std::uniform_real_distribution<double> unif(0, 1);
+  vector<double> x(n * dim);
+  if (dist == "uniform")
+  {
+    for (auto& v : x) v = unif(rng);
+  }
+  else if (dist == "clustered")
+  {
+    const size_t nc = 20;
+    vector<double> centers(nc * dim);
+    for (auto& v : centers) v = unif(rng);
+    std::normal_distribution<double> noise(0, 0.01);
+    std::uniform_int_distribution<size_t> pick(0, nc - 1);
+    for (size_t i = 0; i != n; ++i)
+    {
+      auto c = &centers[pick(rng) * dim];
+      for (size_t j = 0; j != dim; ++j) x[i * dim + j] = c[j] + noise(rng);
+    }
+  }
+  else if (dist == "duplicate")
+  {
+    std::uniform_int_distribution<int> level(0, 3);
+    for (auto& v : x) v = level(rng) / 4.0;
+  }
+  else
+  {
+    throw std::invalid_argument("unknown distribution: " + dist);
+  }
+  return x;
+}
+
+template <size_t D>
+vector<array<double, D>> make_data(const string& dist, size_t n,
+                                   std::mt19937_64& rng)
+{
+  auto rows = make_rows(dist, n, D, rng);
+  vector<array<double, D>> x(n);
+  for (size_t i = 0; i != n; ++i)
+    std::copy(&rows[i * D], &rows[i * D] + D, x[i].begin());
+  return x;
+}
+
+template <typename F>
+std::pair<double, double> time_it(int reps, F f)
+{
+  vector<double> t;
+  for (int r = 0; r < reps; ++r)
+  {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto stop = std::chrono::steady_clock::now();
+    t.push_back(std::chrono::duration<double>(stop - start).count());
+  }
+  std::sort(t.begin(), t.end());
+  return std::make_pair(t[t.size() / 2], t.front());
+}
+
+// Runs f(i) for each query index in [0, nq) split over nthreads threads.
+// Each thread accumulates into its own slot so the returned checksum is
+// deterministic.
+template <typename F>
+size_t run_queries(size_t nq, int nthreads, F f)
+{
+  if (nthreads < 1) nthreads = 1;
+  vector<size_t> acc(nthreads, 0);
+  vector<std::thread> pool;
+  auto chunk = (nq + nthreads - 1) / nthreads;
+  for (int t = 0; t < nthreads; ++t)
+  {
+    auto lo = std::min(nq, t * chunk), hi = std::min(nq, lo + chunk);
+    auto body = [&, t, lo, hi]() {
+      for (auto i = lo; i != hi; ++i) acc[t] += f(i);
+    };
+    if (t + 1 == nthreads) body();
+    else pool.emplace_back(body);
+  }
+  for (auto& th : pool) th.join();
+  size_t sum = 0;
+  for (auto a : acc) sum += a;
+  return sum;
+}
+
+template <size_t D>
+void bench_dim(const options& opt, const string& dist, size_t n,
+               std::mt19937_64& rng, vector<record>& out)
+{
+  auto data = make_data<D>(dist, n, rng);
+  auto queries = make_data<D>("uniform", opt.queries, rng);
+  std::pair<double, double> t;
+  auto emit = [&](const string& op, size_t k, int threads, size_t nq,
+                  size_t checksum) {
+    out.push_back(record{op, dist, n, D, k, threads, nq,
+                         t.first, t.second, checksum});
+  };
+
+  vector<array<double, D>> x;
+  size_t cs = 0;
+  bucket_size b(opt.bucket);
+  t = time_it(opt.reps, [&]() {
+    x = data;
+    kd_sort(begin(x), end(x), b);
+  });
+  emit("kd_sort", 0, 1, 0, kd_is_sorted(begin(x), end(x), b));
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      x = data;
+      kd_sort_threaded(begin(x), end(x), nt, b);
+    });
+    emit("kd_sort_threaded", 0, nt, 0, kd_is_sorted(begin(x), end(x), b));
+  }
+  t = time_it(opt.reps, [&]() {
+    x = data;
+    lex_sort(begin(x), end(x));
+  });
+  emit("lex_sort", 0, 1, 0, std::is_sorted(begin(x), end(x)));
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      x = data;
+      lex_sort_threaded(begin(x), end(x), nt);
+    });
+    emit("lex_sort_threaded", 0, nt, 0, std::is_sorted(begin(x), end(x)));
+  }
+
+  x = data;
+  kd_sort(begin(x), end(x), b);
+  bool ok = false;
+  t = time_it(opt.reps, [&]() { ok = kd_is_sorted(begin(x), end(x), b); });
+  emit("kd_is_sorted", 0, 1, 0, ok);
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      ok = kd_is_sorted_threaded(begin(x), end(x), nt, b);
+    });
+    emit("kd_is_sorted_threaded", 0, nt, 0, ok);
+  }
+
+  auto nq = queries.size();
+
+  // Range boxes cover about 1% of the unit cube.
+  auto half = 0.5 * std::pow(0.01, 1.0 / D);
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      cs = run_queries(nq, nt, [&](size_t i) {
+        array<double, D> lower, upper;
+        for (size_t j = 0; j != D; ++j)
+        {
+          lower[j] = queries[i][j] - half;
+          upper[j] = queries[i][j] + half;
+        }
+        vector<array<double, D>> res;
+        kd_range_query(begin(x), end(x), lower, upper, back_inserter(res),
+                       b);
+        return res.size();
+      });
+    });
+    emit("kd_range_query", 0, nt, nq, cs);
+    t = time_it(opt.reps, [&]() {
+      cs = run_queries(nq, nt, [&](size_t i) {
+        return size_t(kd_nearest_neighbor(begin(x), end(x), queries[i], b) -
+                      begin(x));
+      });
+    });
+    emit("kd_nearest_neighbor", 1, nt, nq, cs);
+    for (auto k : opt.k)
+    {
+      t = time_it(opt.reps, [&]() {
+        cs = run_queries(nq, nt, [&](size_t i) {
+          vector<array<double, D>> res;
+          kd_nearest_neighbors(begin(x), end(x), queries[i], k,
+                               back_inserter(res), b);
+          return res.size();
+        });
+      });
+      emit("kd_nearest_neighbors", k, nt, nq, cs);
+    }
+  }
+
+  // Same queries through a van Emde Boas ordered pivot index
+  using index_t = kd_index<typename vector<array<double, D>>::iterator>;
+  t = time_it(opt.reps, [&]() {
+    index_t index(begin(x), end(x), b);
+    cs = index.m_nodes.size();
+  });
+  emit("kd_index", 0, 1, 0, cs);
+  index_t index(begin(x), end(x), b);
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      cs = run_queries(nq, nt, [&](size_t i) {
+        array<double, D> lower, upper;
+        for (size_t j = 0; j != D; ++j)
+        {
+          lower[j] = queries[i][j] - half;
+          upper[j] = queries[i][j] + half;
+        }
+        vector<array<double, D>> res;
+        kd_range_query(index, lower, upper, back_inserter(res));
+        return res.size();
+      });
+    });
+    emit("kd_range_query_index", 0, nt, nq, cs);
+    t = time_it(opt.reps, [&]() {
+      cs = run_queries(nq, nt, [&](size_t i) {
+        return size_t(kd_nearest_neighbor(index, queries[i]) - begin(x));
+      });
+    });
+    emit("kd_nearest_neighbor_index", 1, nt, nq, cs);
+    for (auto k : opt.k)
+    {
+      t = time_it(opt.reps, [&]() {
+        cs = run_queries(nq, nt, [&](size_t i) {
+          vector<array<double, D>> res;
+          kd_nearest_neighbors(index, queries[i], k, back_inserter(res));
+          return res.size();
+        });
+      });
+      emit("kd_nearest_neighbors_index", k, nt, nq, cs);
+    }
+  }
+
+  // Same index with per-node bounding boxes
+  t = time_it(opt.reps, [&]() {
+    index_t index(begin(x), end(x), b, true);
+    cs = index.m_boxes.size();
+  });
+  emit("kd_index_boxes", 0, 1, 0, cs);
+  index_t boxed(begin(x), end(x), b, true);
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      cs = run_queries(nq, nt, [&](size_t i) {
+        array<double, D> lower, upper;
+        for (size_t j = 0; j != D; ++j)
+        {
+          lower[j] = queries[i][j] - half;
+          upper[j] = queries[i][j] + half;
+        }
+        vector<array<double, D>> res;
+        kd_range_query(boxed, lower, upper, back_inserter(res));
+        return res.size();
+      });
+    });
+    emit("kd_range_query_boxes", 0, nt, nq, cs);
+    for (auto k : opt.k)
+    {
+      t = time_it(opt.reps, [&]() {
+        cs = run_queries(nq, nt, [&](size_t i) {
+          vector<array<double, D>> res;
+          kd_nearest_neighbors(boxed, queries[i], k, back_inserter(res));
+          return res.size();
+        });
+      });
+      emit("kd_nearest_neighbors_boxes", k, nt, nq, cs);
+    }
+  }
+
+  // Gaussian kernel density at the queries to within 1%, with the range
+  // box half-width as bandwidth
+  auto sorted_queries = queries;
+  kd_sort(begin(sorted_queries), end(sorted_queries));
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      vector<double> res;
+      kd_density_threaded(begin(x), end(x), begin(sorted_queries),
+                          end(sorted_queries), half, back_inserter(res),
+                          kernel_type::gaussian, 0.01, nt);
+      cs = res.size();
+    });
+    emit("kd_density", 0, nt, nq, cs);
+  }
+
+  // DBSCAN with a quarter of the range box half-width as radius
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      vector<size_t> res;
+      kd_dbscan_threaded(begin(x), end(x), half / 4, 5, back_inserter(res),
+                         nt, b);
+      cs = *std::max_element(begin(res), end(res));
+    });
+    emit("kd_dbscan", 0, nt, 0, cs);
+  }
+
+  // Ten k-means iterations from 16 evenly spaced rows; the checksum is the
+  // distance evaluations of the last iteration
+  vector<double> centers;
+  for (size_t c = 0; c != 16; ++c)
+    for (size_t j = 0; j != D; ++j)
+      centers.push_back(x[c * (x.size() / 16)][j]);
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      auto res = kd_kmeans_threaded(begin(x), end(x), centers.data(), 16, 10,
+                                    nt);
+      cs = res.distance_evals.back();
+    });
+    emit("kd_kmeans", 16, nt, 0, cs);
+  }
+
+  // Space-filling curve orderings built in place of the kd sort
+  using curve_t = curve_index<typename vector<array<double, D>>::iterator>;
+  for (auto c : {curve_type::hilbert, curve_type::morton})
+  {
+    string name = c == curve_type::hilbert ? "hilbert" : "morton";
+    for (auto nt : opt.threads)
+    {
+      t = time_it(opt.reps, [&]() {
+        x = data;
+        curve_t index(begin(x), end(x), c, nt);
+        cs = std::is_sorted(begin(index.m_keys), end(index.m_keys));
+      });
+      emit(name + "_index", 0, nt, 0, cs);
+    }
+    x = data;
+    curve_t index(begin(x), end(x), c);
+    for (auto nt : opt.threads)
+    {
+      t = time_it(opt.reps, [&]() {
+        cs = run_queries(nq, nt, [&](size_t i) {
+          array<double, D> lower, upper;
+          for (size_t j = 0; j != D; ++j)
+          {
+            lower[j] = queries[i][j] - half;
+            upper[j] = queries[i][j] + half;
+          }
+          vector<array<double, D>> res;
+          curve_range_query(index, lower, upper, back_inserter(res));
+          return res.size();
+        });
+      });
+      emit(name + "_range_query", 0, nt, nq, cs);
+      for (auto k : opt.k)
+      {
+        t = time_it(opt.reps, [&]() {
+          cs = run_queries(nq, nt, [&](size_t i) {
+            vector<array<double, D>> res;
+            curve_nearest_neighbors(index, queries[i], k, back_inserter(res));
+            return res.size();
+          });
+        });
+        emit(name + "_nearest_neighbors", k, nt, nq, cs);
+      }
+    }
+  }
+}
+
+// The runtime-dimension path on row-major data, which R uses above nine
+// columns. Ops are prefixed with dyn_ so that they can be set against the
+// templated ones at the same dimension.
+void bench_dyn(const options& opt, const string& dist, size_t n, size_t dim,
+               std::mt19937_64& rng, vector<record>& out)
+{
+  auto data = make_rows(dist, n, dim, rng);
+  auto queries = make_rows("uniform", opt.queries, dim, rng);
+  std::pair<double, double> t;
+  auto emit = [&](const string& op, size_t k, int threads, size_t nq,
+                  size_t checksum) {
+    out.push_back(record{"dyn_" + op, dist, n, dim, k, threads, nq,
+                         t.first, t.second, checksum});
+  };
+
+  vector<double> x;
+  dyn_rows<double> r(nullptr, n, dim);
+  bucket_size b(opt.bucket);
+  t = time_it(opt.reps, [&]() {
+    x = data;
+    r = dyn_rows<double>(x.data(), n, dim);
+    kd_sort(r, b);
+  });
+  emit("kd_sort", 0, 1, 0, kd_is_sorted(r, b));
+
+  auto nq = opt.queries;
+  auto half = 0.5 * std::pow(0.01, 1.0 / dim);
+  size_t cs = 0;
+  for (auto nt : opt.threads)
+  {
+    t = time_it(opt.reps, [&]() {
+      cs = run_queries(nq, nt, [&](size_t i) {
+        vector<double> lower(dim), upper(dim);
+        for (size_t j = 0; j != dim; ++j)
+        {
+          lower[j] = queries[i * dim + j] - half;
+          upper[j] = queries[i * dim + j] + half;
+        }
+        vector<size_t> res;
+        kd_range_query(r, lower.data(), upper.data(), back_inserter(res), b);
+        return res.size();
+      });
+    });
+    emit("kd_range_query", 0, nt, nq, cs);
+    t = time_it(opt.reps, [&]() {
+      cs = run_queries(nq, nt, [&](size_t i) {
+        return kd_nearest_neighbor(r, &queries[i * dim], b);
+      });
+    });
+    emit("kd_nearest_neighbor", 1, nt, nq, cs);
+    for (auto k : opt.k)
+    {
+      t = time_it(opt.reps, [&]() {
+        cs = run_queries(nq, nt, [&](size_t i) {
+          vector<size_t> res;
+          kd_nearest_neighbors(r, &queries[i * dim], k, back_inserter(res),
+                               b);
+          return res.size();
+        });
+      });
+      emit("kd_nearest_neighbors", k, nt, nq, cs);
+    }
+  }
+}
+
+void bench(const options& opt, const string& dist, size_t n, size_t dim,
+           std::mt19937_64& rng, vector<record>& out)
+{
+  if (dim == 0) throw std::invalid_argument("dimension must be positive");
+  if (opt.dyn && dim <= 9)
+  {
+    // the same data for both paths
+    auto copy = rng;
+    bench_dyn(opt, dist, n, dim, copy, out);
+  }
+  switch (dim)
+  {
+  case 1: bench_dim<1>(opt, dist, n, rng, out); break;
+  case 2: bench_dim<2>(opt, dist, n, rng, out); break;
+  case 3: bench_dim<3>(opt, dist, n, rng, out); break;
+  case 4: bench_dim<4>(opt, dist, n, rng, out); break;
+  case 5: bench_dim<5>(opt, dist, n, rng, out); break;
+  case 6: bench_dim<6>(opt, dist, n, rng, out); break;
+  case 7: bench_dim<7>(opt, dist, n, rng, out); break;
+  case 8: bench_dim<8>(opt, dist, n, rng, out); break;
+  case 9: bench_dim<9>(opt, dist, n, rng, out); break;
+  default: bench_dyn(opt, dist, n, dim, rng, out);
+  }
+}
+
+void write_csv(const vector<record>& rs)
+{
+  std::printf("op,dist,n,dim,k,threads,queries,median_s,min_s,checksum\n");
+  for (auto& r : rs)
+    std::printf("%s,%s,%zu,%zu,%zu,%d,%zu,%.9g,%.9g,%zu\n",
+                r.op.c_str(), r.dist.c_str(), r.n, r.dim, r.k, r.threads,
+                r.queries, r.median_s, r.min_s, r.checksum);
+}
+
+void write_json(const vector<record>& rs)
+{
+  std::printf("[\n");
+  for (size_t i = 0; i != rs.size(); ++i)
+  {
+    auto& r = rs[i];
+    std::printf("  {\"op\": \"%s\", \"dist\": \"%s\", \"n\": %zu, "
+                "\"dim\": %zu, \"k\": %zu, \"threads\": %d, "
+                "\"queries\": %zu, \"median_s\": %.9g, \"min_s\": %.9g, "
+                "\"checksum\": %zu}%s\n",
+                r.op.c_str(), r.dist.c_str(), r.n, r.dim, r.k, r.threads,
+                r.queries, r.median_s, r.min_s, r.checksum,
+                i + 1 == rs.size() ? "" : ",");
+  }
+  std::printf("]\n");
+}
+
+int main(int argc, char** argv)
+{
+  try
+  {
+    auto opt = parse_args(argc, argv);
+    std::mt19937_64 rng(opt.seed);
+    vector<record> out;
+    for (auto& dist : opt.dist)
+      for (auto n : opt.n)
+        for (auto dim : opt.dim)
+        {
+          std::cerr << dist << " n=" << n << " dim=" << dim << std::endl;
+          bench(opt, dist, n, dim, rng, out);
+        }
+    if (opt.json) write_json(out);
+    else write_csv(out);
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "kdbench: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,102 @@
+// Shared helpers for the standalone checks of the kdtools header library.
+//
+// Each check_*.cpp compares results through one code path against a
+// simpler one on random data and exits nonzero on any mismatch. Build and
+// run all of them with `make run` in this directory.
+
+#ifndef KDTOOLS_CHECK_H
+#define KDTOOLS_CHECK_H
+
+#include <kdtools.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+static int check_failures = 0;
+
+#define CHECK(cond)                                                   \
+  do {                                                                \
+    if (!(cond)) {                                                    \
+      ++check_failures;                                               \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n",               \
+                   __FILE__, __LINE__, #cond);                        \
+    }                                                                 \
+  } while (0)
+
+inline int check_report(const char* name)
+{
+  std::printf("%s: %s\n", name,
+              check_failures ? "FAILED" : "ok");
+  return check_failures ? 1 : 0;
+}
+
+// Draws n tuples. Coarse data takes each coordinate from five values so
+// that most tuples have copies; a nan_rate above zero blanks coordinates.
+template <size_t N>
+std::vector<std::array<double, N>>
+random_tuples(size_t n, bool coarse, double nan_rate, std::mt19937& g)
+{
+  std::uniform_real_distribution<double> u;
+  std::uniform_int_distribution<int> c(0, 4);
+  std::vector<std::array<double, N>> x(n);
+  for (auto& t : x)
+    for (auto& v : t)
+    {
+      v = coarse ? c(g) / 4.0 : u(g);
+      if (u(g) < nan_rate) v = std::numeric_limits<double>::quiet_NaN();
+    }
+  return x;
+}
+
+// Orders tuples by the bits of their coordinates, so NaN sorts too
+struct bits_less
+{
+  template <size_t N>
+  bool operator()(const std::array<double, N>& a,
+                  const std::array<double, N>& b) const
+  {
+    for (size_t j = 0; j != N; ++j)
+    {
+      std::uint64_t u, v;
+      std::memcpy(&u, &a[j], sizeof u);
+      std::memcpy(&v, &b[j], sizeof v);
+      if (u != v) return u < v;
+    }
+    return false;
+  }
+};
+
+template <typename T>
+bool same_set(std::vector<T> a, std::vector<T> b)
+{
+  std::sort(a.begin(), a.end(), bits_less());
+  std::sort(b.begin(), b.end(), bits_less());
+  return a.size() == b.size() &&
+    std::equal(a.begin(), a.end(), b.begin(), [](const T& x, const T& y){
+      return !bits_less()(x, y) && !bits_less()(y, x);
+    });
+}
+
+// Distances of rows with NaN rank after every number, as in the queries
+inline double rank_dist(double d)
+{
+  return std::isnan(d) ? std::numeric_limits<double>::infinity() : d;
+}
+
+template <typename T>
+std::vector<double> distances(const std::vector<T>& x, const T& value)
+{
+  std::vector<double> d;
+  for (auto& t : x) d.push_back(kdtools::detail::l2dist(t, value));
+  std::sort(d.begin(), d.end());
+  return d;
+}
+
+#endif // KDTOOLS_CHECK_H
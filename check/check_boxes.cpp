@@ -0,0 +1,90 @@
+// Queries through a kd_index with node bounding boxes must give the same
+// results as without them, also when rows hold NaN and their boxes are
+// unbounded, and when whole subtrees fall inside the query.
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <size_t N>
+void check_boxes(size_t n, bool coarse, double nan_rate, size_t bucket,
+                 std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  using Iter = typename std::vector<T>::iterator;
+  auto x = random_tuples<N>(n, coarse, nan_rate, g);
+  auto b = bucket_size(bucket);
+  kd_sort(x.begin(), x.end(), b);
+  kd_index<Iter> plain(x.begin(), x.end(), b),
+    boxed(x.begin(), x.end(), b, true);
+  CHECK(plain.boxes() == nullptr);
+  CHECK((boxed.boxes() == nullptr) == boxed.m_nodes.empty());
+
+  auto queries = random_tuples<N>(30, coarse, 0, g);
+  std::vector<std::pair<T, T>> ranges;
+  for (auto& q : queries)
+  {
+    T lower, upper;
+    for (size_t j = 0; j != N; ++j)
+    {
+      lower[j] = q[j] - 0.3;
+      upper[j] = q[j] + 0.3;
+    }
+    ranges.emplace_back(lower, upper);
+  }
+  // the lower corner holds whole subtrees; the last query holds everything
+  T lower, upper;
+  lower.fill(0);
+  upper.fill(0.5);
+  ranges.emplace_back(lower, upper);
+  lower.fill(-1);
+  upper.fill(2);
+  ranges.emplace_back(lower, upper);
+
+  for (auto& r : ranges)
+  {
+    std::vector<T> a, c;
+    kd_range_query(plain, r.first, r.second, std::back_inserter(a));
+    kd_range_query(boxed, r.first, r.second, std::back_inserter(c));
+    CHECK(same_set(a, c));
+  }
+  for (auto& q : queries)
+  {
+    std::vector<T> a, c;
+    kd_radius_query(plain, q, 0.4, std::back_inserter(a));
+    kd_radius_query(boxed, q, 0.4, std::back_inserter(c));
+    CHECK(same_set(a, c));
+    if (nan_rate > 0) continue;
+    a.clear();
+    c.clear();
+    kd_nearest_neighbors(plain, q, 10, std::back_inserter(a));
+    kd_nearest_neighbors(boxed, q, 10, std::back_inserter(c));
+    CHECK(distances(a, q) == distances(c, q));
+  }
+
+  // make sure the whole-subtree path is taken on complete data
+  if (nan_rate == 0 && !coarse && n >= 5000 && N <= 3)
+  {
+    auto q = detail::coords(ranges[ranges.size() - 2].first,
+                            ranges[ranges.size() - 2].second);
+    size_t inside = 0;
+    for (size_t k = 0; k != boxed.m_nodes.size(); ++k)
+      inside += detail::box_inside<N>(boxed.boxes() + 2 * N * k, q.data());
+    CHECK(inside > 0);
+  }
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  for (size_t n : {0, 1, 31, 500, 5000})
+    for (bool coarse : {false, true})
+      for (double nan_rate : {0.0, 0.05})
+        for (size_t bucket : {1, 8})
+        {
+          check_boxes<2>(n, coarse, nan_rate, bucket, g);
+          check_boxes<3>(n, coarse, nan_rate, bucket, g);
+          check_boxes<11>(n, coarse, nan_rate, bucket, g);
+        }
+  return check_report("check_boxes");
+}
@@ -0,0 +1,72 @@
+// Queries through one query_context reused across calls must return what
+// the output iterator overloads write, including after a query that
+// returned more rows or asked for more neighbors than the next.
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <typename T>
+bool same_sequence(const std::vector<T>& a, const std::vector<T>& b)
+{
+  return a.size() == b.size() &&
+    std::equal(a.begin(), a.end(), b.begin(), [](const T& x, const T& y){
+      return !bits_less()(x, y) && !bits_less()(y, x);
+    });
+}
+
+template <size_t N>
+void check_context(size_t n, bool coarse, size_t bucket, std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  using Iter = typename std::vector<T>::iterator;
+  auto x = random_tuples<N>(n, coarse, 0, g);
+  auto b = bucket_size(bucket);
+  kd_sort(x.begin(), x.end(), b);
+  auto queries = random_tuples<N>(20, coarse, 0, g);
+  query_context<Iter> context;
+  std::uniform_real_distribution<double> u(0, 0.5);
+  // neighbor counts on both sides of the fixed capacity of the queue
+  std::uniform_int_distribution<size_t> k(0, 100);
+  for (auto& q : queries)
+  {
+    T lower, upper;
+    for (size_t j = 0; j != N; ++j)
+    {
+      lower[j] = q[j] - u(g);
+      upper[j] = q[j] + u(g);
+    }
+    std::vector<T> a;
+    kd_range_query(x.begin(), x.end(), lower, upper, std::back_inserter(a), b);
+    CHECK(same_sequence(kd_range_query(x.begin(), x.end(), lower, upper,
+                                       context, b), a));
+
+    auto radius = u(g);
+    a.clear();
+    kd_radius_query(x.begin(), x.end(), q, radius, std::back_inserter(a), b);
+    CHECK(same_sequence(kd_radius_query(x.begin(), x.end(), q, radius,
+                                        context, b), a));
+
+    auto m = k(g);
+    a.clear();
+    kd_nearest_neighbors(x.begin(), x.end(), q, m, std::back_inserter(a), b);
+    auto& res = kd_nearest_neighbors(x.begin(), x.end(), q, m, context, b);
+    CHECK(res.size() == std::min(m, n));
+    CHECK(same_sequence(res, a));
+    CHECK(&context.results() == &res);
+  }
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  for (size_t n : {0, 1, 31, 500, 3000})
+    for (bool coarse : {false, true})
+      for (size_t bucket : {1, 8})
+      {
+        check_context<1>(n, coarse, bucket, g);
+        check_context<2>(n, coarse, bucket, g);
+        check_context<5>(n, coarse, bucket, g);
+      }
+  return check_report("check_context");
+}
@@ -0,0 +1,49 @@
+// Hilbert keys of every cell of a full grid must be a permutation of
+// 0..cells-1, and cells with consecutive keys must be unit-adjacent.
+
+#include "check.h"
+
+using namespace kdtools;
+
+void check_hilbert(size_t nd, unsigned bits)
+{
+  std::vector<double> lower(nd, 0), upper(nd, 1);
+  detail::curve_grid g(lower, upper);
+  size_t side = size_t(1) << bits, cells = size_t(1) << (nd * bits);
+  std::vector<std::vector<std::uint32_t>> at(cells);
+  std::vector<std::uint32_t> x(nd);
+  for (size_t i = 0; i != cells; ++i)
+  {
+    for (size_t j = 0, r = i; j != nd; ++j, r /= side)
+      x[j] = static_cast<std::uint32_t>(r % side);
+    auto k = detail::curve_key(g, curve_type::hilbert, x.data(), bits);
+    CHECK(k < cells);
+    if (k >= cells) return;
+    CHECK(at[k].empty());
+    at[k] = x;
+  }
+  for (size_t k = 1; k != cells; ++k)
+  {
+    size_t steps = 0;
+    for (size_t j = 0; j != nd; ++j)
+    {
+      auto a = at[k - 1][j], b = at[k][j];
+      steps += a < b ? b - a : a - b;
+    }
+    CHECK(steps == 1);
+  }
+}
+
+int main()
+{
+  for (unsigned bits = 1; bits <= 6; ++bits)
+  {
+    check_hilbert(1, bits);
+    check_hilbert(2, bits);
+    check_hilbert(3, bits);
+  }
+  check_hilbert(4, 3);
+  check_hilbert(5, 2);
+  check_hilbert(6, 2);
+  return check_report("check_curve");
+}
@@ -0,0 +1,52 @@
+// Exact-match lookups through a kd_hash_index must return the offsets of
+// every copy, as found by a scan of the range.
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <size_t N>
+bool same_tuple(const std::array<double, N>& a, const std::array<double, N>& b)
+{
+  for (size_t j = 0; j != N; ++j)
+    if (a[j] != b[j] && !(a[j] != a[j] && b[j] != b[j])) return false;
+  return true;
+}
+
+template <size_t N>
+void check_hash(size_t n, bool coarse, double nan_rate, bool sorted,
+                std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  auto x = random_tuples<N>(n, coarse, nan_rate, g);
+  // the opposite zero must match too
+  for (size_t i = 0; i < n; i += 7) x[i][0] = (i / 7) % 2 ? 0.0 : -0.0;
+  if (sorted) kd_sort(x.begin(), x.end());
+  kd_hash_index<typename std::vector<T>::iterator> index(x.begin(), x.end());
+  auto queries = random_tuples<N>(50, coarse, nan_rate, g);
+  queries.insert(queries.end(), x.begin(), x.end());
+  for (auto& q : queries)
+  {
+    std::vector<size_t> copies;
+    for (size_t i = 0; i != n; ++i)
+      if (same_tuple(x[i], q)) copies.push_back(i);
+    auto r = kd_equal_range(index, q);
+    CHECK(std::vector<size_t>(r.first, r.second) == copies);
+    CHECK(kd_binary_search(index, q) == !copies.empty());
+  }
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  for (size_t n : {0, 1, 7, 500, 5000})
+    for (bool coarse : {false, true})
+      for (double nan_rate : {0.0, 0.1})
+        for (bool sorted : {false, true})
+        {
+          check_hash<1>(n, coarse, nan_rate, sorted, g);
+          check_hash<3>(n, coarse, nan_rate, sorted, g);
+          check_hash<11>(n, coarse, nan_rate, sorted, g);
+        }
+  return check_report("check_hash");
+}
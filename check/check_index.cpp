@@ -0,0 +1,58 @@
+// Queries through a kd_index must match the same queries on the range
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <size_t N>
+void check_index(size_t n, bool coarse, size_t bucket, std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  auto x = random_tuples<N>(n, coarse, 0, g);
+  kd_sort(x.begin(), x.end(), bucket_size(bucket));
+  kd_index<typename std::vector<T>::iterator>
+    index(x.begin(), x.end(), bucket_size(bucket));
+  auto queries = random_tuples<N>(50, coarse, 0, g);
+  for (auto& q : queries)
+  {
+    T lower, upper;
+    for (size_t j = 0; j != N; ++j)
+    {
+      lower[j] = q[j] - 0.3;
+      upper[j] = q[j] + 0.3;
+    }
+    std::vector<T> a, b;
+    kd_range_query(x.begin(), x.end(), lower, upper, std::back_inserter(a),
+                   bucket_size(bucket));
+    kd_range_query(index, lower, upper, std::back_inserter(b));
+    CHECK(same_set(a, b));
+    for (size_t k : {1, 5, 40})
+    {
+      a.clear();
+      b.clear();
+      kd_nearest_neighbors(x.begin(), x.end(), q, k, std::back_inserter(a),
+                           bucket_size(bucket));
+      kd_nearest_neighbors(index, q, k, std::back_inserter(b));
+      CHECK(a.size() == b.size());
+      CHECK(distances(a, q) == distances(b, q));
+    }
+    CHECK(kd_binary_search(x.begin(), x.end(), q, bucket_size(bucket)) ==
+          kd_binary_search(index, q));
+  }
+  // every stored tuple, including all copies of duplicates, must be found
+  for (auto& t : x) CHECK(kd_binary_search(index, t));
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  for (size_t n : {0, 1, 7, 31, 500, 5000})
+    for (bool coarse : {false, true})
+      for (size_t bucket : {1, 8})
+      {
+        check_index<1>(n, coarse, bucket, g);
+        check_index<3>(n, coarse, bucket, g);
+        check_index<11>(n, coarse, bucket, g);
+      }
+  return check_report("check_index");
+}
@@ -0,0 +1,124 @@
+// kd_kmeans must find the same centers, sizes and labels as a plain
+// Lloyd's iteration over the rows, which gives ties to the first center.
+// Coarse data keeps every sum exact, so both must agree bit for bit.
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <size_t N>
+kd_kmeans_result lloyd(const std::vector<std::array<double, N>>& x,
+                       const std::vector<double>& init, size_t k,
+                       size_t max_iter)
+{
+  kd_kmeans_result res;
+  res.centers = init;
+  auto assign = [&](std::vector<double>& sums, std::vector<size_t>& counts){
+    res.labels.assign(x.size(), size_t(-1));
+    sums.assign(k * N, 0);
+    counts.assign(k, 0);
+    for (size_t i = 0; i != x.size(); ++i)
+    {
+      if (std::any_of(x[i].begin(), x[i].end(),
+                      [](double v){ return v != v; })) continue;
+      size_t best = 0;
+      auto best_d2 = std::numeric_limits<double>::infinity();
+      for (size_t c = 0; c != k; ++c)
+      {
+        double d2 = 0;
+        for (size_t j = 0; j != N; ++j)
+        {
+          double d = res.centers[c * N + j] - x[i][j];
+          d2 += d * d;
+        }
+        if (d2 < best_d2)
+        {
+          best = c;
+          best_d2 = d2;
+        }
+      }
+      res.labels[i] = best;
+      ++counts[best];
+      for (size_t j = 0; j != N; ++j) sums[best * N + j] += x[i][j];
+    }
+  };
+  std::vector<double> sums;
+  std::vector<size_t> counts;
+  while (res.iterations < max_iter)
+  {
+    assign(sums, counts);
+    ++res.iterations;
+    auto next = res.centers;
+    for (size_t c = 0; c != k; ++c)
+      if (counts[c])
+        for (size_t j = 0; j != N; ++j)
+          next[c * N + j] = sums[c * N + j] / counts[c];
+    if (next == res.centers)
+    {
+      res.converged = true;
+      break;
+    }
+    res.centers.swap(next);
+  }
+  assign(sums, counts);
+  res.sizes = counts;
+  return res;
+}
+
+template <size_t N>
+void check_same(const std::vector<std::array<double, N>>& x,
+                const std::vector<double>& init, size_t k, size_t max_iter)
+{
+  auto a = kd_kmeans(x.begin(), x.end(), init.data(), k, max_iter);
+  auto b = lloyd(x, init, k, max_iter);
+  CHECK(a.centers == b.centers);
+  CHECK(a.sizes == b.sizes);
+  CHECK(a.labels == b.labels);
+  CHECK(a.iterations == b.iterations);
+  CHECK(a.converged == b.converged);
+  auto c = kd_kmeans_threaded(x.begin(), x.end(), init.data(), k, max_iter,
+                              4);
+  CHECK(c.centers == a.centers);
+  CHECK(c.labels == a.labels);
+}
+
+// Centers are drawn from the grid, with copies, so that many rows and
+// whole cells sit at equal distances from two or more centers
+template <size_t N>
+void check_kmeans(size_t n, size_t k, double nan_rate, std::mt19937& g)
+{
+  auto x = random_tuples<N>(n, true, nan_rate, g);
+  kd_sort(x.begin(), x.end());
+  auto grid = random_tuples<N>(k, true, 0, g);
+  std::vector<double> init;
+  for (size_t c = 0; c != k; ++c)
+    init.insert(init.end(), grid[c / 2 * 2].begin(), grid[c / 2 * 2].end());
+  for (size_t max_iter : {1, 100}) check_same(x, init, k, max_iter);
+  init.clear();
+  for (auto& t : grid)
+    for (auto& v : t) init.push_back(v + 0.125);
+  check_same(x, init, k, 100);
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  // 20 rows at 1 and 20 at 1.5 are tied or nearer to the second center:
+  // one step must move the centers to 1 and 1.5
+  std::vector<std::array<double, 1>> x(40);
+  for (size_t i = 0; i != 40; ++i) x[i][0] = i < 20 ? 1 : 1.5;
+  std::vector<double> init = {0, 2};
+  auto r = kd_kmeans(x.begin(), x.end(), init.data(), 2, 1);
+  CHECK(r.centers == std::vector<double>({1, 1.5}));
+  CHECK(r.sizes == std::vector<size_t>({20, 20}));
+  check_same(x, init, 2, 1);
+  for (size_t n : {1, 40, 1000, 20000})
+    for (size_t k : {1, 2, 5, 12})
+      for (double nan_rate : {0.0, 0.05})
+      {
+        check_kmeans<1>(n, k, nan_rate, g);
+        check_kmeans<2>(n, k, nan_rate, g);
+        check_kmeans<5>(n, k, nan_rate, g);
+      }
+  return check_report("check_kmeans");
+}
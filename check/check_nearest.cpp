@@ -0,0 +1,166 @@
+// Nearest neighbors must have the distances of the nearest rows a scan
+// finds on data with NaN. Rows with NaN have no distance and rank after
+// every number, so they are returned only when too few complete rows
+// remain.
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <size_t N>
+using rows_t = std::vector<std::array<double, N>>;
+
+struct l2_dist
+{
+  template <typename T>
+  double operator()(const T& a, const T& b) const
+  {
+    return detail::l2dist(a, b);
+  }
+};
+
+// The sorted distances of rows to q, those of rows with NaN last
+template <size_t N, typename Dist = l2_dist>
+std::vector<double> nearest_dists(const rows_t<N>& x,
+                                  const std::array<double, N>& q,
+                                  Dist dist = Dist())
+{
+  std::vector<double> d;
+  for (auto& t : x) d.push_back(rank_dist(dist(t, q)));
+  std::sort(d.begin(), d.end());
+  return d;
+}
+
+// The n smallest distances to q found by a scan
+template <size_t N, typename Dist = l2_dist>
+std::vector<double> scan_nearest(const rows_t<N>& x,
+                                 const std::array<double, N>& q, size_t n,
+                                 Dist dist = Dist())
+{
+  auto d = nearest_dists(x, q, dist);
+  if (d.size() > n) d.resize(n);
+  return d;
+}
+
+template <size_t N>
+void check_nearest(size_t n, bool coarse, double nan_rate, std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  using Iter = typename rows_t<N>::iterator;
+  auto x = random_tuples<N>(n, coarse, nan_rate, g);
+  kd_sort(x.begin(), x.end());
+  auto h = x;
+  curve_index<Iter> curve(h.begin(), h.end());
+  kd_index<Iter> plain(x.begin(), x.end()),
+    boxed(x.begin(), x.end(), bucket_size(8), true);
+  query_context<Iter> context;
+  std::vector<double> flat;
+  for (auto& t : x) flat.insert(flat.end(), t.begin(), t.end());
+  dyn_rows<double> r(flat.data(), n, N);
+  kd_sort(r);
+  auto y = x;
+  auto axes = kd_sort_adaptive(y.begin(), y.end());
+  auto row = [&](size_t i){
+    T t{};
+    std::copy(r.row(i), r.row(i) + N, t.begin());
+    return t;
+  };
+  T box;
+  box.fill(1);
+  auto periodic = [&](const T& a, const T& b){
+    return detail::l2dist_periodic(a, b, box);
+  };
+
+  // a row's own coordinates must find at least that row
+  auto queries = random_tuples<N>(10, coarse, 0, g);
+  for (size_t i = 0; i < n; i += 1 + n / 20) queries.push_back(x[i]);
+  for (auto& q : queries)
+    for (size_t k : {1, 5, 50})
+    {
+      auto ans = scan_nearest(x, q, k);
+      rows_t<N> res;
+      kd_nearest_neighbors(x.begin(), x.end(), q, k, std::back_inserter(res));
+      CHECK(nearest_dists(res, q) == ans);
+      CHECK(nearest_dists(kd_nearest_neighbors(x.begin(), x.end(), q, k,
+                                               context), q) == ans);
+      for (auto index : {&plain, &boxed})
+      {
+        res.clear();
+        kd_nearest_neighbors(*index, q, k, std::back_inserter(res));
+        CHECK(nearest_dists(res, q) == ans);
+      }
+      std::vector<size_t> idx;
+      kd_nearest_neighbors(r, q.data(), k, std::back_inserter(idx));
+      res.clear();
+      for (auto i : idx) res.push_back(row(i));
+      CHECK(nearest_dists(res, q) == ans);
+      res.clear();
+      kd_nearest_neighbors_adaptive(y.begin(), y.end(), axes.data(), q, k,
+                                    std::back_inserter(res));
+      CHECK(nearest_dists(res, q) == ans);
+      res.clear();
+      curve_nearest_neighbors(curve, q, k, std::back_inserter(res));
+      CHECK(nearest_dists(res, q) == ans);
+      res.clear();
+      kd_nearest_neighbors_periodic(x.begin(), x.end(), q, k, box,
+                                    std::back_inserter(res));
+      CHECK(nearest_dists(res, q, periodic) ==
+              scan_nearest(x, q, k, periodic));
+    }
+  // a single nearest neighbor, found whenever there are rows
+  auto nearest = [&](Iter nn, const T& q){
+    return nn == x.end() ? n == 0 :
+      rank_dist(detail::l2dist(*nn, q)) == scan_nearest(x, q, 1)[0];
+  };
+  for (auto& q : queries)
+  {
+    CHECK(nearest(kd_nearest_neighbor(x.begin(), x.end(), q), q));
+    CHECK(nearest(kd_nearest_neighbor(plain, q), q));
+    auto it = kd_nearest_neighbor_adaptive(y.begin(), y.end(), axes.data(), q);
+    CHECK(it == y.end() ? n == 0 : rank_dist(detail::l2dist(*it, q)) ==
+            scan_nearest(x, q, 1)[0]);
+    auto i = kd_nearest_neighbor(r, q.data());
+    CHECK(i == n ? n == 0 : rank_dist(detail::l2dist(row(i), q)) ==
+            scan_nearest(x, q, 1)[0]);
+  }
+}
+
+// Longitude and latitude in degrees, with NaN blanking coordinates
+void check_geo(size_t n, double nan_rate, std::mt19937& g)
+{
+  using T = std::array<double, 2>;
+  std::uniform_real_distribution<double> u;
+  rows_t<2> x(n);
+  for (auto& t : x)
+  {
+    t[0] = 360 * u(g) - 180;
+    t[1] = 180 * u(g) - 90;
+    for (auto& v : t)
+      if (u(g) < nan_rate) v = std::numeric_limits<double>::quiet_NaN();
+  }
+  kd_sort(x.begin(), x.end());
+  auto geo = [](const T& a, const T& b){ return detail::geo_dist(a, b); };
+  for (size_t i = 0; i < n; i += 1 + n / 20)
+    for (size_t k : {1, 5, 50})
+    {
+      rows_t<2> res;
+      kd_nearest_neighbors_geo(x.begin(), x.end(), x[i], k,
+                               std::back_inserter(res));
+      CHECK(nearest_dists(res, x[i], geo) == scan_nearest(x, x[i], k, geo));
+    }
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  for (size_t n : {0, 1, 40, 3000})
+    for (bool coarse : {false, true})
+      for (double nan_rate : {0.0, 0.2, 0.9})
+      {
+        check_nearest<1>(n, coarse, nan_rate, g);
+        check_nearest<2>(n, coarse, nan_rate, g);
+        check_nearest<4>(n, coarse, nan_rate, g);
+        check_geo(n, nan_rate, g);
+      }
+  return check_report("check_nearest");
+}
@@ -0,0 +1,113 @@
+// Polytope queries must return the rows a scan finds inside every
+// half-space, leaving out rows holding NaN also when their cell lies
+// inside the polytope and is emitted whole. The cells hold only if the
+// sorts place NaN consistently, after every number.
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <size_t N>
+std::vector<std::array<double, N>>
+scan_polytope(const std::vector<std::array<double, N>>& x,
+              const std::vector<double>& a, const std::vector<double>& b)
+{
+  std::vector<std::array<double, N>> res;
+  for (auto& t : x)
+  {
+    bool inside = !kdtools::detail::row_has_nan(t, N);
+    for (size_t k = 0; k != b.size(); ++k)
+    {
+      double s = 0;
+      for (size_t j = 0; j != N; ++j) s += a[k * N + j] * t[j];
+      if (!(s <= b[k])) inside = false;
+    }
+    if (inside) res.push_back(t);
+  }
+  return res;
+}
+
+template <size_t N>
+void check_polytope(size_t n, bool coarse, double nan_rate, size_t bucket,
+                    std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  auto x = random_tuples<N>(n, coarse, nan_rate, g);
+  auto bkt = bucket_size(bucket);
+  kd_sort(x.begin(), x.end(), bkt);
+  CHECK(kd_is_sorted(x.begin(), x.end(), bkt));
+  auto y = random_tuples<N>(n, coarse, nan_rate, g);
+  auto axes = kd_sort_adaptive(y.begin(), y.end(), bkt);
+  std::vector<double> flat;
+  for (auto& t : y) flat.insert(flat.end(), t.begin(), t.end());
+  dyn_rows<double> r(flat.data(), n, N);
+  kd_sort(r, bkt);
+  CHECK(kd_is_sorted(r, bkt));
+
+  // boxes, one holding everything, and random half-spaces
+  std::uniform_real_distribution<double> u(-1, 1);
+  std::vector<std::pair<std::vector<double>, std::vector<double>>> polys;
+  for (double lo : {-1.0, 0.0})
+    for (double hi : {2.0, 0.5})
+    {
+      std::vector<double> a(2 * N * N, 0), b(2 * N);
+      for (size_t j = 0; j != N; ++j)
+      {
+        a[j * N + j] = 1;
+        b[j] = hi;
+        a[(N + j) * N + j] = -1;
+        b[N + j] = -lo;
+      }
+      polys.emplace_back(a, b);
+    }
+  polys.emplace_back(std::vector<double>(), std::vector<double>());
+  for (int i = 0; i != 5; ++i)
+  {
+    std::vector<double> a(3 * N), b(3);
+    for (auto& v : a) v = u(g);
+    for (auto& v : b) v = u(g) + 1;
+    polys.emplace_back(a, b);
+  }
+
+  for (auto& p : polys)
+  {
+    auto& a = p.first;
+    auto& b = p.second;
+    auto ans = scan_polytope(x, a, b);
+    std::vector<T> res;
+    kd_polytope_query(x.begin(), x.end(), a.data(), b.data(), b.size(),
+                      std::back_inserter(res), bkt);
+    CHECK(same_set(res, ans));
+    std::vector<size_t> idx;
+    kd_polytope_query(r, a.data(), b.data(), b.size(),
+                      std::back_inserter(idx), bkt);
+    res.clear();
+    for (auto i : idx)
+    {
+      T t;
+      std::copy(r.row(i), r.row(i) + N, t.begin());
+      res.push_back(t);
+    }
+    CHECK(same_set(res, scan_polytope(y, a, b)));
+    res.clear();
+    kd_polytope_query_adaptive(y.begin(), y.end(), axes.data(), a.data(),
+                               b.data(), b.size(), std::back_inserter(res),
+                               bkt);
+    CHECK(same_set(res, scan_polytope(y, a, b)));
+  }
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  for (size_t n : {0, 1, 100, 5000})
+    for (bool coarse : {false, true})
+      for (double nan_rate : {0.0, 0.02, 0.3})
+        for (size_t bucket : {1, 16})
+        {
+          check_polytope<1>(n, coarse, nan_rate, bucket, g);
+          check_polytope<2>(n, coarse, nan_rate, bucket, g);
+          check_polytope<5>(n, coarse, nan_rate, bucket, g);
+        }
+  return check_report("check_polytope");
+}
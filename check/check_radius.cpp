@@ -0,0 +1,125 @@
+// Radius queries must return the rows a scan finds within the radius on
+// data with NaN. The sorts place NaN after every number, so a pivot with a
+// NaN coordinate has every numeric row on its left.
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <size_t N, typename Dist>
+std::vector<std::array<double, N>>
+scan_radius(const std::vector<std::array<double, N>>& x,
+            const std::array<double, N>& q, double radius, Dist dist)
+{
+  std::vector<std::array<double, N>> res;
+  for (auto& t : x)
+    if (dist(t, q) <= radius) res.push_back(t);
+  return res;
+}
+
+template <size_t N>
+void check_radius(size_t n, bool coarse, double nan_rate, size_t bucket,
+                  std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  auto x = random_tuples<N>(n, coarse, nan_rate, g);
+  auto bkt = bucket_size(bucket);
+  kd_sort(x.begin(), x.end(), bkt);
+  kd_index<typename std::vector<T>::iterator>
+    plain(x.begin(), x.end(), bkt), boxed(x.begin(), x.end(), bkt, true);
+  auto y = random_tuples<N>(n, coarse, nan_rate, g);
+  auto axes = kd_sort_adaptive(y.begin(), y.end(), bkt);
+  auto z = random_tuples<N>(n, coarse, nan_rate, g);
+  std::vector<double> flat;
+  for (auto& t : z) flat.insert(flat.end(), t.begin(), t.end());
+  dyn_rows<double> r(flat.data(), n, N);
+  kd_sort(r, bkt);
+  T box;
+  box.fill(1);
+  auto periodic = [&](const T& a, const T& b){
+    return detail::l2dist_periodic(a, b, box);
+  };
+
+  // a row's own coordinates must find at least that row
+  auto queries = random_tuples<N>(10, coarse, 0, g);
+  for (size_t i = 0; i < n; i += 1 + n / 20) queries.push_back(x[i]);
+  auto l2 = [](const T& a, const T& b){ return detail::l2dist(a, b); };
+  for (auto& q : queries)
+    for (double radius : {0.0, 0.1, 0.5})
+    {
+      auto ans = scan_radius(x, q, radius, l2);
+      std::vector<T> res;
+      kd_radius_query(x.begin(), x.end(), q, radius, std::back_inserter(res),
+                      bkt);
+      CHECK(same_set(res, ans));
+      res.clear();
+      kd_radius_query(plain, q, radius, std::back_inserter(res));
+      CHECK(same_set(res, ans));
+      res.clear();
+      kd_radius_query(boxed, q, radius, std::back_inserter(res));
+      CHECK(same_set(res, ans));
+      res.clear();
+      kd_radius_query_periodic(x.begin(), x.end(), q, radius, box,
+                               std::back_inserter(res), bkt);
+      CHECK(same_set(res, scan_radius(x, q, radius, periodic)));
+      res.clear();
+      kd_radius_query_adaptive(y.begin(), y.end(), axes.data(), q, radius,
+                               std::back_inserter(res), bkt);
+      CHECK(same_set(res, scan_radius(y, q, radius, l2)));
+      std::vector<size_t> idx;
+      kd_radius_query(r, q.data(), radius, std::back_inserter(idx), bkt);
+      res.clear();
+      for (auto i : idx)
+      {
+        T t;
+        std::copy(r.row(i), r.row(i) + N, t.begin());
+        res.push_back(t);
+      }
+      CHECK(same_set(res, scan_radius(z, q, radius, l2)));
+    }
+}
+
+// Longitude and latitude in degrees, with NaN blanking coordinates
+void check_geo(size_t n, double nan_rate, size_t bucket, std::mt19937& g)
+{
+  using T = std::array<double, 2>;
+  std::uniform_real_distribution<double> u;
+  std::vector<T> x(n);
+  for (auto& t : x)
+  {
+    t[0] = 360 * u(g) - 180;
+    t[1] = 180 * u(g) - 90;
+    for (auto& v : t)
+      if (u(g) < nan_rate) v = std::numeric_limits<double>::quiet_NaN();
+  }
+  auto bkt = bucket_size(bucket);
+  kd_sort(x.begin(), x.end(), bkt);
+  auto geo = [](const T& a, const T& b){ return detail::geo_dist(a, b); };
+  for (size_t i = 0; i < n; i += 1 + n / 20)
+  {
+    auto& q = x[i];
+    for (double radius : {0.0, 0.05, 0.5})
+    {
+      std::vector<T> res;
+      kd_radius_query_geo(x.begin(), x.end(), q, radius,
+                          std::back_inserter(res), bkt);
+      CHECK(same_set(res, scan_radius(x, q, radius, geo)));
+    }
+  }
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  for (size_t n : {0, 1, 100, 3000})
+    for (bool coarse : {false, true})
+      for (double nan_rate : {0.0, 0.05, 0.3})
+        for (size_t bucket : {1, 16})
+        {
+          check_radius<1>(n, coarse, nan_rate, bucket, g);
+          check_radius<2>(n, coarse, nan_rate, bucket, g);
+          check_radius<4>(n, coarse, nan_rate, bucket, g);
+          check_geo(n, nan_rate, bucket, g);
+        }
+  return check_report("check_radius");
+}
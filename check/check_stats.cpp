@@ -0,0 +1,74 @@
+// Threaded sorts must report the same partition count and maximum depth
+// as the sequential sorts of the same data, also when the deepest
+// partitions are sorted by spawned threads.
+
+#ifndef KDTOOLS_ENABLE_STATS
+#define KDTOOLS_ENABLE_STATS
+#endif
+#include "check.h"
+
+using namespace kdtools;
+
+template <typename F>
+kd_stats sort_stats(F f)
+{
+  kd_stats_reset();
+  f();
+  return kd_stats_total();
+}
+
+void check_same(const kd_stats& a, const kd_stats& b)
+{
+  CHECK(a.sort_max_depth > 0);
+  CHECK(a.sort_max_depth == b.sort_max_depth);
+  CHECK(a.sort_partitions == b.sort_partitions);
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  using T = std::array<double, 3>;
+  for (size_t n : {100, 5000, 100000})
+    for (int kind : {0, 1, 2})
+    {
+      auto x = random_tuples<3>(n, kind == 1, 0, g);
+      // a left half of copies stops early, so the deepest partitions are
+      // on the right, in spawned threads
+      if (kind == 2)
+        for (size_t i = 0; i <= n / 2; ++i) x[i] = T{{-1, -1, -1}};
+      for (int threads : {2, 8})
+      {
+        auto y = x, z = x;
+        auto a = sort_stats([&]{ kd_sort(y.begin(), y.end()); });
+        auto b = sort_stats([&]{ kd_sort_threaded(z.begin(), z.end(), threads); });
+        check_same(a, b);
+
+        std::vector<size_t> oy(n), oz(n);
+        std::iota(oy.begin(), oy.end(), 0);
+        std::iota(oz.begin(), oz.end(), 0);
+        auto data = x.front().data();
+        a = sort_stats([&]{
+          detail::kd_sort_dyn(oy.begin(), oy.end(), data, 3, 0);
+        });
+        b = sort_stats([&]{
+          detail::kd_sort_threaded_dyn(oz.begin(), oz.end(), data, 3, 0,
+                                       threads);
+        });
+        check_same(a, b);
+
+        y = x;
+        z = x;
+        std::vector<std::uint8_t> ay(n), az(n);
+        auto proj = [](const T& t) -> const T& { return t; };
+        a = sort_stats([&]{
+          detail::kd_sort_adaptive(y.begin(), y.end(), proj, 3, ay.data());
+        });
+        b = sort_stats([&]{
+          detail::kd_sort_adaptive(z.begin(), z.end(), proj, 3, az.data(),
+                                   threads);
+        });
+        check_same(a, b);
+      }
+    }
+  return check_report("check_stats");
+}
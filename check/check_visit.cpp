@@ -0,0 +1,145 @@
+// Visiting every hit must reproduce the matching query, a visitor that
+// returns false must stop the search at once, and nearest neighbors must
+// arrive in order of distance.
+
+#include "check.h"
+
+using namespace kdtools;
+
+template <size_t N>
+void check_visit(size_t n, bool coarse, double nan_rate, size_t bucket,
+                 std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  using Iter = typename std::vector<T>::iterator;
+  auto x = random_tuples<N>(n, coarse, nan_rate, g);
+  auto b = bucket_size(bucket);
+  kd_sort(x.begin(), x.end(), b);
+  auto queries = random_tuples<N>(20, coarse, 0, g);
+  for (auto& q : queries)
+  {
+    T lower, upper;
+    for (size_t j = 0; j != N; ++j)
+    {
+      lower[j] = q[j] - 0.4;
+      upper[j] = q[j] + 0.4;
+    }
+    std::vector<T> a, v;
+    kd_range_query(x.begin(), x.end(), lower, upper, std::back_inserter(a), b);
+    CHECK(kd_range_visit(x.begin(), x.end(), lower, upper,
+                         [&](Iter it){ v.push_back(*it); }, b));
+    CHECK(same_set(a, v));
+    CHECK(kd_any_in_range(x.begin(), x.end(), lower, upper, b) == !a.empty());
+    for (size_t stop : {1, 3})
+    {
+      size_t calls = 0;
+      auto done = kd_range_visit(x.begin(), x.end(), lower, upper,
+                                 [&](Iter){ return ++calls != stop; }, b);
+      CHECK(done == (a.size() < stop));
+      CHECK(calls == (done ? a.size() : stop));
+    }
+
+    a.clear();
+    v.clear();
+    kd_radius_query(x.begin(), x.end(), q, 0.5, std::back_inserter(a), b);
+    CHECK(kd_radius_visit(x.begin(), x.end(), q, 0.5,
+                          [&](Iter it){ v.push_back(*it); return true; }, b));
+    CHECK(same_set(a, v));
+    for (size_t stop : {1, 3})
+    {
+      size_t calls = 0;
+      auto done = kd_radius_visit(x.begin(), x.end(), q, 0.5,
+                                  [&](Iter){ return ++calls != stop; }, b);
+      CHECK(done == (a.size() < stop));
+      CHECK(calls == (done ? a.size() : stop));
+    }
+  }
+}
+
+// The runtime-dimension visit against the runtime-dimension query
+template <size_t N>
+void check_visit_dyn(size_t n, bool coarse, double nan_rate, size_t bucket,
+                     std::mt19937& g)
+{
+  auto x = random_tuples<N>(n, coarse, nan_rate, g);
+  std::vector<double> flat;
+  for (auto& t : x) flat.insert(flat.end(), t.begin(), t.end());
+  dyn_rows<double> r(flat.data(), n, N);
+  auto b = bucket_size(bucket);
+  kd_sort(r, b);
+  auto queries = random_tuples<N>(20, coarse, 0, g);
+  for (size_t i = 0; i < n; i += 1 + n / 20)
+  {
+    std::array<double, N> q;
+    std::copy(r.row(i), r.row(i) + N, q.begin());
+    queries.push_back(q);
+  }
+  for (auto& q : queries)
+  {
+    std::vector<size_t> a, v;
+    kd_radius_query(r, q.data(), 0.5, std::back_inserter(a), b);
+    auto f = [&](size_t i){ v.push_back(i); };
+    CHECK(detail::kd_radius_visit_dyn(r, 0, n, q.data(), 0.5, 0, f, bucket));
+    std::sort(a.begin(), a.end());
+    std::sort(v.begin(), v.end());
+    CHECK(a == v);
+    size_t m = 0;
+    for (size_t i = 0; i != n; ++i)
+      m += detail::row_l2dist(r.row(i), q.data(), N) <= 0.5;
+    CHECK(v.size() == m);
+  }
+}
+
+template <size_t N>
+void check_nearest_visit(size_t n, bool coarse, double nan_rate,
+                         size_t bucket, std::mt19937& g)
+{
+  using T = std::array<double, N>;
+  using Iter = typename std::vector<T>::iterator;
+  auto x = random_tuples<N>(n, coarse, nan_rate, g);
+  auto b = bucket_size(bucket);
+  kd_sort(x.begin(), x.end(), b);
+  auto queries = random_tuples<N>(20, coarse, 0, g);
+  for (auto& q : queries)
+  {
+    std::vector<double> d, s;
+    CHECK(kd_nearest_visit(x.begin(), x.end(), q, [&](Iter it){
+      d.push_back(rank_dist(detail::l2dist(*it, q)));
+    }, b));
+    for (auto& t : x) s.push_back(rank_dist(detail::l2dist(t, q)));
+    std::sort(s.begin(), s.end());
+    CHECK(d == s);
+    std::vector<T> a;
+    kd_nearest_neighbors(x.begin(), x.end(), q, 10, std::back_inserter(a), b);
+    std::vector<double> e;
+    for (auto& t : a) e.push_back(rank_dist(detail::l2dist(t, q)));
+    std::sort(e.begin(), e.end());
+    CHECK(std::equal(e.begin(), e.end(), d.begin()));
+    size_t calls = 0;
+    auto done = kd_nearest_visit(x.begin(), x.end(), q,
+                                 [&](Iter){ return ++calls != 5; }, b);
+    CHECK(done == (x.size() < 5));
+    CHECK(calls == (done ? x.size() : 5));
+  }
+}
+
+int main()
+{
+  std::mt19937 g(42);
+  for (size_t n : {0, 1, 7, 31, 500, 3000})
+    for (bool coarse : {false, true})
+      for (size_t bucket : {1, 8})
+      {
+        check_visit<2>(n, coarse, 0, bucket, g);
+        check_visit<2>(n, coarse, 0.05, bucket, g);
+        check_visit<2>(n, coarse, 0.3, bucket, g);
+        check_visit_dyn<3>(n, coarse, 0, bucket, g);
+        check_visit_dyn<3>(n, coarse, 0.3, bucket, g);
+        check_visit<5>(n, coarse, 0, bucket, g);
+        check_nearest_visit<2>(n, coarse, 0, bucket, g);
+        check_nearest_visit<2>(n, coarse, 0.2, bucket, g);
+        check_nearest_visit<4>(n, coarse, 0, bucket, g);
+        check_nearest_visit<4>(n, coarse, 0.2, bucket, g);
+      }
+  return check_report("check_visit");
+}
@@ -13,11 +13,30 @@
 #include <iostream>
 #include <utility>
 #include <thread>
+#include <atomic>
 #include <vector>
 #include <limits>
-#include <queue>
+#include <numeric>
+#include <array>
 #include <tuple>
+#include <queue>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#ifdef KDTOOLS_ENABLE_STATS
+#include <mutex>
+#define KDTOOLS_STAT(field) (++kdtools::detail::local_stats().field)
+#define KDTOOLS_STAT_ADD(field, n) (kdtools::detail::local_stats().field += (n))
+#define KDTOOLS_STAT_DEPTH() kdtools::detail::depth_guard kd_depth_guard_
+#define KDTOOLS_STAT_DEPTH_AT(level) \
+  kdtools::detail::depth_guard kd_depth_guard_(level)
+#else
+#define KDTOOLS_STAT(field) ((void)0)
+#define KDTOOLS_STAT_ADD(field, n) ((void)0)
+#define KDTOOLS_STAT_DEPTH() ((void)0)
+#define KDTOOLS_STAT_DEPTH_AT(level) ((void)0)
+#endif
 
 namespace kdtools {
 
@@ -28,6 +47,168 @@ struct ndim
   static constexpr auto value = std::tuple_size<U>::value;
 };
 
+// Ranges of at most this many elements are left unordered by kd_sort
+// and scanned linearly by queries; queries must use the sort's value
+struct bucket_size
+{
+  size_t value;
+  explicit bucket_size(size_t n = 1) : value(n < 1 ? 1 : n) {}
+};
+
+// Space-filling curves available to curve_sort and curve_index
+enum class curve_type { morton, hilbert };
+
+// Kernels available to kd_density
+enum class kernel_type { gaussian, epanechnikov };
+
+// Centers (one row of ncol values each), cluster sizes and row labels
+// found by kd_kmeans, with the distance evaluations of each iteration
+struct kd_kmeans_result
+{
+  std::vector<double> centers;
+  std::vector<size_t> sizes;
+  std::vector<size_t> labels;
+  std::vector<size_t> distance_evals;
+  size_t iterations = 0;
+  bool converged = false;
+};
+
+// Count, sum and extremes of the weights attached to a set of points
+struct kd_summary
+{
+  size_t count = 0;
+  double sum = 0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+  void add(double w)
+  {
+    ++count;
+    sum += w;
+    if (w < min) min = w;
+    if (max < w) max = w;
+  }
+  void add(const kd_summary& rhs)
+  {
+    count += rhs.count;
+    sum += rhs.sum;
+    if (rhs.min < min) min = rhs.min;
+    if (max < rhs.max) max = rhs.max;
+  }
+  double mean() const
+  {
+    return sum / count;
+  }
+};
+
+// Summaries of the weights under each subtree of a kd-sorted range in
+// heap order, and the bounding box of the points, N lower then N upper
+// coordinates. Built by kd_summarize for use with kd_range_summary on the
+// same range; the shape it was built for is kept for callers to check.
+struct kd_summary_tree
+{
+  size_t m_size = 0, m_ncol = 0;
+  size_t m_bucket = 1;
+  std::vector<kd_summary> m_nodes;
+  std::vector<double> m_bounds;
+};
+
+// Counters are only updated when compiled with KDTOOLS_ENABLE_STATS
+struct kd_stats
+{
+  size_t nodes_visited = 0;
+  size_t subtrees_pruned = 0;
+  size_t points_scanned = 0;
+  size_t distance_evals = 0;
+  size_t sort_partitions = 0;
+  size_t sort_max_depth = 0;
+  kd_stats& operator+=(const kd_stats& rhs)
+  {
+    nodes_visited += rhs.nodes_visited;
+    subtrees_pruned += rhs.subtrees_pruned;
+    points_scanned += rhs.points_scanned;
+    distance_evals += rhs.distance_evals;
+    sort_partitions += rhs.sort_partitions;
+    if (rhs.sort_max_depth > sort_max_depth)
+      sort_max_depth = rhs.sort_max_depth;
+    return *this;
+  }
+};
+
+#ifdef KDTOOLS_ENABLE_STATS
+namespace detail {
+
+struct stats_registry
+{
+  std::mutex m_mutex;
+  kd_stats m_total;
+  void merge(const kd_stats& x)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_total += x;
+  }
+  kd_stats total()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_total;
+  }
+  void reset()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_total = kd_stats();
+  }
+};
+
+inline stats_registry& global_stats()
+{
+  static stats_registry registry;
+  return registry;
+}
+
+// Per-thread counters; merged into the global total on flush or
+// when the thread exits
+struct thread_stats
+{
+  kd_stats m_counts;
+  size_t m_depth = 0;
+  ~thread_stats()
+  {
+    global_stats().merge(m_counts);
+  }
+};
+
+inline thread_stats& local_thread_stats()
+{
+  static thread_local thread_stats s;
+  return s;
+}
+
+inline kd_stats& local_stats()
+{
+  return local_thread_stats().m_counts;
+}
+
+// Threaded sorts pass their depth as level, since a thread they spawn
+// starts counting from zero
+struct depth_guard
+{
+  size_t m_saved;
+  explicit depth_guard(size_t level = 0)
+  {
+    auto& s = local_thread_stats();
+    m_saved = s.m_depth;
+    s.m_depth = m_saved + 1 < level ? level : m_saved + 1;
+    if (s.m_depth > s.m_counts.sort_max_depth)
+      s.m_counts.sort_max_depth = s.m_depth;
+  }
+  ~depth_guard()
+  {
+    local_thread_stats().m_depth = m_saved;
+  }
+};
+
+} // namespace detail
+#endif
+
 // Specialize for non-numeric types
 // TODO: User defined distance functions
 
@@ -49,6 +230,9 @@ using std::abs;
 using std::get;
 using std::next;
 using std::pair;
+using std::array;
+using std::begin;
+using std::end;
 using std::size_t;
 using std::thread;
 using std::vector;
@@ -60,7 +244,6 @@ using std::is_pointer;
 using std::nth_element;
 using std::tuple_element;
 using std::numeric_limits;
-using std::priority_queue;
 using std::is_partitioned;
 using std::remove_pointer;
 using std::iterator_traits;
@@ -96,6 +279,46 @@ struct less_nth
   }
 };
 
+// Sorts order NaN after every number and level with any other NaN, so
+// that their comparisons stay a strict weak order when data are missing
+template <typename T>
+typename enable_if<!std::is_floating_point<T>::value, bool>::type
+sort_less(const T& lhs, const T& rhs)
+{
+  return lhs < rhs;
+}
+
+template <typename T>
+typename enable_if<std::is_floating_point<T>::value, bool>::type
+sort_less(T lhs, T rhs)
+{
+  return lhs < rhs || (lhs == lhs && rhs != rhs);
+}
+
+// Distances to rows with NaN rank after every number, as those rows sort,
+// so that comparisons of distances stay a strict weak order too
+inline double nan_last(double d)
+{
+  return d != d ? numeric_limits<double>::infinity() : d;
+}
+
+template <size_t I>
+struct sort_less_nth
+{
+  template <typename T>
+  typename enable_if<is_not_pointer<T>::value, bool>::type
+  operator()(const T& lhs, const T& rhs)
+  {
+    return sort_less(get<I>(lhs), get<I>(rhs));
+  }
+  template <typename T>
+  typename enable_if<is_pointer<T>::value, bool>::type
+  operator()(const T& lhs, const T& rhs)
+  {
+    return sort_less(get<I>(*lhs), get<I>(*rhs));
+  }
+};
+
 template <size_t I>
 struct equal_nth
 {
@@ -198,15 +421,15 @@ struct kd_less
   operator()(const T& lhs, const T& rhs) const
   {
     constexpr auto J = next_dim<I, T>::value;
-    return equal_nth<I>()(lhs, rhs) ?
-      kd_less<J, K + 1>()(lhs, rhs) :
-        less_nth<I>()(lhs, rhs);
+    return sort_less_nth<I>()(lhs, rhs) ? true :
+      sort_less_nth<I>()(rhs, lhs) ? false :
+        kd_less<J, K + 1>()(lhs, rhs);
   }
   template <typename T>
   typename enable_if<is_last<K, T>::value, bool>::type
   operator()(const T& lhs, const T& rhs) const
   {
-    return less_nth<I>()(lhs, rhs);
+    return sort_less_nth<I>()(lhs, rhs);
   }
 };
 
@@ -221,7 +444,7 @@ struct kd_compare
   {
     auto pred = make_pred_nth<I>(m_pred);
     constexpr auto J = next_dim<I, T>::value;
-    return !pred(lhs, rhs) && !pred(lhs, rhs) ?
+    return !pred(lhs, rhs) && !pred(rhs, lhs) ?
       kd_compare<Pred, J, K + 1>(m_pred)(lhs, rhs) : pred(lhs, rhs);
   }
   template <typename T>
@@ -238,41 +461,240 @@ kd_compare<Pred, I> make_kd_compare(const Pred& pred)
   return kd_compare<Pred, I>(pred);
 }
 
+// Three-way version of kd_less: negative, zero or positive as lhs orders
+// before, equal to or after rhs, comparing each dimension at most twice
+template <size_t I, size_t K = 0>
+struct kd_three_way
+{
+  template <typename T>
+  typename enable_if<is_not_last<K, T>::value, int>::type
+  operator()(const T& lhs, const T& rhs) const
+  {
+    constexpr auto J = next_dim<I, T>::value;
+    return sort_less_nth<I>()(lhs, rhs) ? -1 :
+      sort_less_nth<I>()(rhs, lhs) ? 1 : kd_three_way<J, K + 1>()(lhs, rhs);
+  }
+  template <typename T>
+  typename enable_if<is_last<K, T>::value, int>::type
+  operator()(const T& lhs, const T& rhs) const
+  {
+    return sort_less_nth<I>()(lhs, rhs) ? -1 :
+      sort_less_nth<I>()(rhs, lhs) ? 1 : 0;
+  }
+};
+
 template <typename T>
 using iter_value_t = typename iterator_traits<T>::value_type;
 
+// Sorted ranges keep the pivot at the middle; elements to its left do not
+// order after it and elements to its right do not order before it
 template <size_t I, typename Iter>
 Iter find_pivot(Iter first, Iter last)
+{
+  return middle_of(first, last);
+}
+
+template <typename Iter, typename Compare>
+Iter median_of_three(Iter a, Iter b, Iter c, Compare cmp)
+{
+  if (cmp(*a, *b) < 0)
+    return cmp(*b, *c) < 0 ? b : cmp(*a, *c) < 0 ? c : a;
+  return cmp(*a, *c) < 0 ? a : cmp(*b, *c) < 0 ? c : b;
+}
+
+// Quickselect with three-way partitioning. Places the nth element as
+// nth_element would and returns the block of elements equal to it, so
+// that a range of equal keys is settled in a single pass.
+template <typename Iter, typename Compare>
+pair<Iter, Iter> kd_select(Iter first, Iter nth, Iter last, Compare cmp)
 {
   using T = iter_value_t<Iter>;
-  auto pivot = middle_of(first, last);
-  return partition_point(first, pivot, [&](const T& x){
-    return less_nth<I>()(x, *pivot);
-  });
+  auto limit = 2 * static_cast<int>(std::log2(distance(first, last) + 1));
+  while (distance(first, last) > 1)
+  {
+    if (limit-- == 0)
+    {
+      nth_element(first, nth, last, [&](const T& a, const T& b){
+        return cmp(a, b) < 0;
+      });
+      return std::make_pair(nth, next(nth));
+    }
+    T pivot = *median_of_three(first, middle_of(first, last),
+                               std::prev(last), cmp);
+    auto lt = first, i = first, gt = last;
+    while (i != gt)
+    {
+      auto c = cmp(*i, pivot);
+      if (c < 0) std::iter_swap(lt++, i++);
+      else if (c > 0) std::iter_swap(i, --gt);
+      else ++i;
+    }
+    if (nth < lt) last = lt;
+    else if (gt <= nth) first = gt;
+    else return std::make_pair(lt, gt);
+  }
+  return std::make_pair(first, last);
 }
 
-template <typename Iter, typename Pred>
-Iter adjust_pivot(Iter first, Iter pivot, Pred pred)
+// Order-preserving maps from floating point keys to unsigned integers;
+// negative zero is folded onto zero so that equal keys map equal
+inline std::uint32_t radix_key(float x)
+{
+  std::uint32_t u;
+  x += 0.0f;
+  std::memcpy(&u, &x, sizeof u);
+  return u & 0x80000000u ? ~u : u | 0x80000000u;
+}
+
+inline std::uint64_t radix_key(double x)
+{
+  std::uint64_t u;
+  x += 0.0;
+  std::memcpy(&u, &x, sizeof u);
+  return u & 0x8000000000000000u ? ~u : u | 0x8000000000000000u;
+}
+
+// Sort keys send every NaN past the numbers, as sort_less orders them
+template <typename T>
+auto sort_key(T x) -> decltype(radix_key(x))
+{
+  return x == x ? radix_key(x) : ~decltype(radix_key(x))(0);
+}
+
+template <typename T>
+struct is_radix_key
+{
+  static constexpr bool value =
+    is_same<T, double>::value || is_same<T, float>::value;
+};
+
+template <size_t I, typename T>
+struct element_nth
+{
+  using U = typename remove_pointer<T>::type;
+  using type = typename std::decay<typename tuple_element<I, U>::type>::type;
+};
+
+template <size_t I>
+struct radix_nth
+{
+  template <typename T>
+  typename enable_if<is_not_pointer<T>::value,
+                     decltype(radix_key(get<I>(std::declval<T>())))>::type
+  operator()(const T& x) const
+  {
+    return sort_key(get<I>(x));
+  }
+  template <typename T>
+  typename enable_if<is_pointer<T>::value,
+                     decltype(radix_key(get<I>(*std::declval<T>())))>::type
+  operator()(const T& x) const
+  {
+    return sort_key(get<I>(*x));
+  }
+};
+
+constexpr std::ptrdiff_t radix_cutoff = 1024;
+
+// Counts of one byte of the keys; four interleaved tables keep runs of
+// equal digits from serializing on a single counter
+template <typename K>
+void radix_histogram(const K* keys, size_t m, int shift, size_t* hist)
+{
+  size_t h[4][256] = {};
+  size_t i = 0;
+  for (; i + 4 <= m; i += 4)
+  {
+    ++h[0][(keys[i] >> shift) & 0xff];
+    ++h[1][(keys[i + 1] >> shift) & 0xff];
+    ++h[2][(keys[i + 2] >> shift) & 0xff];
+    ++h[3][(keys[i + 3] >> shift) & 0xff];
+  }
+  for (; i != m; ++i) ++h[0][(keys[i] >> shift) & 0xff];
+  for (int b = 0; b != 256; ++b)
+    hist[b] = h[0][b] + h[1][b] + h[2][b] + h[3][b];
+}
+
+// Selection on the leading key by most-significant-digit histograms over
+// a copy of the keys, followed by a single partition of the range. Ties
+// on the leading key are then resolved by kd_select with cmp.
+template <typename Iter, typename Key, typename Compare>
+pair<Iter, Iter> radix_select(Iter first, Iter nth, Iter last,
+                              Key key, Compare cmp)
 {
   using T = iter_value_t<Iter>;
-  return partition(first, pivot, [&](const T& x){
-    return pred(x, *pivot);
+  using K = decltype(key(*first));
+  if (distance(first, last) < radix_cutoff)
+    return kd_select(first, nth, last, cmp);
+  vector<K> keys;
+  keys.reserve(distance(first, last));
+  std::transform(first, last, std::back_inserter(keys), key);
+  auto r = static_cast<size_t>(distance(first, nth));
+  auto m = keys.size();
+  K target = 0;
+  for (int shift = 8 * sizeof(K) - 8; shift >= 0; shift -= 8)
+  {
+    size_t hist[256];
+    radix_histogram(keys.data(), m, shift, hist);
+    size_t b = 0;
+    while (r >= hist[b]) r -= hist[b++];
+    target |= static_cast<K>(b) << shift;
+    if (hist[b] == m) continue;
+    size_t k = 0;
+    for (size_t i = 0; i != m; ++i)
+    {
+      auto v = keys[i];
+      keys[k] = v;
+      k += ((v >> shift) & 0xff) == b;
+    }
+    m = k;
+    if (m == 1)
+    {
+      target = keys[0];
+      break;
+    }
+  }
+  auto lt = partition(first, last, [&](const T& x){
+    return key(x) < target;
   });
+  auto gt = partition(lt, last, [&](const T& x){
+    return key(x) == target;
+  });
+  if (distance(lt, gt) > 1) return kd_select(lt, nth, gt, cmp);
+  return std::make_pair(lt, gt);
+}
+
+// Floating point leading keys use radix selection; other types compare
+template <size_t I, typename Iter>
+typename enable_if<is_radix_key<typename element_nth<I,
+  iter_value_t<Iter>>::type>::value, pair<Iter, Iter>>::type
+kd_partition(Iter first, Iter nth, Iter last)
+{
+  return radix_select(first, nth, last, radix_nth<I>(), kd_three_way<I>());
+}
+
+template <size_t I, typename Iter>
+typename enable_if<!is_radix_key<typename element_nth<I,
+  iter_value_t<Iter>>::type>::value, pair<Iter, Iter>>::type
+kd_partition(Iter first, Iter nth, Iter last)
+{
+  return kd_select(first, nth, last, kd_three_way<I>());
 }
 
 template <size_t I, typename Iter>
-void kd_sort(Iter first, Iter last)
+void kd_sort(Iter first, Iter last, size_t bucket = 1)
 {
   using TupleType = iter_value_t<Iter>;
   constexpr auto J = next_dim<I, TupleType>::value;
-  if (distance(first, last) > 1)
+  if (static_cast<size_t>(distance(first, last)) > bucket)
   {
-    auto pred = kd_less<I>();
+    KDTOOLS_STAT_DEPTH();
+    KDTOOLS_STAT(sort_partitions);
     auto pivot = middle_of(first, last);
-    nth_element(first, pivot, last, pred);
-    pivot = adjust_pivot(first, pivot, pred);
-    kd_sort<J>(next(pivot), last);
-    kd_sort<J>(first, pivot);
+    auto equal = kd_partition<I>(first, pivot, last);
+    if (equal.first == first && equal.second == last) return;
+    kd_sort<J>(next(pivot), last, bucket);
+    kd_sort<J>(first, pivot, bucket);
   }
 }
 
@@ -280,22 +702,64 @@ template <typename Iter, typename Pred>
 bool check_partition(Iter first, Iter pivot, Iter last, Pred pred)
 {
   using T = iter_value_t<Iter>;
-  return is_partitioned(first, last, [&](const T& x){
+  return std::none_of(first, pivot, [&](const T& x){
+    return pred(*pivot, x);
+  }) && std::none_of(next(pivot), last, [&](const T& x){
     return pred(x, *pivot);
   });
 }
 
+constexpr size_t all_levels = numeric_limits<size_t>::max();
+
 template <size_t I, typename Iter>
-bool kd_is_sorted(Iter first, Iter last)
+bool kd_is_sorted(Iter first, Iter last, size_t bucket = 1,
+                  size_t levels = all_levels)
 {
   using TupleType = iter_value_t<Iter>;
   constexpr auto J = next_dim<I, TupleType>::value;
-  if (distance(first, last) < 2) return true;
+  if (levels == 0) return true;
+  if (static_cast<size_t>(distance(first, last)) <= bucket) return true;
   auto pred = kd_less<I>();
   auto pivot = find_pivot<I>(first, last);
   return check_partition(first, pivot, last, pred) &&
-    kd_is_sorted<J>(first, pivot) &&
-    kd_is_sorted<J>(next(pivot), last);
+    kd_is_sorted<J>(first, pivot, bucket, levels - 1) &&
+    kd_is_sorted<J>(next(pivot), last, bucket, levels - 1);
+}
+
+// Subtrees are checked concurrently down to the thread budget; the first
+// violation found sets failed, which the others test at each partition
+template <size_t I, typename Iter>
+bool kd_is_sorted_threaded(Iter first, Iter last, size_t bucket,
+                           size_t levels, std::atomic<bool>& failed,
+                           int max_threads, int thread_depth = 1)
+{
+  using TupleType = iter_value_t<Iter>;
+  constexpr auto J = next_dim<I, TupleType>::value;
+  if (failed.load(std::memory_order_relaxed)) return false;
+  if (levels == 0) return true;
+  if (static_cast<size_t>(distance(first, last)) <= bucket) return true;
+  auto pivot = find_pivot<I>(first, last);
+  if (!check_partition(first, pivot, last, kd_less<I>()))
+  {
+    failed = true;
+    return false;
+  }
+  if ((1 << thread_depth) <= max_threads)
+  {
+    bool right = true;
+    thread t([&]{
+      right = kd_is_sorted_threaded<J>(next(pivot), last, bucket, levels - 1,
+                                       failed, max_threads, thread_depth + 1);
+    });
+    auto left = kd_is_sorted_threaded<J>(first, pivot, bucket, levels - 1,
+                                         failed, max_threads, thread_depth + 1);
+    t.join();
+    return left && right;
+  }
+  return kd_is_sorted_threaded<J>(first, pivot, bucket, levels - 1,
+                                  failed, max_threads, thread_depth) &&
+    kd_is_sorted_threaded<J>(next(pivot), last, bucket, levels - 1,
+                             failed, max_threads, thread_depth);
 }
 
 template <size_t I, typename Iter, typename Compare>
@@ -305,10 +769,11 @@ void kd_sort(Iter first, Iter last, const Compare& comp)
   constexpr auto J = next_dim<I, TupleType>::value;
   if (distance(first, last) > 1)
   {
+    KDTOOLS_STAT_DEPTH();
+    KDTOOLS_STAT(sort_partitions);
     auto pivot = middle_of(first, last);
     auto pred = make_kd_compare<I>(comp);
     nth_element(first,  pivot,  last,  pred);
-    pivot = adjust_pivot(first, pivot, pred);
     kd_sort<J>(next(pivot), last, comp);
     kd_sort<J>(first, pivot, comp);
   }
@@ -330,31 +795,113 @@ bool kd_is_sorted(Iter first, Iter last, const Compare& comp)
 template <size_t I, typename Iter>
 void kd_sort_threaded(Iter first, Iter last,
                       int max_threads = std::thread::hardware_concurrency(),
-                      int thread_depth = 1)
+                      int thread_depth = 1,
+                      size_t bucket = 1)
 {
   using TupleType = iter_value_t<Iter>;
   constexpr auto J = next_dim<I, TupleType>::value;
-  if (distance(first, last) > 1)
+  if (static_cast<size_t>(distance(first, last)) > bucket)
   {
-    auto pred = kd_less<I>();
+    KDTOOLS_STAT_DEPTH_AT(thread_depth);
+    KDTOOLS_STAT(sort_partitions);
     auto pivot = middle_of(first, last);
-    nth_element(first, pivot, last, pred);
-    pivot = adjust_pivot(first, pivot, pred);
+    auto equal = kd_partition<I>(first, pivot, last);
+    if (equal.first == first && equal.second == last) return;
     if ((1 << thread_depth) <= max_threads)
     {
       thread t(kd_sort_threaded<J, Iter>,
-               next(pivot), last, max_threads, thread_depth + 1);
-      kd_sort_threaded<J>(first, pivot, max_threads, thread_depth + 1);
+               next(pivot), last, max_threads, thread_depth + 1, bucket);
+      kd_sort_threaded<J>(first, pivot, max_threads, thread_depth + 1, bucket);
       t.join();
     }
     else
     {
-      kd_sort<J>(next(pivot), last);
-      kd_sort<J>(first, pivot);
+      kd_sort<J>(next(pivot), last, bucket);
+      kd_sort<J>(first, pivot, bucket);
     }
   }
 }
 
+constexpr std::ptrdiff_t lex_cutoff = 1 << 14;
+
+template <typename Iter, typename OutIter>
+void move_threaded(Iter first, Iter last, OutIter outp,
+                   int max_threads, int thread_depth)
+{
+  auto n = distance(first, last);
+  if ((1 << thread_depth) > max_threads || n < lex_cutoff)
+  {
+    std::move(first, last, outp);
+    return;
+  }
+  auto mid = middle_of(first, last);
+  thread t([=]{
+    move_threaded(mid, last, next(outp, n / 2), max_threads, thread_depth + 1);
+  });
+  move_threaded(first, mid, outp, max_threads, thread_depth + 1);
+  t.join();
+}
+
+// Splits the longer run at its middle and the shorter at the matching
+// bound so that the two halves of the output can be merged concurrently
+template <typename Iter, typename OutIter, typename Compare>
+void merge_threaded(Iter first1, Iter last1, Iter first2, Iter last2,
+                    OutIter outp, const Compare& comp,
+                    int max_threads, int thread_depth)
+{
+  auto n1 = distance(first1, last1), n2 = distance(first2, last2);
+  if ((1 << thread_depth) > max_threads || n1 + n2 < lex_cutoff)
+  {
+    std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+               std::make_move_iterator(first2), std::make_move_iterator(last2),
+               outp, comp);
+    return;
+  }
+  Iter mid1, mid2;
+  if (n1 >= n2)
+  {
+    mid1 = middle_of(first1, last1);
+    mid2 = std::lower_bound(first2, last2, *mid1, comp);
+  }
+  else
+  {
+    mid2 = middle_of(first2, last2);
+    mid1 = std::upper_bound(first1, last1, *mid2, comp);
+  }
+  auto outm = next(outp, distance(first1, mid1) + distance(first2, mid2));
+  thread t([=, &comp]{
+    merge_threaded(mid1, last1, mid2, last2, outm, comp,
+                   max_threads, thread_depth + 1);
+  });
+  merge_threaded(first1, mid1, first2, mid2, outp, comp,
+                 max_threads, thread_depth + 1);
+  t.join();
+}
+
+// Merge sort over threads: each half is sorted concurrently, then merged
+// into buf and moved back, both also split across the available threads
+template <typename Iter, typename BufIter, typename Compare>
+void lex_sort_threaded(Iter first, Iter last, BufIter buf,
+                       const Compare& comp,
+                       int max_threads, int thread_depth = 1)
+{
+  auto n = distance(first, last);
+  if ((1 << thread_depth) > max_threads || n < lex_cutoff)
+  {
+    std::sort(first, last, comp);
+    return;
+  }
+  auto mid = middle_of(first, last);
+  auto bmid = next(buf, n / 2);
+  thread t([=, &comp]{
+    lex_sort_threaded(mid, last, bmid, comp, max_threads, thread_depth + 1);
+  });
+  lex_sort_threaded(first, mid, buf, comp, max_threads, thread_depth + 1);
+  t.join();
+  merge_threaded(first, mid, mid, last, buf, comp, max_threads, thread_depth);
+  move_threaded(buf, next(buf, n), first, max_threads, thread_depth);
+}
+
 template <size_t I>
 struct all_less_
 {
@@ -402,43 +949,53 @@ bool none_less(const TupleType& lhs, const TupleType& rhs)
 }
 
 template <size_t I, typename Iter, typename TupleType>
-Iter kd_lower_bound(Iter first, Iter last, const TupleType& value)
+Iter kd_lower_bound(Iter first, Iter last, const TupleType& value,
+                    size_t bucket = 1)
 {
   constexpr auto J = next_dim<I, TupleType>::value;
-  if (distance(first, last) > 1)
+  if (static_cast<size_t>(distance(first, last)) > bucket)
   {
     auto pivot = find_pivot<I>(first, last);
     if (none_less(*pivot, value))
-      return kd_lower_bound<J>(first, pivot, value);
+      return kd_lower_bound<J>(first, pivot, value, bucket);
     if (all_less(*pivot, value))
-      return kd_lower_bound<J>(next(pivot), last, value);
-    auto it = kd_lower_bound<J>(first, pivot, value);
+      return kd_lower_bound<J>(next(pivot), last, value, bucket);
+    auto it = kd_lower_bound<J>(first, pivot, value, bucket);
     if (it != last && none_less(*it, value)) return it;
-    it = kd_lower_bound<J>(next(pivot), last, value);
+    it = kd_lower_bound<J>(next(pivot), last, value, bucket);
     if (it != last && none_less(*it, value)) return it;
     return last;
   }
-  return first != last && none_less(*first, value) ? first : last;
+  auto res = last;
+  for (; first != last; ++first)
+    if (none_less(*first, value) && (res == last || kd_less<I>()(*first, *res)))
+      res = first;
+  return res;
 }
 
 template <size_t I, typename Iter, typename TupleType>
-Iter kd_upper_bound(Iter first, Iter last, const TupleType& value)
+Iter kd_upper_bound(Iter first, Iter last, const TupleType& value,
+                    size_t bucket = 1)
 {
   constexpr auto J = next_dim<I, TupleType>::value;
-  if (distance(first, last) > 1)
+  if (static_cast<size_t>(distance(first, last)) > bucket)
   {
     auto pivot = find_pivot<I>(first, last);
     if (all_less(value, *pivot))
-      return kd_upper_bound<J>(first, pivot, value);
+      return kd_upper_bound<J>(first, pivot, value, bucket);
     if (none_less(value, *pivot))
-      return kd_upper_bound<J>(next(pivot), last, value);
-    auto it = kd_upper_bound<J>(first, pivot, value);
+      return kd_upper_bound<J>(next(pivot), last, value, bucket);
+    auto it = kd_upper_bound<J>(first, pivot, value, bucket);
     if (it != last && all_less(value, *it)) return it;
-    it = kd_upper_bound<J>(next(pivot), last, value);
+    it = kd_upper_bound<J>(next(pivot), last, value, bucket);
     if (it != last && all_less(value, *it)) return it;
     return last;
   }
-  return first != last && all_less(value, *first) ? first : last;
+  auto res = last;
+  for (; first != last; ++first)
+    if (all_less(value, *first) && (res == last || kd_less<I>()(*first, *res)))
+      res = first;
+  return res;
 }
 
 template <size_t I>
@@ -468,38 +1025,50 @@ double sum_of_squares(const TupleType& lhs, const TupleType& rhs)
 template <typename TupleType>
 double l2dist(const TupleType& lhs, const TupleType& rhs)
 {
+  KDTOOLS_STAT(distance_evals);
   return std::sqrt(sum_of_squares(lhs, rhs));
 }
 
 template <size_t I, typename Iter, typename TupleType>
-Iter kd_nearest_neighbor(Iter first, Iter last, const TupleType& value)
+Iter kd_nearest_neighbor(Iter first, Iter last, const TupleType& value,
+                         size_t bucket = 1)
 {
   constexpr auto J = next_dim<I, TupleType>::value;
-  if (distance(first, last) > 1)
+  if (static_cast<size_t>(distance(first, last)) > bucket)
   {
+    KDTOOLS_STAT(nodes_visited);
     auto pivot = find_pivot<I>(first, last);
-    auto search_left = less_nth<I>()(value, *pivot);
+    auto search_left = sort_less_nth<I>()(value, *pivot);
     auto search = search_left ?
-      kd_nearest_neighbor<J>(first, pivot, value) :
-        kd_nearest_neighbor<J>(next(pivot), last, value);
-    auto min_dist = l2dist(*pivot, value);
+      kd_nearest_neighbor<J>(first, pivot, value, bucket) :
+        kd_nearest_neighbor<J>(next(pivot), last, value, bucket);
+    auto min_dist = nan_last(l2dist(*pivot, value));
     if (search == last) search = pivot;
     else
     {
-      auto sdist = l2dist(*search, value);
+      auto sdist = nan_last(l2dist(*search, value));
       if (sdist < min_dist) min_dist = sdist;
       else search = pivot;
     }
-    if (dist_nth<I>(value, *pivot) < min_dist)
+    if (nan_last(dist_nth<I>(value, *pivot)) < min_dist)
     {
       auto s2 = search_left ?
-        kd_nearest_neighbor<J>(next(pivot), last, value) :
-          kd_nearest_neighbor<J>(first, pivot, value);
-      if (s2 != last && l2dist(*s2, value) < min_dist) search = s2;
+        kd_nearest_neighbor<J>(next(pivot), last, value, bucket) :
+          kd_nearest_neighbor<J>(first, pivot, value, bucket);
+      if (s2 != last && nan_last(l2dist(*s2, value)) < min_dist) search = s2;
     }
+    else KDTOOLS_STAT(subtrees_pruned);
     return search;
   }
-  return first;
+  using T = iter_value_t<Iter>;
+  return std::min_element(first, last, [&](const T& x, const T& y){
+    return nan_last(l2dist(x, value)) < nan_last(l2dist(y, value));
+  });
+}
+
+inline size_t leaf_size(size_t bucket)
+{
+  return bucket > 32 ? bucket : 32;
 }
 
 template <typename TupleType>
@@ -517,18 +1086,23 @@ template <size_t I,
 void kd_range_query(Iter first, Iter last,
                     const TupleType& lower,
                     const TupleType& upper,
-                    OutIter outp)
+                    OutIter outp,
+                    size_t bucket = 1)
 {
-  if (distance(first, last) > 32) {
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
     auto pred = less_nth<I>();
     auto pivot = find_pivot<I>(first, last);
     constexpr auto J = next_dim<I, TupleType>::value;
     if (within(*pivot, lower, upper)) *outp++ = *pivot;
     if (!pred(*pivot, lower)) // search left
-      kd_range_query<J>(first, pivot, lower, upper, outp);
+      kd_range_query<J>(first, pivot, lower, upper, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
     if (pred(*pivot, upper)) // search right
-      kd_range_query<J>(next(pivot), last, lower, upper, outp);
+      kd_range_query<J>(next(pivot), last, lower, upper, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
   } else {
+    KDTOOLS_STAT_ADD(points_scanned, distance(first, last));
     copy_if(first, last, outp, [&](const TupleType& x){
       return within(x, lower, upper);
     });
@@ -536,190 +1110,5111 @@ void kd_range_query(Iter first, Iter last,
   return;
 }
 
-template <typename Iter, typename Key = double>
+template <size_t I,
+          typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_radius_query(Iter first, Iter last,
+                     const TupleType& value,
+                     double radius,
+                     OutIter outp,
+                     size_t bucket = 1)
+{
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = find_pivot<I>(first, last);
+    constexpr auto J = next_dim<I, TupleType>::value;
+    if (l2dist(*pivot, value) <= radius) *outp++ = *pivot;
+    if (!(diff_nth<I>(value, *pivot) > radius)) // search left, also of NaN
+      kd_radius_query<J>(first, pivot, value, radius, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (diff_nth<I>(*pivot, value) <= radius) // search right
+      kd_radius_query<J>(next(pivot), last, value, radius, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, distance(first, last));
+    copy_if(first, last, outp, [&](const TupleType& x){
+      return l2dist(x, value) <= radius;
+    });
+  }
+  return;
+}
+
+template <typename Iter>
+size_t clamp_size(Iter first, Iter last, size_t n)
+{
+  auto m = static_cast<size_t>(distance(first, last));
+  return n < m ? n : m;
+}
+
+template <typename Iter, typename Key = double, size_t N = 32>
 struct n_best
 {
   using qmem_t = pair<Key, Iter>;
-  using qcont_t = vector<qmem_t>;
   using qcomp_t = less_nth<0>;
-  using queue_t = priority_queue<qmem_t, qcont_t, qcomp_t>;
-  size_t m_n;
-  queue_t m_q;
-  n_best(size_t n) : m_n(n), m_q(qcomp_t()) {}
+  size_t m_n, m_size;
+  array<qmem_t, N> m_sorted;
+  vector<qmem_t> m_heap;
+  n_best(size_t n) : m_n(n), m_size(0)
+  {
+    if (m_n > N) m_heap.reserve(m_n);
+  }
+  void reset(size_t n)
+  {
+    m_n = n;
+    m_size = 0;
+    m_heap.clear();
+    if (m_n > N) m_heap.reserve(m_n);
+  }
+  bool is_small() const
+  {
+    return m_n <= N;
+  }
+  Key worst_key() const
+  {
+    return is_small() ? m_sorted[m_size - 1].first : m_heap.front().first;
+  }
   Key max_key() const
   {
-    return m_q.empty() ?
-      numeric_limits<Key>::max() :
-        m_q.top().first;
+    if (m_n == 0) return numeric_limits<Key>::lowest();
+    return m_size < m_n ?
+      numeric_limits<Key>::infinity() :
+        worst_key();
   }
   void add(Key dist, Iter it)
   {
-    m_q.emplace(dist, it);
-    if (m_q.size() > m_n) m_q.pop();
+    dist = nan_last(dist);
+    if (m_n == 0 || (m_size == m_n && !(dist < worst_key()))) return;
+    if (is_small())
+    {
+      auto pos = m_size < m_n ? m_size++ : m_size - 1;
+      for (; pos > 0 && dist < m_sorted[pos - 1].first; --pos)
+        m_sorted[pos] = m_sorted[pos - 1];
+      m_sorted[pos] = qmem_t(dist, it);
+    }
+    else
+    {
+      if (m_size == m_n)
+        std::pop_heap(begin(m_heap), end(m_heap), qcomp_t());
+      else
+      {
+        m_heap.emplace_back();
+        ++m_size;
+      }
+      m_heap.back() = qmem_t(dist, it);
+      std::push_heap(begin(m_heap), end(m_heap), qcomp_t());
+    }
   }
-  template <typename OutIter>
-  void copy_to(OutIter outp)
+  template <typename OutIter, typename Fun>
+  void drain_to(OutIter outp, Fun f)
   {
-    while (!m_q.empty())
+    if (is_small())
+      while (m_size > 0) *outp++ = f(m_sorted[--m_size].second);
+    else
     {
-      *outp++ = *m_q.top().second;
-      m_q.pop();
+      std::sort_heap(begin(m_heap), end(m_heap), qcomp_t());
+      while (!m_heap.empty())
+      {
+        *outp++ = f(m_heap.back().second);
+        m_heap.pop_back();
+      }
+      m_size = 0;
     }
   }
-};
-
-template <size_t I,
-          typename Iter,
-          typename TupleType,
-          typename QType>
+  template <typename OutIter>
+  void copy_to(OutIter outp)
+  {
+    drain_to(outp, [](Iter it){ return *it; });
+  }
+  template <typename OutIter>
+  void copy_iters_to(OutIter outp)
+  {
+    drain_to(outp, [](Iter it){ return it; });
+  }
+};
+
+template <size_t I,
+          typename Iter,
+          typename TupleType,
+          typename QType>
 void knn(Iter first, Iter last,
          const TupleType& value,
-         QType& Q)
+         QType& Q, size_t bucket = 1)
 {
-  switch(distance(first, last)) {
-  case 1 : Q.add(l2dist(*first, value), first);
-  case 0 : return; } // switch end
+  if (static_cast<size_t>(distance(first, last)) <= bucket)
+  {
+    for (; first != last; ++first) Q.add(l2dist(*first, value), first);
+    return;
+  }
+  KDTOOLS_STAT(nodes_visited);
   auto pivot = find_pivot<I>(first, last);
   Q.add(l2dist(*pivot, value), pivot);
-  auto search_left = less_nth<I>()(value, *pivot);
+  // NaN sorts last, so a NaN pivot has every number on its left and
+  // rows ranked last on its right
+  auto search_left = sort_less_nth<I>()(value, *pivot);
   constexpr auto J = next_dim<I, TupleType>::value;
   if (search_left)
-    knn<J>(first, pivot, value, Q);
+    knn<J>(first, pivot, value, Q, bucket);
   else
-    knn<J>(next(pivot), last, value, Q);
-  if (dist_nth<I>(value, *pivot) <= Q.max_key())
+    knn<J>(next(pivot), last, value, Q, bucket);
+  if (nan_last(dist_nth<I>(value, *pivot)) <= Q.max_key())
   {
     if (search_left)
-      knn<J>(next(pivot), last, value, Q);
+      knn<J>(next(pivot), last, value, Q, bucket);
     else
-      knn<J>(first, pivot, value, Q);
+      knn<J>(first, pivot, value, Q, bucket);
   }
+  else KDTOOLS_STAT(subtrees_pruned);
 }
 
-} // namespace detail
+// Visitors are called with an iterator to each hit. They may return void,
+// or bool, where false stops the search.
+template <typename Visitor, typename Iter>
+typename enable_if<is_same<decltype(std::declval<Visitor&>()(
+  std::declval<Iter>())), void>::value, bool>::type
+visit(Visitor& f, Iter it)
+{
+  f(it);
+  return true;
+}
 
-namespace utils {
+template <typename Visitor, typename Iter>
+typename enable_if<!is_same<decltype(std::declval<Visitor&>()(
+  std::declval<Iter>())), void>::value, bool>::type
+visit(Visitor& f, Iter it)
+{
+  return static_cast<bool>(f(it));
+}
 
-using detail::all_less;
-using detail::none_less;
-using detail::within;
+template <size_t I,
+          typename Iter,
+          typename TupleType,
+          typename Visitor>
+bool kd_range_visit(Iter first, Iter last,
+                    const TupleType& lower,
+                    const TupleType& upper,
+                    Visitor& f, size_t bucket = 1)
+{
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pred = less_nth<I>();
+    auto pivot = find_pivot<I>(first, last);
+    constexpr auto J = next_dim<I, TupleType>::value;
+    if (within(*pivot, lower, upper) && !visit(f, pivot)) return false;
+    if (!pred(*pivot, lower)) { // search left
+      if (!kd_range_visit<J>(first, pivot, lower, upper, f, bucket))
+        return false;
+    }
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (pred(*pivot, upper)) // search right
+      return kd_range_visit<J>(next(pivot), last, lower, upper, f, bucket);
+    KDTOOLS_STAT(subtrees_pruned);
+    return true;
+  }
+  for (; first != last; ++first)
+  {
+    KDTOOLS_STAT(points_scanned);
+    if (within(*first, lower, upper) && !visit(f, first)) return false;
+  }
+  return true;
+}
 
-using detail::middle_of;
-using detail::find_pivot;
+template <size_t I,
+          typename Iter,
+          typename TupleType,
+          typename Visitor>
+bool kd_radius_visit(Iter first, Iter last,
+                     const TupleType& value,
+                     double radius,
+                     Visitor& f, size_t bucket = 1)
+{
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = find_pivot<I>(first, last);
+    constexpr auto J = next_dim<I, TupleType>::value;
+    if (l2dist(*pivot, value) <= radius && !visit(f, pivot)) return false;
+    if (!(diff_nth<I>(value, *pivot) > radius)) { // search left, also of NaN
+      if (!kd_radius_visit<J>(first, pivot, value, radius, f, bucket))
+        return false;
+    }
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (diff_nth<I>(*pivot, value) <= radius) // search right
+      return kd_radius_visit<J>(next(pivot), last, value, radius, f, bucket);
+    KDTOOLS_STAT(subtrees_pruned);
+    return true;
+  }
+  for (; first != last; ++first)
+  {
+    KDTOOLS_STAT(points_scanned);
+    if (l2dist(*first, value) <= radius && !visit(f, first)) return false;
+  }
+  return true;
+}
 
-using detail::is_last;
-using detail::is_not_last;
-using detail::incr_wrap;
-using detail::next_dim;
+// Signed difference along a dimension chosen at run time
+template <size_t I, typename T>
+typename enable_if<is_last<I, T>::value, double>::type
+diff_at(const T& lhs, const T& rhs, size_t)
+{
+  return diff_nth<I>(lhs, rhs);
+}
 
-using detail::kd_less;
-using detail::less_nth;
-using detail::equal_nth;
-using detail::pred_nth;
-using detail::dist_nth;
-using detail::kd_compare;
-using detail::make_kd_compare;
+template <size_t I, typename T>
+typename enable_if<is_not_last<I, T>::value, double>::type
+diff_at(const T& lhs, const T& rhs, size_t j)
+{
+  return j == I ? diff_nth<I>(lhs, rhs) : diff_at<I + 1>(lhs, rhs, j);
+}
 
-using detail::l2dist;
-using detail::sum_of_squares;
+// Entries of the best-first search: a point when last == first, otherwise
+// a partition with its splitting dimension. Keys are lower bounds on the
+// distance to anything in a partition, so points leave the queue in order
+// of distance.
+struct visit_entry
+{
+  double key;
+  size_t first, last, dim;
+  bool operator<(const visit_entry& rhs) const
+  {
+    return rhs.key < key;
+  }
+};
 
-} // namespace utils
+template <typename Iter,
+          typename TupleType,
+          typename Visitor>
+bool kd_nearest_visit(Iter first, Iter last,
+                      const TupleType& value,
+                      Visitor& f, size_t bucket = 1)
+{
+  constexpr auto N = ndim<TupleType>::value;
+  std::priority_queue<visit_entry> Q;
+  auto n = static_cast<size_t>(distance(first, last));
+  if (n > 0) Q.push(visit_entry{0, 0, n, 0});
+  while (!Q.empty())
+  {
+    auto e = Q.top();
+    Q.pop();
+    if (e.first == e.last)
+    {
+      if (!visit(f, next(first, e.first))) return false;
+      continue;
+    }
+    if (e.last - e.first <= bucket)
+    {
+      KDTOOLS_STAT_ADD(points_scanned, e.last - e.first);
+      for (auto i = e.first; i != e.last; ++i)
+        Q.push(visit_entry{nan_last(l2dist(*next(first, i), value)),
+                           i, i, 0});
+      continue;
+    }
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = e.first + (e.last - e.first) / 2;
+    auto& x = *next(first, pivot);
+    auto d = diff_at<0>(value, x, e.dim);
+    auto k = (e.dim + 1) % N;
+    Q.push(visit_entry{nan_last(l2dist(x, value)), pivot, pivot, 0});
+    if (e.first != pivot)
+      Q.push(visit_entry{d > e.key ? d : e.key, e.first, pivot, k});
+    if (pivot + 1 != e.last)
+      Q.push(visit_entry{-d > e.key ? -d : e.key, pivot + 1, e.last, k});
+  }
+  return true;
+}
 
-template <typename Iter>
-void lex_sort(Iter first, Iter last)
+// Companion pivot array for a kd-sorted range. Nodes hold the split value
+// and pivot offset of each partition so that queries need not search for
+// pivots or touch the data to choose a branch. They are stored in van Emde
+// Boas order: each subtree of half the height is contiguous, so the first
+// levels of every query share a few cache lines and pages.
+
+struct index_node
 {
-  std::sort(first, last, utils::kd_less<0>());
+  double split;
+  size_t pivot;
+  size_t child[2];
+};
+
+constexpr size_t no_node = numeric_limits<size_t>::max();
+
+template <size_t I, typename T>
+typename enable_if<is_not_pointer<T>::value, double>::type
+value_nth(const T& x)
+{
+  return static_cast<double>(get<I>(x));
 }
 
-template <typename Iter, typename Compare>
-void lex_sort(Iter first, Iter last, const Compare& comp)
+template <size_t I, typename T>
+typename enable_if<is_pointer<T>::value, double>::type
+value_nth(const T& x)
 {
-  std::sort(first, last, utils::make_kd_compare<0>(comp));
+  return static_cast<double>(get<I>(*x));
 }
 
-template <typename Iter>
-void kd_sort(Iter first, Iter last)
+template <size_t I>
+struct each_coord_
+{
+  template <typename T, typename F>
+  typename enable_if<is_not_last<I, T>::value>::type
+  operator()(const T& x, F& f) const
+  {
+    f(I, value_nth<I>(x));
+    each_coord_<I + 1>()(x, f);
+  }
+  template <typename T, typename F>
+  typename enable_if<is_last<I, T>::value>::type
+  operator()(const T& x, F& f) const
+  {
+    f(I, value_nth<I>(x));
+  }
+};
+
+template <size_t I, typename Iter>
+size_t build_index(Iter base, Iter first, Iter last,
+                   vector<index_node>& nodes, size_t bucket)
 {
-  detail::kd_sort<0>(first, last);
+  if (static_cast<size_t>(distance(first, last)) <= bucket) return no_node;
+  using TupleType = iter_value_t<Iter>;
+  constexpr auto J = next_dim<I, TupleType>::value;
+  auto pivot = find_pivot<I>(first, last);
+  auto k = nodes.size();
+  nodes.push_back(index_node{value_nth<I>(*pivot),
+                             static_cast<size_t>(distance(base, pivot)),
+                             {no_node, no_node}});
+  auto left = build_index<J>(base, first, pivot, nodes, bucket);
+  auto right = build_index<J>(base, next(pivot), last, nodes, bucket);
+  nodes[k].child[0] = left;
+  nodes[k].child[1] = right;
+  return k;
 }
 
-template <typename Iter>
-bool kd_is_sorted(Iter first, Iter last)
+inline size_t index_height(const vector<index_node>& nodes, size_t k)
 {
-  return detail::kd_is_sorted<0>(first, last);
+  if (k == no_node) return 0;
+  auto l = index_height(nodes, nodes[k].child[0]),
+    r = index_height(nodes, nodes[k].child[1]);
+  return 1 + (l < r ? r : l);
 }
 
-template <typename Iter, typename Compare>
-void kd_sort(Iter first, Iter last, const Compare& comp)
+// Lays out the subtree of the given height under k and appends the nodes
+// just below it to frontier, so each level is walked only once.
+
+inline void veb_order(const vector<index_node>& nodes, size_t k,
+                      size_t height, vector<size_t>& out,
+                      vector<size_t>& frontier)
 {
-  detail::kd_sort<0>(first, last, comp);
+  if (k == no_node) return;
+  if (height == 1)
+  {
+    out.push_back(k);
+    for (auto c : nodes[k].child)
+      if (c != no_node) frontier.push_back(c);
+    return;
+  }
+  auto top = height / 2;
+  vector<size_t> bottom;
+  veb_order(nodes, k, top, out, bottom);
+  for (auto b : bottom) veb_order(nodes, b, height - top, out, frontier);
 }
 
-template <typename Iter, typename Compare>
-bool kd_is_sorted(Iter first, Iter last, const Compare& comp)
+inline vector<index_node> veb_layout(const vector<index_node>& nodes)
 {
-  return detail::kd_is_sorted<0>(first, last, comp);
+  vector<size_t> order;
+  order.reserve(nodes.size());
+  vector<size_t> frontier;
+  if (!nodes.empty())
+    veb_order(nodes, 0, index_height(nodes, 0), order, frontier);
+  vector<size_t> pos(nodes.size());
+  for (size_t i = 0; i != order.size(); ++i) pos[order[i]] = i;
+  vector<index_node> res(nodes.size());
+  for (size_t i = 0; i != order.size(); ++i)
+  {
+    res[i] = nodes[order[i]];
+    for (auto& c : res[i].child)
+      if (c != no_node) c = pos[c];
+  }
+  return res;
+}
+
+// Optional bounding boxes of the range under each index node, stored as N
+// lower then N upper coordinates per node in node order. A NaN coordinate
+// makes its dimension unbounded so that the box never excludes or accepts
+// on it.
+
+template <typename TupleType>
+void grow_box(double* box, const TupleType& x)
+{
+  constexpr auto N = ndim<TupleType>::value;
+  auto f = [&](size_t j, double v){
+    if (v != v)
+    {
+      box[j] = -numeric_limits<double>::infinity();
+      box[N + j] = numeric_limits<double>::infinity();
+    }
+    if (v < box[j]) box[j] = v;
+    if (box[N + j] < v) box[N + j] = v;
+  };
+  each_coord_<0>()(x, f);
 }
 
 template <typename Iter>
-void kd_sort_threaded(Iter first, Iter last)
+void build_boxes(const index_node* nodes, size_t k,
+                 Iter base, Iter first, Iter last,
+                 double* boxes, double* out)
 {
-  detail::kd_sort_threaded<0>(first, last);
+  constexpr auto N = ndim<iter_value_t<Iter>>::value;
+  std::fill(out, out + N, numeric_limits<double>::infinity());
+  std::fill(out + N, out + 2 * N, -numeric_limits<double>::infinity());
+  if (k == no_node)
+  {
+    for (; first != last; ++first) grow_box(out, *first);
+    return;
+  }
+  auto pivot = next(base, nodes[k].pivot);
+  grow_box(out, *pivot);
+  array<double, 2 * N> leaf;
+  for (int side = 0; side != 2; ++side)
+  {
+    auto c = nodes[k].child[side];
+    auto box = c == no_node ? leaf.data() : boxes + 2 * N * c;
+    if (side == 0) build_boxes(nodes, c, base, first, pivot, boxes, box);
+    else build_boxes(nodes, c, base, next(pivot), last, boxes, box);
+    for (size_t j = 0; j != N; ++j)
+    {
+      if (box[j] < out[j]) out[j] = box[j];
+      if (out[N + j] < box[N + j]) out[N + j] = box[N + j];
+    }
+  }
 }
 
-template <typename Iter, typename Value>
-Iter kd_lower_bound(Iter first, Iter last, const Value& value)
+template <typename TupleType>
+array<double, ndim<TupleType>::value> coords(const TupleType& x)
 {
-  return detail::kd_lower_bound<0>(first, last, value);
+  array<double, ndim<TupleType>::value> res;
+  auto f = [&](size_t j, double v){ res[j] = v; };
+  each_coord_<0>()(x, f);
+  return res;
 }
 
-template <typename Iter, typename Value>
-Iter kd_upper_bound(Iter first, Iter last, const Value& value)
+template <typename TupleType>
+array<double, 2 * ndim<TupleType>::value>
+coords(const TupleType& lower, const TupleType& upper)
 {
-  return detail::kd_upper_bound<0>(first, last, value);
+  constexpr auto N = ndim<TupleType>::value;
+  array<double, 2 * N> res;
+  auto f = [&](size_t j, double v){ res[j] = v; };
+  auto g = [&](size_t j, double v){ res[N + j] = v; };
+  each_coord_<0>()(lower, f);
+  each_coord_<0>()(upper, g);
+  return res;
 }
 
-template <typename Iter, typename TupleType>
-bool kd_binary_search(Iter first, Iter last, const TupleType& value)
+// Query boxes q hold N lower then N upper coordinates and are half-open
+template <size_t N>
+bool box_disjoint(const double* box, const double* q)
 {
-  first = detail::kd_lower_bound<0>(first, last, value);
-  return first != last && utils::none_less(value, *first);
+  for (size_t j = 0; j != N; ++j)
+    if (box[N + j] < q[j] || !(box[j] < q[N + j])) return true;
+  return false;
 }
 
-template <typename Iter, typename Value>
-std::pair<Iter, Iter> kd_equal_range(Iter first, Iter last, const Value& value)
+template <size_t N>
+bool box_inside(const double* box, const double* q)
 {
-  return std::make_pair(detail::kd_lower_bound<0>(first, last, value),
-                        detail::kd_upper_bound<0>(first, last, value));
+  for (size_t j = 0; j != N; ++j)
+    if (box[j] < q[j] || !(box[N + j] < q[N + j])) return false;
+  return true;
 }
 
-template <typename Iter, typename TupleType>
-Iter kd_nearest_neighbor(Iter first, Iter last, const TupleType& value)
+template <size_t N>
+double box_min_dist(const double* box, const double* v)
 {
-  return detail::kd_nearest_neighbor<0>(first, last, value);
+  double ss = 0;
+  for (size_t j = 0; j != N; ++j)
+  {
+    auto d = box[j] - v[j];
+    if (d < 0) d = v[j] - box[N + j];
+    if (d > 0) ss += d * d;
+  }
+  return std::sqrt(ss);
 }
 
-template <typename Iter,
+template <size_t N>
+double box_max_dist(const double* box, const double* v)
+{
+  double ss = 0;
+  for (size_t j = 0; j != N; ++j)
+  {
+    auto a = std::abs(v[j] - box[j]), b = std::abs(box[N + j] - v[j]);
+    ss += a < b ? b * b : a * a;
+  }
+  return std::sqrt(ss);
+}
+
+template <size_t I, typename Iter, typename TupleType>
+Iter kd_nearest_neighbor_index(const index_node* nodes, size_t k,
+                               Iter base, Iter first, Iter last,
+                               const TupleType& value, size_t bucket)
+{
+  constexpr auto J = next_dim<I, TupleType>::value;
+  if (static_cast<size_t>(distance(first, last)) > bucket)
+  {
+    KDTOOLS_STAT(nodes_visited);
+    auto& node = nodes[k];
+    auto pivot = next(base, node.pivot);
+    auto v = value_nth<I>(value);
+    auto search_left = sort_less(v, node.split);
+    auto search = search_left ?
+      kd_nearest_neighbor_index<J>(nodes, node.child[0], base,
+                                   first, pivot, value, bucket) :
+        kd_nearest_neighbor_index<J>(nodes, node.child[1], base,
+                                     next(pivot), last, value, bucket);
+    auto min_dist = nan_last(l2dist(*pivot, value));
+    if (search == last) search = pivot;
+    else
+    {
+      auto sdist = nan_last(l2dist(*search, value));
+      if (sdist < min_dist) min_dist = sdist;
+      else search = pivot;
+    }
+    if (nan_last(std::abs(v - node.split)) < min_dist)
+    {
+      auto s2 = search_left ?
+        kd_nearest_neighbor_index<J>(nodes, node.child[1], base,
+                                     next(pivot), last, value, bucket) :
+          kd_nearest_neighbor_index<J>(nodes, node.child[0], base,
+                                       first, pivot, value, bucket);
+      if (s2 != last && nan_last(l2dist(*s2, value)) < min_dist) search = s2;
+    }
+    else KDTOOLS_STAT(subtrees_pruned);
+    return search;
+  }
+  using T = iter_value_t<Iter>;
+  return std::min_element(first, last, [&](const T& x, const T& y){
+    return nan_last(l2dist(x, value)) < nan_last(l2dist(y, value));
+  });
+}
+
+template <size_t I, typename Iter, typename TupleType>
+bool kd_binary_search_index(const index_node* nodes, size_t k,
+                            Iter base, Iter first, Iter last,
+                            const TupleType& value, size_t bucket)
+{
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket))
+  {
+    KDTOOLS_STAT(nodes_visited);
+    auto& node = nodes[k];
+    auto pivot = next(base, node.pivot);
+    if (none_less(*pivot, value) && none_less(value, *pivot)) return true;
+    constexpr auto J = next_dim<I, TupleType>::value;
+    auto v = value_nth<I>(value);
+    // copies equal to the split may lie on either side
+    return (!(node.split < v) &&
+            kd_binary_search_index<J>(nodes, node.child[0], base,
+                                      first, pivot, value, bucket)) ||
+      (!(v < node.split) &&
+       kd_binary_search_index<J>(nodes, node.child[1], base,
+                                 next(pivot), last, value, bucket));
+  }
+  KDTOOLS_STAT_ADD(points_scanned, distance(first, last));
+  using T = iter_value_t<Iter>;
+  return std::any_of(first, last, [&](const T& x){
+    return none_less(x, value) && none_less(value, x);
+  });
+}
+
+template <size_t I,
+          typename Iter,
           typename TupleType,
           typename OutIter>
-void kd_range_query(Iter first, Iter last,
-                    const TupleType& lower,
-                    const TupleType& upper,
-                    OutIter outp)
+void kd_range_query_index(const index_node* nodes, const double* boxes,
+                          const double* q, size_t k,
+                          Iter base, Iter first, Iter last,
+                          const TupleType& lower,
+                          const TupleType& upper,
+                          OutIter outp, size_t bucket)
 {
-  detail::kd_range_query<0>(first, last, lower, upper, outp);
+  constexpr auto N = ndim<TupleType>::value;
+  if (boxes && k != no_node)
+  {
+    auto box = boxes + 2 * N * k;
+    if (box_disjoint<N>(box, q))
+    {
+      KDTOOLS_STAT(subtrees_pruned);
+      return;
+    }
+    if (box_inside<N>(box, q))
+    {
+      std::copy(first, last, outp);
+      return;
+    }
+  }
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto& node = nodes[k];
+    auto pivot = next(base, node.pivot);
+    constexpr auto J = next_dim<I, TupleType>::value;
+    auto go_left = !(node.split < value_nth<I>(lower)),
+      go_right = node.split < value_nth<I>(upper);
+    if (go_left && go_right && within(*pivot, lower, upper)) *outp++ = *pivot;
+    if (go_left)
+      kd_range_query_index<J>(nodes, boxes, q, node.child[0], base, first,
+                              pivot, lower, upper, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (go_right)
+      kd_range_query_index<J>(nodes, boxes, q, node.child[1], base,
+                              next(pivot), last, lower, upper, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, distance(first, last));
+    copy_if(first, last, outp, [&](const TupleType& x){
+      return within(x, lower, upper);
+    });
+  }
 }
 
-template <typename Iter,
+template <size_t I,
+          typename Iter,
           typename TupleType,
           typename OutIter>
-void kd_nearest_neighbors(Iter first, Iter last,
-                          const TupleType& value,
-                          size_t n, OutIter outp)
+void kd_radius_query_index(const index_node* nodes, const double* boxes,
+                           const double* q, size_t k,
+                           Iter base, Iter first, Iter last,
+                           const TupleType& value,
+                           double radius,
+                           OutIter outp, size_t bucket)
 {
-  detail::n_best<Iter> Q(n);
-  detail::knn<0>(first, last, value, Q);
-  Q.copy_to(outp);
+  constexpr auto N = ndim<TupleType>::value;
+  if (boxes && k != no_node)
+  {
+    auto box = boxes + 2 * N * k;
+    if (radius < box_min_dist<N>(box, q))
+    {
+      KDTOOLS_STAT(subtrees_pruned);
+      return;
+    }
+    if (box_max_dist<N>(box, q) <= radius)
+    {
+      std::copy(first, last, outp);
+      return;
+    }
+  }
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto& node = nodes[k];
+    auto pivot = next(base, node.pivot);
+    constexpr auto J = next_dim<I, TupleType>::value;
+    auto v = value_nth<I>(value);
+    if (l2dist(*pivot, value) <= radius) *outp++ = *pivot;
+    if (!(v - node.split > radius)) // search left, also of NaN
+      kd_radius_query_index<J>(nodes, boxes, q, node.child[0], base, first,
+                               pivot, value, radius, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (node.split - v <= radius) // search right
+      kd_radius_query_index<J>(nodes, boxes, q, node.child[1], base,
+                               next(pivot), last, value, radius, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, distance(first, last));
+    copy_if(first, last, outp, [&](const TupleType& x){
+      return l2dist(x, value) <= radius;
+    });
+  }
+}
+
+template <size_t I,
+          typename Iter,
+          typename TupleType,
+          typename QType>
+void knn_index(const index_node* nodes, const double* boxes,
+               const double* q, size_t k,
+               Iter base, Iter first, Iter last,
+               const TupleType& value,
+               QType& Q, size_t bucket)
+{
+  constexpr auto N = ndim<TupleType>::value;
+  if (boxes && k != no_node &&
+      Q.max_key() < box_min_dist<N>(boxes + 2 * N * k, q))
+  {
+    KDTOOLS_STAT(subtrees_pruned);
+    return;
+  }
+  if (static_cast<size_t>(distance(first, last)) <= bucket)
+  {
+    for (; first != last; ++first) Q.add(l2dist(*first, value), first);
+    return;
+  }
+  KDTOOLS_STAT(nodes_visited);
+  auto& node = nodes[k];
+  auto pivot = next(base, node.pivot);
+  Q.add(l2dist(*pivot, value), pivot);
+  auto v = value_nth<I>(value);
+  // a NaN split has every number on its left, as in knn
+  auto search_left = sort_less(v, node.split);
+  constexpr auto J = next_dim<I, TupleType>::value;
+  if (search_left)
+    knn_index<J>(nodes, boxes, q, node.child[0], base, first, pivot,
+                 value, Q, bucket);
+  else
+    knn_index<J>(nodes, boxes, q, node.child[1], base, next(pivot), last,
+                 value, Q, bucket);
+  if (nan_last(std::abs(v - node.split)) <= Q.max_key())
+  {
+    if (search_left)
+      knn_index<J>(nodes, boxes, q, node.child[1], base, next(pivot), last,
+                   value, Q, bucket);
+    else
+      knn_index<J>(nodes, boxes, q, node.child[0], base, first, pivot,
+                   value, Q, bucket);
+  }
+  else KDTOOLS_STAT(subtrees_pruned);
+}
+
+// Exact-match tables map each distinct tuple to the offsets of its copies.
+// Equal tuples need not be adjacent in kd order, so the offsets of each key
+// are grouped in a side array rather than stored as a subrange of the data.
+// Tuples are equal when their coordinates are. Floating point coordinates
+// are compared by radix key, so zero matches negative zero and NaN matches
+// a NaN with the same bits, such as R's NA.
+
+struct hash_slot
+{
+  size_t hash, start, count;
+};
+
+inline std::uint64_t hash_mix(std::uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 33);
+}
+
+template <typename T>
+typename enable_if<is_radix_key<T>::value, std::uint64_t>::type
+hash_element(const T& x)
+{
+  return radix_key(x);
+}
+
+template <typename T>
+typename enable_if<!is_radix_key<T>::value, std::uint64_t>::type
+hash_element(const T& x)
+{
+  return std::hash<T>()(x);
+}
+
+template <size_t I>
+struct tuple_hash_
+{
+  template <typename T>
+  typename enable_if<is_not_last<I, T>::value, std::uint64_t>::type
+  operator()(const T& x, std::uint64_t h) const
+  {
+    return tuple_hash_<I + 1>()(x, hash_mix(h ^ hash_element(get<I>(x))));
+  }
+  template <typename T>
+  typename enable_if<is_last<I, T>::value, std::uint64_t>::type
+  operator()(const T& x, std::uint64_t h) const
+  {
+    return hash_mix(h ^ hash_element(get<I>(x)));
+  }
+};
+
+template <typename T>
+typename enable_if<is_not_pointer<T>::value, size_t>::type
+tuple_hash(const T& x)
+{
+  return static_cast<size_t>(tuple_hash_<0>()(x, 0));
+}
+
+template <typename T>
+typename enable_if<is_pointer<T>::value, size_t>::type
+tuple_hash(const T& x)
+{
+  return static_cast<size_t>(tuple_hash_<0>()(*x, 0));
+}
+
+template <typename T>
+typename enable_if<is_radix_key<T>::value, bool>::type
+element_equal(const T& lhs, const T& rhs)
+{
+  return radix_key(lhs) == radix_key(rhs);
+}
+
+template <typename T>
+typename enable_if<!is_radix_key<T>::value, bool>::type
+element_equal(const T& lhs, const T& rhs)
+{
+  return !(lhs < rhs) && !(rhs < lhs);
+}
+
+template <size_t I>
+struct tuple_equal_
+{
+  template <typename T>
+  typename enable_if<is_not_last<I, T>::value, bool>::type
+  operator()(const T& lhs, const T& rhs) const
+  {
+    return element_equal(get<I>(lhs), get<I>(rhs)) &&
+      tuple_equal_<I + 1>()(lhs, rhs);
+  }
+  template <typename T>
+  typename enable_if<is_last<I, T>::value, bool>::type
+  operator()(const T& lhs, const T& rhs) const
+  {
+    return element_equal(get<I>(lhs), get<I>(rhs));
+  }
+};
+
+template <typename T>
+typename enable_if<is_not_pointer<T>::value, bool>::type
+tuple_equal(const T& lhs, const T& rhs)
+{
+  return tuple_equal_<0>()(lhs, rhs);
+}
+
+template <typename T>
+typename enable_if<is_pointer<T>::value, bool>::type
+tuple_equal(const T& lhs, const T& rhs)
+{
+  return tuple_equal_<0>()(*lhs, *rhs);
+}
+
+template <typename Iter>
+void build_hash(Iter first, Iter last,
+                vector<hash_slot>& slots, vector<size_t>& offsets)
+{
+  auto n = static_cast<size_t>(distance(first, last));
+  size_t m = 2;
+  while (m < 2 * n) m *= 2;
+  auto mask = m - 1;
+  slots.assign(m, hash_slot{0, 0, 0});
+  vector<size_t> where(n);
+  auto it = first;
+  for (size_t i = 0; i != n; ++i, ++it)
+  {
+    auto h = tuple_hash(*it);
+    auto s = h & mask;
+    // start holds the first copy's offset until the table is complete
+    while (slots[s].count != 0 &&
+           !(slots[s].hash == h &&
+             tuple_equal(*next(first, slots[s].start), *it)))
+      s = (s + 1) & mask;
+    if (slots[s].count++ == 0)
+    {
+      slots[s].hash = h;
+      slots[s].start = i;
+    }
+    where[i] = s;
+  }
+  size_t end = 0;
+  for (auto& s : slots)
+  {
+    end += s.count;
+    s.start = end;
+  }
+  offsets.resize(n);
+  for (size_t i = n; i-- != 0;)
+    offsets[--slots[where[i]].start] = i;
+}
+
+template <typename Iter, typename TupleType>
+pair<const size_t*, const size_t*>
+find_hash(const vector<hash_slot>& slots, const vector<size_t>& offsets,
+          Iter first, const TupleType& value)
+{
+  auto mask = slots.size() - 1;
+  auto h = tuple_hash(value);
+  for (auto s = h & mask; slots[s].count != 0; s = (s + 1) & mask)
+  {
+    auto& slot = slots[s];
+    auto p = offsets.data() + slot.start;
+    if (slot.hash == h && tuple_equal(*next(first, *p), value))
+      return std::make_pair(p, p + slot.count);
+  }
+  return std::make_pair(offsets.data(), offsets.data());
+}
+
+// Space-filling curve orderings. Coordinates are scaled onto a grid of
+// 2^bits cells per dimension over a bounding box and the cell indices are
+// interleaved into 64-bit keys, highest bit of the first dimension first.
+// Each dimension gets 64 / ndim bits, capped at 32 so that cells fit in
+// 32 bits; one-dimensional keys therefore use only their low half.
+// Every aligned block of cells is a contiguous run of keys on both curves,
+// so a query box can be searched block by block on the sorted keys.
+// Scaling is monotone, so queries are exact; a coarse grid only costs
+// extra scanning.
+
+struct curve_grid
+{
+  size_t m_ndim;
+  unsigned m_bits;
+  vector<double> m_lower, m_scale;
+  curve_grid(const vector<double>& lower, const vector<double>& upper)
+  {
+    m_ndim = lower.size() < 64 ? lower.size() : 64;
+    m_bits = m_ndim == 0 ? 0 : 64 / m_ndim < 32 ? 64 / m_ndim : 32;
+    m_lower.assign(begin(lower), begin(lower) + m_ndim);
+    m_scale.resize(m_ndim);
+    for (size_t j = 0; j != m_ndim; ++j)
+    {
+      auto w = upper[j] - lower[j];
+      m_scale[j] = w > 0 && std::isfinite(w) ? std::ldexp(1.0, m_bits) / w : 0;
+    }
+  }
+  std::uint32_t cell_max() const
+  {
+    return static_cast<std::uint32_t>((std::uint64_t(1) << m_bits) - 1);
+  }
+  std::uint32_t cell(size_t j, double x) const
+  {
+    auto c = (x - m_lower[j]) * m_scale[j];
+    if (!(c > 0)) return 0;
+    return c < cell_max() ? static_cast<std::uint32_t>(c) : cell_max();
+  }
+};
+
+template <typename Iter>
+curve_grid make_grid(Iter first, Iter last)
+{
+  constexpr auto N = ndim<iter_value_t<Iter>>::value;
+  vector<double> lower(N, numeric_limits<double>::infinity()),
+    upper(N, -numeric_limits<double>::infinity());
+  auto f = [&](size_t j, double x){
+    if (!std::isfinite(x)) return;
+    if (x < lower[j]) lower[j] = x;
+    if (upper[j] < x) upper[j] = x;
+  };
+  for (; first != last; ++first) each_coord_<0>()(*first, f);
+  return curve_grid(lower, upper);
+}
+
+template <typename TupleType>
+curve_grid bounds_grid(const TupleType& lower, const TupleType& upper)
+{
+  array<TupleType, 2> b{{lower, upper}};
+  return make_grid(begin(b), end(b));
+}
+
+template <typename TupleType>
+void tuple_cells(const curve_grid& g, const TupleType& x, std::uint32_t* out)
+{
+  auto f = [&](size_t j, double v){
+    if (j < g.m_ndim) out[j] = g.cell(j, v);
+  };
+  each_coord_<0>()(x, f);
+}
+
+inline std::uint64_t spread2(std::uint64_t x)
+{
+  x = (x | x << 16) & 0x0000ffff0000ffffULL;
+  x = (x | x << 8) & 0x00ff00ff00ff00ffULL;
+  x = (x | x << 4) & 0x0f0f0f0f0f0f0f0fULL;
+  x = (x | x << 2) & 0x3333333333333333ULL;
+  return (x | x << 1) & 0x5555555555555555ULL;
+}
+
+inline std::uint64_t spread3(std::uint64_t x)
+{
+  x = (x | x << 32) & 0x001f00000000ffffULL;
+  x = (x | x << 16) & 0x001f0000ff0000ffULL;
+  x = (x | x << 8) & 0x100f00f00f00f00fULL;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+  return (x | x << 2) & 0x1249249249249249ULL;
+}
+
+inline std::uint64_t interleave(const std::uint32_t* x, size_t nd,
+                                unsigned bits)
+{
+  switch (nd)
+  {
+  case 1: return x[0];
+  case 2: return spread2(x[0]) << 1 | spread2(x[1]);
+  case 3: return spread3(x[0]) << 2 | spread3(x[1]) << 1 | spread3(x[2]);
+  }
+  std::uint64_t k = 0;
+  for (auto b = bits; b-- != 0;)
+    for (size_t j = 0; j != nd; ++j)
+      k = k << 1 | (x[j] >> b & 1);
+  return k;
+}
+
+inline std::uint64_t low_mask(size_t n)
+{
+  return n >= 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << n) - 1;
+}
+
+inline std::uint64_t rotate_left(std::uint64_t x, size_t r, size_t n)
+{
+  r %= n;
+  return r == 0 ? x : (x << r | x >> (n - r)) & low_mask(n);
+}
+
+inline std::uint64_t rotate_right(std::uint64_t x, size_t r, size_t n)
+{
+  r %= n;
+  return r == 0 ? x : (x >> r | x << (n - r)) & low_mask(n);
+}
+
+inline std::uint64_t gray_inverse(std::uint64_t x, size_t n)
+{
+  for (size_t s = 1; s < n; s <<= 1) x ^= x >> s;
+  return x;
+}
+
+inline size_t trailing_ones(std::uint64_t x)
+{
+  size_t k = 0;
+  for (; x & 1; x >>= 1) ++k;
+  return k;
+}
+
+// Hamilton's formulation of the Hilbert curve. Each level reads one bit
+// of every cell, the Morton digit l, and maps it to the Hilbert digit
+// given the entry corner e and direction d of the enclosing block.
+struct hilbert_state
+{
+  std::uint64_t e;
+  size_t d;
+  std::uint64_t step(std::uint64_t l, size_t n)
+  {
+    auto w = gray_inverse(rotate_right(l ^ e, d + 1, n), n);
+    auto g = (w - 1) & ~std::uint64_t(1);
+    auto entry = w == 0 ? 0 : g ^ g >> 1;
+    auto dir = w == 0 ? 0 : trailing_ones(w & 1 ? w : w - 1);
+    e ^= rotate_left(entry, d + 1, n);
+    d = (d + dir + 1) % n;
+    return w;
+  }
+};
+
+// Entry s * 2^n + l holds the digit for Morton digit l in state s plus the
+// next state times 2^n; the state of corner e and direction d is e * n + d
+inline vector<std::uint16_t> make_hilbert_table(size_t n)
+{
+  auto m = size_t(1) << n;
+  vector<std::uint16_t> res(n * m * m);
+  for (size_t e = 0; e != m; ++e)
+    for (size_t d = 0; d != n; ++d)
+      for (size_t l = 0; l != m; ++l)
+      {
+        hilbert_state s{e, d};
+        auto w = s.step(l, n);
+        res[((e * n + d) << n) + l] =
+          static_cast<std::uint16_t>(((s.e * n + s.d) << n) + w);
+      }
+  return res;
+}
+
+template <size_t N>
+const std::uint16_t* hilbert_table()
+{
+  static const vector<std::uint16_t> table = make_hilbert_table(N);
+  return table.data();
+}
+
+inline std::uint64_t hilbert_key(std::uint64_t morton, size_t nd,
+                                 unsigned bits)
+{
+  const std::uint16_t* table = nullptr;
+  switch (nd)
+  {
+  case 1: return morton;
+  case 2: table = hilbert_table<2>(); break;
+  case 3: table = hilbert_table<3>(); break;
+  case 4: table = hilbert_table<4>(); break;
+  }
+  auto m = low_mask(nd);
+  std::uint64_t h = 0;
+  if (table)
+  {
+    std::uint64_t s = 0;
+    for (auto b = bits; b-- != 0;)
+    {
+      s = table[s + (morton >> b * nd & m)];
+      h = h << nd | (s & m);
+      s &= ~m;
+    }
+    return h;
+  }
+  hilbert_state s{0, 0};
+  for (auto b = bits; b-- != 0;)
+    h = h << nd | s.step(morton >> b * nd & m, nd);
+  return h;
+}
+
+// On both curves the key of the leading bits of each cell is the leading
+// bits of the full key
+inline std::uint64_t curve_key(const curve_grid& g, curve_type c,
+                               const std::uint32_t* x, unsigned bits)
+{
+  auto k = interleave(x, g.m_ndim, bits);
+  return c == curve_type::hilbert ? hilbert_key(k, g.m_ndim, bits) : k;
+}
+
+inline std::uint64_t curve_key(const curve_grid& g, curve_type c,
+                               const std::uint32_t* x)
+{
+  return curve_key(g, c, x, g.m_bits);
+}
+
+constexpr size_t curve_cutoff = 1 << 15;
+
+inline size_t curve_threads(size_t n, int max_threads)
+{
+  return max_threads > 1 && n >= curve_cutoff ?
+    static_cast<size_t>(max_threads) : 1;
+}
+
+// Calls f(t, first, last) on nthreads equal chunks of [0, n)
+template <typename F>
+void for_chunks(size_t n, size_t nthreads, F f)
+{
+  vector<thread> pool;
+  for (size_t t = 1; t < nthreads; ++t)
+    pool.emplace_back(f, t, n * t / nthreads, n * (t + 1) / nthreads);
+  f(0, 0, n / nthreads);
+  for (auto& t : pool) t.join();
+}
+
+struct curve_entry
+{
+  std::uint64_t key;
+  size_t index;
+};
+
+constexpr unsigned curve_digit = 11;
+constexpr size_t curve_radix = size_t(1) << curve_digit;
+
+// Least significant digit first, so each pass is stable; chunks count and
+// scatter their own elements into per-thread slices of each bucket
+inline void radix_sort_keys(vector<curve_entry>& x, unsigned key_bits,
+                            size_t nthreads)
+{
+  auto n = x.size();
+  if (n < curve_radix)
+  {
+    std::sort(begin(x), end(x), [](const curve_entry& a, const curve_entry& b){
+      return a.key < b.key || (a.key == b.key && a.index < b.index);
+    });
+    return;
+  }
+  vector<curve_entry> buf(n);
+  vector<array<size_t, curve_radix>> count(nthreads);
+  for (unsigned shift = 0; shift < key_bits; shift += curve_digit)
+  {
+    for_chunks(n, nthreads, [&](size_t t, size_t first, size_t last){
+      auto& h = count[t];
+      h.fill(0);
+      for (auto i = first; i != last; ++i)
+        ++h[x[i].key >> shift & (curve_radix - 1)];
+    });
+    size_t total = 0;
+    bool trivial = false;
+    for (size_t d = 0; d != curve_radix && !trivial; ++d)
+    {
+      size_t s = 0;
+      for (auto& h : count) s += h[d];
+      trivial = s == n;
+    }
+    if (trivial) continue;
+    for (size_t d = 0; d != curve_radix; ++d)
+      for (auto& h : count)
+      {
+        auto c = h[d];
+        h[d] = total;
+        total += c;
+      }
+    for_chunks(n, nthreads, [&](size_t t, size_t first, size_t last){
+      auto& h = count[t];
+      for (auto i = first; i != last; ++i)
+        buf[h[x[i].key >> shift & (curve_radix - 1)]++] = x[i];
+    });
+    x.swap(buf);
+  }
+}
+
+// Cells(i, out) writes the cells of the i-th point
+template <typename Cells>
+vector<curve_entry> curve_sort_keys(size_t n, const curve_grid& g,
+                                    curve_type c, Cells cells,
+                                    int max_threads)
+{
+  vector<curve_entry> res(n);
+  auto nthreads = curve_threads(n, max_threads);
+  for_chunks(n, nthreads, [&](size_t, size_t first, size_t last){
+    vector<std::uint32_t> x(g.m_ndim);
+    for (auto i = first; i != last; ++i)
+    {
+      cells(i, x.data());
+      res[i] = curve_entry{curve_key(g, c, x.data()), i};
+    }
+  });
+  radix_sort_keys(res, g.m_bits * static_cast<unsigned>(g.m_ndim), nthreads);
+  return res;
+}
+
+template <typename Iter>
+vector<curve_entry> curve_sort_keys(Iter first, Iter last,
+                                    const curve_grid& g, curve_type c,
+                                    int max_threads)
+{
+  return curve_sort_keys(static_cast<size_t>(distance(first, last)), g, c,
+                         [&](size_t i, std::uint32_t* out){
+                           tuple_cells(g, *next(first, i), out);
+                         }, max_threads);
+}
+
+// Sorts the range and returns its keys
+template <typename Iter>
+vector<std::uint64_t> curve_sort(Iter first, Iter last, const curve_grid& g,
+                                 curve_type c, int max_threads)
+{
+  auto e = curve_sort_keys(first, last, g, c, max_threads);
+  vector<iter_value_t<Iter>> tmp;
+  tmp.reserve(e.size());
+  for (auto& x : e) tmp.push_back(std::move(*next(first, x.index)));
+  std::move(begin(tmp), end(tmp), first);
+  vector<std::uint64_t> keys(e.size());
+  for (size_t i = 0; i != e.size(); ++i) keys[i] = e[i].key;
+  return keys;
+}
+
+constexpr size_t curve_leaf = 4;
+
+// Blocks of cells are split until they lie inside the box, hold at most
+// curve_leaf points per child block or are single cells. Each child is an
+// aligned block and so a run of keys, which is searched for within its
+// parent's run. A block has 2^nd children, so with 16 or more dimensions
+// blocks are not split and every key is passed to f; there each dimension
+// has at most 4 bits, too coarse for blocks to prune much anyway.
+// The block at each level is stored at level * nd in the scratch array;
+// the box may shrink during the scan.
+template <typename F>
+void curve_scan_block(const curve_grid& g, curve_type c,
+                      const vector<std::uint64_t>& keys,
+                      const std::uint32_t* lo, const std::uint32_t* hi,
+                      std::uint32_t* scratch, unsigned level,
+                      size_t first, size_t last, F& f)
+{
+  auto nd = g.m_ndim;
+  auto block = scratch + level * nd, child = block + nd;
+  auto shift = g.m_bits - level;
+  auto width = (std::uint64_t(1) << shift) - 1;
+  bool inside = true;
+  for (size_t j = 0; j != nd; ++j)
+  {
+    auto a = std::uint64_t(block[j]) << shift, z = a + width;
+    if (a < lo[j] || hi[j] < z) inside = false;
+  }
+  if (inside || shift == 0 || nd >= 16 ||
+      last - first <= (curve_leaf << nd))
+  {
+    for (auto i = first; i != last; ++i) f(i);
+    return;
+  }
+  --shift;
+  width >>= 1;
+  auto low = shift * static_cast<unsigned>(nd);
+  auto kb = next(begin(keys), first), ke = next(begin(keys), last);
+  for (size_t m = 0; m != size_t(1) << nd; ++m)
+  {
+    bool disjoint = false;
+    for (size_t j = 0; j != nd; ++j)
+    {
+      child[j] = block[j] << 1 | (m >> j & 1);
+      auto a = std::uint64_t(child[j]) << shift;
+      if (a + width < lo[j] || hi[j] < a) disjoint = true;
+    }
+    if (disjoint) continue;
+    auto k = curve_key(g, c, child, level + 1) << low;
+    auto a = std::lower_bound(kb, ke, k);
+    auto z = std::upper_bound(a, ke, k | ((std::uint64_t(1) << low) - 1));
+    if (a != z)
+      curve_scan_block(g, c, keys, lo, hi, scratch, level + 1,
+                       static_cast<size_t>(a - begin(keys)),
+                       static_cast<size_t>(z - begin(keys)), f);
+  }
+}
+
+// Calls f(i) for the offset of every key whose cells lie in [lo, hi],
+// and possibly for other keys
+template <typename F>
+void curve_scan(const curve_grid& g, curve_type c,
+                const vector<std::uint64_t>& keys,
+                const std::uint32_t* lo, const std::uint32_t* hi, F f)
+{
+  for (size_t j = 0; j != g.m_ndim; ++j)
+    if (hi[j] < lo[j]) return;
+  vector<std::uint32_t> scratch((g.m_bits + 1) * g.m_ndim, 0);
+  curve_scan_block(g, c, keys, lo, hi, scratch.data(), 0, 0, keys.size(), f);
+}
+
+inline double wrap_offset(double x, double period)
+{
+  return x - period * std::floor(x / period);
+}
+
+template <typename T>
+double periodic_dist(const T& lhs, const T& rhs, const T& period)
+{
+  auto L = static_cast<double>(period);
+  auto d = std::fmod(scalar_dist(lhs, rhs), L);
+  return d < L - d ? d : L - d;
+}
+
+template <typename T>
+double periodic_width(const T& lower, const T& upper, const T& period)
+{
+  auto w = scalar_diff(upper, lower);
+  return w < 0 ? wrap_offset(w, period) : w;
+}
+
+template <typename T>
+double periodic_interval_dist(const T& x, const T& a, const T& b,
+                              const T& period)
+{
+  auto L = static_cast<double>(period), w = scalar_diff(b, a);
+  if (w >= L) return 0;
+  auto t = wrap_offset(scalar_diff(x, a), L);
+  if (t <= w) return 0;
+  return t - w < L - t ? t - w : L - t;
+}
+
+template <typename T>
+bool periodic_overlap(const T& a, const T& b,
+                      const T& lower, const T& upper,
+                      const T& period)
+{
+  auto L = static_cast<double>(period),
+       w = periodic_width(lower, upper, period);
+  if (w >= L || scalar_diff(b, a) >= L) return true;
+  if (wrap_offset(scalar_diff(a, lower), L) < w) return true;
+  return wrap_offset(scalar_diff(lower, a), L) <= scalar_diff(b, a);
+}
+
+template <typename T>
+bool periodic_within(const T& x,
+                     const T& lower, const T& upper,
+                     const T& period)
+{
+  auto L = static_cast<double>(period),
+       w = periodic_width(lower, upper, period);
+  return w >= L || wrap_offset(scalar_diff(x, lower), L) < w;
+}
+
+template <size_t I, typename TupleType>
+double periodic_dist_nth(const TupleType& lhs,
+                         const TupleType& rhs,
+                         const TupleType& box)
+{
+  return periodic_dist(get<I>(lhs), get<I>(rhs), get<I>(box));
+}
+
+template <size_t I, typename TupleType>
+double periodic_interval_dist_nth(const TupleType& value,
+                                  const TupleType& lower,
+                                  const TupleType& upper,
+                                  const TupleType& box)
+{
+  return periodic_interval_dist(get<I>(value), get<I>(lower),
+                                get<I>(upper), get<I>(box));
+}
+
+template <size_t I>
+struct sum_of_squares_periodic_
+{
+  template <typename TupleType>
+  typename enable_if<is_not_last<I, TupleType>::value, double>::type
+  operator()(const TupleType& lhs, const TupleType& rhs,
+             const TupleType& box) const
+  {
+    using next_ = sum_of_squares_periodic_<I + 1>;
+    return std::pow(periodic_dist_nth<I>(lhs, rhs, box), 2) +
+      next_()(lhs, rhs, box);
+  }
+  template <typename TupleType>
+  typename enable_if<is_last<I, TupleType>::value, double>::type
+  operator()(const TupleType& lhs, const TupleType& rhs,
+             const TupleType& box) const
+  {
+    return std::pow(periodic_dist_nth<I>(lhs, rhs, box), 2);
+  }
+};
+
+template <typename TupleType>
+double l2dist_periodic(const TupleType& lhs,
+                       const TupleType& rhs,
+                       const TupleType& box)
+{
+  KDTOOLS_STAT(distance_evals);
+  return std::sqrt(sum_of_squares_periodic_<0>()(lhs, rhs, box));
+}
+
+template <size_t I>
+struct cell_dist_periodic_
+{
+  template <typename TupleType>
+  typename enable_if<is_not_last<I, TupleType>::value, double>::type
+  operator()(const TupleType& value,
+             const TupleType& lower, const TupleType& upper,
+             const TupleType& box) const
+  {
+    using next_ = cell_dist_periodic_<I + 1>;
+    return std::pow(periodic_interval_dist_nth<I>(value, lower, upper, box), 2) +
+      next_()(value, lower, upper, box);
+  }
+  template <typename TupleType>
+  typename enable_if<is_last<I, TupleType>::value, double>::type
+  operator()(const TupleType& value,
+             const TupleType& lower, const TupleType& upper,
+             const TupleType& box) const
+  {
+    return std::pow(periodic_interval_dist_nth<I>(value, lower, upper, box), 2);
+  }
+};
+
+template <typename TupleType>
+double cell_dist_periodic(const TupleType& value,
+                          const TupleType& lower,
+                          const TupleType& upper,
+                          const TupleType& box)
+{
+  return std::sqrt(cell_dist_periodic_<0>()(value, lower, upper, box));
+}
+
+template <size_t I>
+struct within_periodic_
+{
+  template <typename TupleType>
+  typename enable_if<is_not_last<I, TupleType>::value, bool>::type
+  operator()(const TupleType& value,
+             const TupleType& lower, const TupleType& upper,
+             const TupleType& box) const
+  {
+    return periodic_within(get<I>(value), get<I>(lower),
+                           get<I>(upper), get<I>(box)) &&
+      within_periodic_<I + 1>()(value, lower, upper, box);
+  }
+  template <typename TupleType>
+  typename enable_if<is_last<I, TupleType>::value, bool>::type
+  operator()(const TupleType& value,
+             const TupleType& lower, const TupleType& upper,
+             const TupleType& box) const
+  {
+    return periodic_within(get<I>(value), get<I>(lower),
+                           get<I>(upper), get<I>(box));
+  }
+};
+
+template <typename TupleType>
+bool within_periodic(const TupleType& value,
+                     const TupleType& lower,
+                     const TupleType& upper,
+                     const TupleType& box)
+{
+  return within_periodic_<0>()(value, lower, upper, box);
+}
+
+template <typename T>
+typename enable_if<numeric_limits<T>::has_infinity, T>::type
+lowest_value()
+{
+  return -numeric_limits<T>::infinity();
+}
+
+template <typename T>
+typename enable_if<!numeric_limits<T>::has_infinity, T>::type
+lowest_value()
+{
+  return numeric_limits<T>::lowest();
+}
+
+template <typename T>
+typename enable_if<numeric_limits<T>::has_infinity, T>::type
+highest_value()
+{
+  return numeric_limits<T>::infinity();
+}
+
+template <typename T>
+typename enable_if<!numeric_limits<T>::has_infinity, T>::type
+highest_value()
+{
+  return numeric_limits<T>::max();
+}
+
+template <size_t I>
+struct set_unbounded_
+{
+  template <typename TupleType>
+  typename enable_if<is_not_last<I, TupleType>::value>::type
+  operator()(TupleType& lower, TupleType& upper) const
+  {
+    set_nth(lower, upper);
+    set_unbounded_<I + 1>()(lower, upper);
+  }
+  template <typename TupleType>
+  typename enable_if<is_last<I, TupleType>::value>::type
+  operator()(TupleType& lower, TupleType& upper) const
+  {
+    set_nth(lower, upper);
+  }
+  template <typename TupleType>
+  void set_nth(TupleType& lower, TupleType& upper) const
+  {
+    using T = typename tuple_element<I, TupleType>::type;
+    get<I>(lower) = lowest_value<T>();
+    get<I>(upper) = highest_value<T>();
+  }
+};
+
+template <typename TupleType>
+void set_unbounded(TupleType& lower, TupleType& upper)
+{
+  set_unbounded_<0>()(lower, upper);
+}
+
+// Skylines are taken with smaller values preferred: a dominates b when a
+// is no greater than b in every dimension and less in at least one.
+template <typename TupleType>
+bool dominates(const TupleType& a, const TupleType& b)
+{
+  return none_less(b, a) && !none_less(a, b);
+}
+
+template <typename T>
+typename enable_if<is_not_pointer<T>::value, const T&>::type
+deref(const T& x)
+{
+  return x;
+}
+
+template <typename T>
+typename enable_if<is_pointer<T>::value,
+                   const typename remove_pointer<T>::type&>::type
+deref(const T& x)
+{
+  return *x;
+}
+
+// Adds it to the skyline S unless dominated, dropping any members it
+// dominates. A member that rejects a candidate is moved to the front as
+// it is likely to reject the next one too.
+template <typename Iter>
+void skyline_add(vector<Iter>& S, Iter it)
+{
+  auto& x = deref(*it);
+  for (size_t i = 0; i != S.size(); ++i)
+    if (dominates(deref(*S[i]), x))
+    {
+      std::swap(S[i], S[0]);
+      return;
+    }
+  S.erase(std::remove_if(begin(S), end(S), [&](Iter s){
+    return dominates(x, deref(*s));
+  }), end(S));
+  S.push_back(it);
+}
+
+// Every point of a partition is no less than corner, so a member of S
+// dominating corner dominates the whole partition. Left partitions are
+// searched first and their skyline is used to prune the right.
+template <size_t I, typename Iter, typename TupleType>
+void kd_skyline(Iter first, Iter last, TupleType& corner,
+                vector<Iter>& S, size_t bucket = 1)
+{
+  for (auto s : S)
+    if (dominates(deref(*s), corner))
+    {
+      KDTOOLS_STAT(subtrees_pruned);
+      return;
+    }
+  if (static_cast<size_t>(distance(first, last)) <= leaf_size(bucket))
+  {
+    KDTOOLS_STAT_ADD(points_scanned, distance(first, last));
+    for (; first != last; ++first) skyline_add(S, first);
+    return;
+  }
+  KDTOOLS_STAT(nodes_visited);
+  constexpr auto J = next_dim<I, TupleType>::value;
+  auto pivot = find_pivot<I>(first, last);
+  kd_skyline<J>(first, pivot, corner, S, bucket);
+  skyline_add(S, pivot);
+  auto c = get<I>(corner);
+  if (c < get<I>(deref(*pivot))) get<I>(corner) = get<I>(deref(*pivot));
+  kd_skyline<J>(next(pivot), last, corner, S, bucket);
+  get<I>(corner) = c;
+}
+
+// The two sides of the top partitions are searched concurrently, without
+// sharing their skylines, and then merged
+template <size_t I, typename Iter, typename TupleType>
+void kd_skyline_threaded(Iter first, Iter last, TupleType corner,
+                         vector<Iter>& S, size_t bucket,
+                         int max_threads, int thread_depth = 1)
+{
+  if (static_cast<size_t>(distance(first, last)) <= leaf_size(bucket) ||
+      (1 << thread_depth) > max_threads)
+    return kd_skyline<I>(first, last, corner, S, bucket);
+  constexpr auto J = next_dim<I, TupleType>::value;
+  auto pivot = find_pivot<I>(first, last);
+  auto right = corner;
+  if (get<I>(right) < get<I>(deref(*pivot)))
+    get<I>(right) = get<I>(deref(*pivot));
+  vector<Iter> R;
+  thread t([&]{
+    kd_skyline_threaded<J>(next(pivot), last, right, R, bucket,
+                           max_threads, thread_depth + 1);
+  });
+  kd_skyline_threaded<J>(first, pivot, corner, S, bucket,
+                         max_threads, thread_depth + 1);
+  t.join();
+  skyline_add(S, pivot);
+  for (auto it : R) skyline_add(S, it);
+}
+
+template <typename TupleType>
+struct periodic_metric
+{
+  TupleType m_box;
+  periodic_metric(const TupleType& box) : m_box(box) {}
+  double operator()(const TupleType& lhs, const TupleType& rhs) const
+  {
+    return l2dist_periodic(lhs, rhs, m_box);
+  }
+  double cell_dist(const TupleType& value,
+                   const TupleType& lower,
+                   const TupleType& upper) const
+  {
+    return cell_dist_periodic(value, lower, upper, m_box);
+  }
+};
+
+template <size_t I,
+          typename Iter,
+          typename TupleType,
+          typename Metric,
+          typename QType>
+void knn_metric(Iter first, Iter last,
+                const TupleType& value,
+                const Metric& metric,
+                const TupleType& lower,
+                const TupleType& upper,
+                QType& Q, size_t bucket = 1)
+{
+  if (metric.cell_dist(value, lower, upper) > Q.max_key())
+  {
+    KDTOOLS_STAT(subtrees_pruned);
+    return;
+  }
+  if (static_cast<size_t>(distance(first, last)) <= bucket)
+  {
+    for (; first != last; ++first) Q.add(metric(*first, value), first);
+    return;
+  }
+  KDTOOLS_STAT(nodes_visited);
+  auto pivot = find_pivot<I>(first, last);
+  Q.add(metric(*pivot, value), pivot);
+  constexpr auto J = next_dim<I, TupleType>::value;
+  auto split = get<I>(*pivot);
+  if (split != split)
+  {
+    // NaN sorts last, so the left cell keeps its bounds and the right one
+    // holds rows ranked last, needed only while Q can take them
+    knn_metric<J>(first, pivot, value, metric, lower, upper, Q, bucket);
+    if (Q.max_key() == numeric_limits<double>::infinity())
+      knn_metric<J>(next(pivot), last, value, metric, lower, upper,
+                    Q, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    return;
+  }
+  auto left_upper = upper, right_lower = lower;
+  get<I>(left_upper) = get<I>(*pivot);
+  get<I>(right_lower) = get<I>(*pivot);
+  if (less_nth<I>()(value, *pivot))
+  {
+    knn_metric<J>(first, pivot, value, metric, lower, left_upper,
+                  Q, bucket);
+    knn_metric<J>(next(pivot), last, value, metric, right_lower, upper,
+                  Q, bucket);
+  }
+  else
+  {
+    knn_metric<J>(next(pivot), last, value, metric, right_lower, upper,
+                  Q, bucket);
+    knn_metric<J>(first, pivot, value, metric, lower, left_upper,
+                  Q, bucket);
+  }
+}
+
+template <size_t I,
+          typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_range_query_periodic(Iter first, Iter last,
+                             const TupleType& lower,
+                             const TupleType& upper,
+                             const TupleType& box,
+                             const TupleType& cell_lower,
+                             const TupleType& cell_upper,
+                             OutIter outp, size_t bucket = 1)
+{
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = find_pivot<I>(first, last);
+    constexpr auto J = next_dim<I, TupleType>::value;
+    if (within_periodic(*pivot, lower, upper, box)) *outp++ = *pivot;
+    auto left_upper = cell_upper, right_lower = cell_lower;
+    get<I>(left_upper) = get<I>(*pivot);
+    get<I>(right_lower) = get<I>(*pivot);
+    if (periodic_overlap(get<I>(cell_lower), get<I>(left_upper),
+                         get<I>(lower), get<I>(upper), get<I>(box)))
+      kd_range_query_periodic<J>(first, pivot, lower, upper, box,
+                                 cell_lower, left_upper, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (periodic_overlap(get<I>(right_lower), get<I>(cell_upper),
+                         get<I>(lower), get<I>(upper), get<I>(box)))
+      kd_range_query_periodic<J>(next(pivot), last, lower, upper, box,
+                                 right_lower, cell_upper, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, distance(first, last));
+    copy_if(first, last, outp, [&](const TupleType& x){
+      return within_periodic(x, lower, upper, box);
+    });
+  }
+  return;
+}
+
+template <size_t I,
+          typename Iter,
+          typename TupleType,
+          typename Metric,
+          typename OutIter>
+void kd_radius_query_metric(Iter first, Iter last,
+                            const TupleType& value,
+                            double radius,
+                            const Metric& metric,
+                            const TupleType& lower,
+                            const TupleType& upper,
+                            OutIter outp, size_t bucket = 1)
+{
+  if (metric.cell_dist(value, lower, upper) > radius)
+  {
+    KDTOOLS_STAT(subtrees_pruned);
+    return;
+  }
+  if (static_cast<size_t>(distance(first, last)) > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = find_pivot<I>(first, last);
+    constexpr auto J = next_dim<I, TupleType>::value;
+    if (metric(*pivot, value) <= radius) *outp++ = *pivot;
+    auto split = get<I>(*pivot);
+    if (split != split)
+    {
+      // NaN sorts last, so the right side holds only rows with no distance
+      KDTOOLS_STAT(subtrees_pruned);
+      kd_radius_query_metric<J>(first, pivot, value, radius, metric,
+                                lower, upper, outp, bucket);
+      return;
+    }
+    auto left_upper = upper, right_lower = lower;
+    get<I>(left_upper) = get<I>(*pivot);
+    get<I>(right_lower) = get<I>(*pivot);
+    kd_radius_query_metric<J>(first, pivot, value, radius, metric,
+                              lower, left_upper, outp, bucket);
+    kd_radius_query_metric<J>(next(pivot), last, value, radius, metric,
+                              right_lower, upper, outp, bucket);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, distance(first, last));
+    copy_if(first, last, outp, [&](const TupleType& x){
+      return metric(x, value) <= radius;
+    });
+  }
+  return;
+}
+
+constexpr double pi = 3.141592653589793238462643383279502884;
+
+inline double deg_to_rad(double x)
+{
+  return x * pi / 180;
+}
+
+inline double geo_lon_offset(double lon, double ref)
+{
+  auto d = wrap_offset(lon - ref, 360);
+  return d < 360 - d ? d : 360 - d;
+}
+
+template <typename TupleType>
+double geo_dist(const TupleType& lhs, const TupleType& rhs)
+{
+  static_assert(ndim<TupleType>::value == 2,
+                "Geographic coordinates must be (longitude, latitude) pairs");
+  KDTOOLS_STAT(distance_evals);
+  auto phi1 = deg_to_rad(get<1>(lhs)), phi2 = deg_to_rad(get<1>(rhs)),
+    dlambda = deg_to_rad(geo_lon_offset(get<0>(lhs), get<0>(rhs)));
+  auto a = std::pow(std::sin((phi2 - phi1) / 2), 2) +
+    std::cos(phi1) * std::cos(phi2) * std::pow(std::sin(dlambda / 2), 2);
+  return 2 * std::asin(std::sqrt(a < 1 ? a : 1));
+}
+
+inline double geo_meridian_dist(double dlambda, double phi)
+{
+  if (dlambda <= pi / 2)
+    return std::asin(std::sin(dlambda) * std::cos(phi));
+  return pi / 2 - abs(phi);
+}
+
+template <typename TupleType>
+double geo_cell_dist(const TupleType& value,
+                     const TupleType& lower,
+                     const TupleType& upper)
+{
+  double lat = get<1>(value), lat_dist = 0, lon_dist = 0;
+  if (lat < get<1>(lower)) lat_dist = deg_to_rad(get<1>(lower) - lat);
+  if (lat > get<1>(upper)) lat_dist = deg_to_rad(lat - get<1>(upper));
+  if (periodic_interval_dist(get<0>(value), get<0>(lower),
+                             get<0>(upper), 360.0) > 0)
+  {
+    auto phi = deg_to_rad(lat),
+      da = deg_to_rad(geo_lon_offset(get<0>(value), get<0>(lower))),
+      db = deg_to_rad(geo_lon_offset(get<0>(value), get<0>(upper)));
+    lon_dist = std::min(geo_meridian_dist(da, phi),
+                        geo_meridian_dist(db, phi));
+  }
+  return lat_dist > lon_dist ? lat_dist : lon_dist;
+}
+
+struct geo_metric
+{
+  template <typename TupleType>
+  double operator()(const TupleType& lhs, const TupleType& rhs) const
+  {
+    return geo_dist(lhs, rhs);
+  }
+  template <typename TupleType>
+  double cell_dist(const TupleType& value,
+                   const TupleType& lower,
+                   const TupleType& upper) const
+  {
+    return geo_cell_dist(value, lower, upper);
+  }
+};
+
+template <typename T>
+struct dyn_rows
+{
+  T* m_data;
+  size_t m_nrow, m_ncol;
+  dyn_rows(T* data, size_t nrow, size_t ncol) :
+    m_data(data), m_nrow(nrow), m_ncol(ncol) {}
+  T* row(size_t i) const
+  {
+    return m_data + i * m_ncol;
+  }
+  size_t size() const
+  {
+    return m_nrow;
+  }
+  size_t ncol() const
+  {
+    return m_ncol;
+  }
+};
+
+inline size_t next_dim_dyn(size_t j, size_t ncol)
+{
+  return j + 1 == ncol ? 0 : j + 1;
+}
+
+template <typename T>
+struct row_less
+{
+  const T* m_data;
+  size_t m_ncol, m_dim;
+  row_less(const T* data, size_t ncol, size_t dim) :
+    m_data(data), m_ncol(ncol), m_dim(dim) {}
+  bool operator()(size_t lhs, size_t rhs) const
+  {
+    auto a = m_data + lhs * m_ncol, b = m_data + rhs * m_ncol;
+    for (size_t i = m_dim, k = 0; k != m_ncol; ++k, i = next_dim_dyn(i, m_ncol))
+    {
+      if (sort_less(a[i], b[i])) return true;
+      if (sort_less(b[i], a[i])) return false;
+    }
+    return false;
+  }
+};
+
+template <typename T>
+bool row_all_less(const T* lhs, const T* rhs, size_t ncol)
+{
+  for (size_t i = 0; i != ncol; ++i)
+    if (!(lhs[i] < rhs[i])) return false;
+  return true;
+}
+
+template <typename T>
+bool row_none_less(const T* lhs, const T* rhs, size_t ncol)
+{
+  for (size_t i = 0; i != ncol; ++i)
+    if (lhs[i] < rhs[i]) return false;
+  return true;
+}
+
+template <typename T>
+bool row_within(const T* value, const T* lower, const T* upper, size_t ncol)
+{
+  return row_none_less(value, lower, ncol) && row_all_less(value, upper, ncol);
+}
+
+template <typename T>
+double row_l2dist(const T* lhs, const T* rhs, size_t ncol)
+{
+  KDTOOLS_STAT(distance_evals);
+  double ssq = 0;
+  for (size_t i = 0; i != ncol; ++i)
+    ssq += std::pow(scalar_diff(rhs[i], lhs[i]), 2);
+  return std::sqrt(ssq);
+}
+
+template <typename T>
+struct row_three_way
+{
+  const T* m_data;
+  size_t m_ncol, m_dim;
+  row_three_way(const T* data, size_t ncol, size_t dim) :
+    m_data(data), m_ncol(ncol), m_dim(dim) {}
+  int operator()(size_t lhs, size_t rhs) const
+  {
+    auto a = m_data + lhs * m_ncol, b = m_data + rhs * m_ncol;
+    for (size_t i = m_dim, k = 0; k != m_ncol; ++k, i = next_dim_dyn(i, m_ncol))
+    {
+      if (sort_less(a[i], b[i])) return -1;
+      if (sort_less(b[i], a[i])) return 1;
+    }
+    return 0;
+  }
+};
+
+template <typename T>
+struct row_radix
+{
+  const T* m_data;
+  size_t m_ncol, m_dim;
+  row_radix(const T* data, size_t ncol, size_t dim) :
+    m_data(data), m_ncol(ncol), m_dim(dim) {}
+  auto operator()(size_t i) const -> decltype(radix_key(*m_data))
+  {
+    return sort_key(m_data[i * m_ncol + m_dim]);
+  }
+};
+
+template <typename Iter, typename T>
+typename enable_if<is_radix_key<typename std::remove_const<T>::type>::value,
+                   pair<Iter, Iter>>::type
+kd_partition_dyn(Iter first, Iter nth, Iter last,
+                 const T* data, size_t ncol, size_t j)
+{
+  return radix_select(first, nth, last, row_radix<T>(data, ncol, j),
+                      row_three_way<T>(data, ncol, j));
+}
+
+template <typename Iter, typename T>
+typename enable_if<!is_radix_key<typename std::remove_const<T>::type>::value,
+                   pair<Iter, Iter>>::type
+kd_partition_dyn(Iter first, Iter nth, Iter last,
+                 const T* data, size_t ncol, size_t j)
+{
+  return kd_select(first, nth, last, row_three_way<T>(data, ncol, j));
+}
+
+template <typename Iter, typename T>
+void kd_sort_dyn(Iter first, Iter last, const T* data, size_t ncol, size_t j,
+                 size_t bucket = 1)
+{
+  if (static_cast<size_t>(distance(first, last)) > bucket)
+  {
+    KDTOOLS_STAT_DEPTH();
+    KDTOOLS_STAT(sort_partitions);
+    auto pivot = middle_of(first, last);
+    auto equal = kd_partition_dyn(first, pivot, last, data, ncol, j);
+    if (equal.first == first && equal.second == last) return;
+    auto k = next_dim_dyn(j, ncol);
+    kd_sort_dyn(next(pivot), last, data, ncol, k, bucket);
+    kd_sort_dyn(first, pivot, data, ncol, k, bucket);
+  }
+}
+
+template <typename Iter, typename T>
+void kd_sort_threaded_dyn(Iter first, Iter last,
+                          const T* data, size_t ncol, size_t j,
+                          int max_threads = std::thread::hardware_concurrency(),
+                          int thread_depth = 1,
+                          size_t bucket = 1)
+{
+  if (static_cast<size_t>(distance(first, last)) > bucket)
+  {
+    KDTOOLS_STAT_DEPTH_AT(thread_depth);
+    KDTOOLS_STAT(sort_partitions);
+    auto pivot = middle_of(first, last);
+    auto equal = kd_partition_dyn(first, pivot, last, data, ncol, j);
+    if (equal.first == first && equal.second == last) return;
+    auto k = next_dim_dyn(j, ncol);
+    if ((1 << thread_depth) <= max_threads)
+    {
+      thread t(kd_sort_threaded_dyn<Iter, T>, next(pivot), last,
+               data, ncol, k, max_threads, thread_depth + 1, bucket);
+      kd_sort_threaded_dyn(first, pivot, data, ncol, k,
+                           max_threads, thread_depth + 1, bucket);
+      t.join();
+    }
+    else
+    {
+      kd_sort_dyn(next(pivot), last, data, ncol, k, bucket);
+      kd_sort_dyn(first, pivot, data, ncol, k, bucket);
+    }
+  }
+}
+
+template <typename T>
+void permute_rows(const dyn_rows<T>& x, const vector<size_t>& order)
+{
+  vector<typename std::remove_const<T>::type> tmp(x.size() * x.ncol());
+  auto outp = begin(tmp);
+  for (auto i : order)
+    outp = std::copy(x.row(i), x.row(i) + x.ncol(), outp);
+  std::copy(begin(tmp), end(tmp), x.row(0));
+}
+
+template <typename T>
+vector<size_t> curve_order_dyn(const dyn_rows<T>& x, curve_type c,
+                               int max_threads)
+{
+  auto nc = x.ncol();
+  vector<double> lower(nc, numeric_limits<double>::infinity()),
+    upper(nc, -numeric_limits<double>::infinity());
+  for (size_t i = 0; i != x.size(); ++i)
+    for (size_t j = 0; j != nc; ++j)
+    {
+      double v = x.row(i)[j];
+      if (!std::isfinite(v)) continue;
+      if (v < lower[j]) lower[j] = v;
+      if (upper[j] < v) upper[j] = v;
+    }
+  curve_grid g(lower, upper);
+  auto e = curve_sort_keys(x.size(), g, c, [&](size_t i, std::uint32_t* out){
+    for (size_t j = 0; j != g.m_ndim; ++j) out[j] = g.cell(j, x.row(i)[j]);
+  }, max_threads);
+  vector<size_t> res(e.size());
+  for (size_t i = 0; i != e.size(); ++i) res[i] = e[i].index;
+  return res;
+}
+
+template <typename T>
+size_t find_pivot_dyn(const dyn_rows<T>&, size_t first, size_t last, size_t)
+{
+  return first + (last - first) / 2;
+}
+
+template <typename T>
+bool check_partition_dyn(const dyn_rows<T>& x, size_t first, size_t pivot,
+                         size_t last, size_t j)
+{
+  auto pred = row_less<T>(x.row(0), x.ncol(), j);
+  for (auto i = first; i != pivot; ++i)
+    if (pred(pivot, i)) return false;
+  for (auto i = pivot + 1; i != last; ++i)
+    if (pred(i, pivot)) return false;
+  return true;
+}
+
+template <typename T>
+bool kd_is_sorted_dyn(const dyn_rows<T>& x, size_t first, size_t last, size_t j,
+                      size_t bucket = 1, size_t levels = all_levels)
+{
+  if (levels == 0 || last - first <= bucket) return true;
+  auto pivot = find_pivot_dyn(x, first, last, j);
+  if (!check_partition_dyn(x, first, pivot, last, j)) return false;
+  auto k = next_dim_dyn(j, x.ncol());
+  return kd_is_sorted_dyn(x, first, pivot, k, bucket, levels - 1) &&
+    kd_is_sorted_dyn(x, pivot + 1, last, k, bucket, levels - 1);
+}
+
+template <typename T>
+bool kd_is_sorted_threaded_dyn(const dyn_rows<T>& x, size_t first,
+                               size_t last, size_t j, size_t bucket,
+                               size_t levels, std::atomic<bool>& failed,
+                               int max_threads, int thread_depth = 1)
+{
+  if (failed.load(std::memory_order_relaxed)) return false;
+  if (levels == 0 || last - first <= bucket) return true;
+  auto pivot = find_pivot_dyn(x, first, last, j);
+  if (!check_partition_dyn(x, first, pivot, last, j))
+  {
+    failed = true;
+    return false;
+  }
+  auto k = next_dim_dyn(j, x.ncol());
+  auto depth = thread_depth;
+  if ((1 << thread_depth) <= max_threads)
+  {
+    bool right = true;
+    thread t([&]{
+      right = kd_is_sorted_threaded_dyn(x, pivot + 1, last, k, bucket,
+                                        levels - 1, failed, max_threads,
+                                        depth + 1);
+    });
+    auto left = kd_is_sorted_threaded_dyn(x, first, pivot, k, bucket,
+                                          levels - 1, failed, max_threads,
+                                          depth + 1);
+    t.join();
+    return left && right;
+  }
+  return kd_is_sorted_threaded_dyn(x, first, pivot, k, bucket, levels - 1,
+                                   failed, max_threads, depth) &&
+    kd_is_sorted_threaded_dyn(x, pivot + 1, last, k, bucket, levels - 1,
+                              failed, max_threads, depth);
+}
+
+template <typename T>
+size_t kd_lower_bound_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+                          const T* value, size_t j, size_t bucket = 1)
+{
+  auto n = x.ncol();
+  if (last - first > bucket)
+  {
+    auto k = next_dim_dyn(j, n);
+    auto pivot = find_pivot_dyn(x, first, last, j);
+    if (row_none_less(x.row(pivot), value, n))
+      return kd_lower_bound_dyn(x, first, pivot, value, k, bucket);
+    if (row_all_less(x.row(pivot), value, n))
+      return kd_lower_bound_dyn(x, pivot + 1, last, value, k, bucket);
+    auto it = kd_lower_bound_dyn(x, first, pivot, value, k, bucket);
+    if (it != last && row_none_less(x.row(it), value, n)) return it;
+    it = kd_lower_bound_dyn(x, pivot + 1, last, value, k, bucket);
+    if (it != last && row_none_less(x.row(it), value, n)) return it;
+    return last;
+  }
+  auto res = last;
+  auto less = row_less<T>(x.row(0), n, j);
+  for (; first != last; ++first)
+    if (row_none_less(x.row(first), value, n) && (res == last || less(first, res)))
+      res = first;
+  return res;
+}
+
+template <typename T>
+size_t kd_upper_bound_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+                          const T* value, size_t j, size_t bucket = 1)
+{
+  auto n = x.ncol();
+  if (last - first > bucket)
+  {
+    auto k = next_dim_dyn(j, n);
+    auto pivot = find_pivot_dyn(x, first, last, j);
+    if (row_all_less(value, x.row(pivot), n))
+      return kd_upper_bound_dyn(x, first, pivot, value, k, bucket);
+    if (row_none_less(value, x.row(pivot), n))
+      return kd_upper_bound_dyn(x, pivot + 1, last, value, k, bucket);
+    auto it = kd_upper_bound_dyn(x, first, pivot, value, k, bucket);
+    if (it != last && row_all_less(value, x.row(it), n)) return it;
+    it = kd_upper_bound_dyn(x, pivot + 1, last, value, k, bucket);
+    if (it != last && row_all_less(value, x.row(it), n)) return it;
+    return last;
+  }
+  auto res = last;
+  auto less = row_less<T>(x.row(0), n, j);
+  for (; first != last; ++first)
+    if (row_all_less(value, x.row(first), n) && (res == last || less(first, res)))
+      res = first;
+  return res;
+}
+
+template <typename T>
+size_t kd_nearest_neighbor_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+                               const T* value, size_t j,
+                               size_t bucket = 1)
+{
+  auto n = x.ncol();
+  if (last - first > bucket)
+  {
+    auto k = next_dim_dyn(j, n);
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = find_pivot_dyn(x, first, last, j);
+    auto p = x.row(pivot);
+    auto search_left = sort_less(value[j], p[j]);
+    auto search = search_left ?
+      kd_nearest_neighbor_dyn(x, first, pivot, value, k, bucket) :
+        kd_nearest_neighbor_dyn(x, pivot + 1, last, value, k, bucket);
+    auto min_dist = nan_last(row_l2dist(p, value, n));
+    if (search == last) search = pivot;
+    else
+    {
+      auto sdist = nan_last(row_l2dist(x.row(search), value, n));
+      if (sdist < min_dist) min_dist = sdist;
+      else search = pivot;
+    }
+    if (nan_last(scalar_dist(value[j], p[j])) < min_dist)
+    {
+      auto s2 = search_left ?
+        kd_nearest_neighbor_dyn(x, pivot + 1, last, value, k, bucket) :
+          kd_nearest_neighbor_dyn(x, first, pivot, value, k, bucket);
+      if (s2 != last && nan_last(row_l2dist(x.row(s2), value, n)) < min_dist)
+        search = s2;
+    }
+    else KDTOOLS_STAT(subtrees_pruned);
+    return search;
+  }
+  auto best = first;
+  auto best_dist = numeric_limits<double>::max();
+  for (; first != last; ++first)
+  {
+    auto d = row_l2dist(x.row(first), value, n);
+    if (d < best_dist)
+    {
+      best_dist = d;
+      best = first;
+    }
+  }
+  return best;
+}
+
+template <typename T, typename OutIter>
+void kd_range_query_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+                        const T* lower, const T* upper,
+                        size_t j, OutIter& outp, size_t bucket = 1)
+{
+  auto n = x.ncol();
+  if (last - first > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = find_pivot_dyn(x, first, last, j);
+    auto k = next_dim_dyn(j, n);
+    auto p = x.row(pivot);
+    if (row_within(p, lower, upper, n)) *outp++ = pivot;
+    if (!(p[j] < lower[j])) // search left
+      kd_range_query_dyn(x, first, pivot, lower, upper, k, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (p[j] < upper[j]) // search right
+      kd_range_query_dyn(x, pivot + 1, last, lower, upper, k, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, last - first);
+    for (; first != last; ++first)
+      if (row_within(x.row(first), lower, upper, n)) *outp++ = first;
+  }
+}
+
+template <typename T, typename OutIter>
+void kd_radius_query_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+                         const T* value, double radius,
+                         size_t j, OutIter& outp, size_t bucket = 1)
+{
+  auto n = x.ncol();
+  if (last - first > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = find_pivot_dyn(x, first, last, j);
+    auto k = next_dim_dyn(j, n);
+    auto p = x.row(pivot);
+    if (row_l2dist(p, value, n) <= radius) *outp++ = pivot;
+    if (!(scalar_diff(value[j], p[j]) > radius)) // search left, also of NaN
+      kd_radius_query_dyn(x, first, pivot, value, radius, k, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (scalar_diff(p[j], value[j]) <= radius) // search right
+      kd_radius_query_dyn(x, pivot + 1, last, value, radius, k, outp, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, last - first);
+    for (; first != last; ++first)
+      if (row_l2dist(x.row(first), value, n) <= radius) *outp++ = first;
+  }
+}
+
+// Calls f with the row index of each point within radius, stopping when
+// f returns false, as kd_radius_visit does
+template <typename T, typename Visitor>
+bool kd_radius_visit_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+                         const T* value, double radius,
+                         size_t j, Visitor& f, size_t bucket = 1)
+{
+  auto n = x.ncol();
+  if (last - first > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = find_pivot_dyn(x, first, last, j);
+    auto k = next_dim_dyn(j, n);
+    auto p = x.row(pivot);
+    if (row_l2dist(p, value, n) <= radius && !visit(f, pivot)) return false;
+    if (!(scalar_diff(value[j], p[j]) > radius)) { // search left, also of NaN
+      if (!kd_radius_visit_dyn(x, first, pivot, value, radius, k, f, bucket))
+        return false;
+    }
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (scalar_diff(p[j], value[j]) <= radius) // search right
+      return kd_radius_visit_dyn(x, pivot + 1, last, value, radius, k, f,
+                                 bucket);
+    KDTOOLS_STAT(subtrees_pruned);
+    return true;
+  }
+  KDTOOLS_STAT_ADD(points_scanned, last - first);
+  for (; first != last; ++first)
+    if (row_l2dist(x.row(first), value, n) <= radius && !visit(f, first))
+      return false;
+  return true;
+}
+
+template <typename T, typename QType>
+void knn_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+             const T* value, size_t j, QType& Q, size_t bucket = 1)
+{
+  auto n = x.ncol();
+  if (last - first <= bucket)
+  {
+    for (; first != last; ++first)
+      Q.add(row_l2dist(x.row(first), value, n), first);
+    return;
+  }
+  KDTOOLS_STAT(nodes_visited);
+  auto pivot = find_pivot_dyn(x, first, last, j);
+  auto p = x.row(pivot);
+  Q.add(row_l2dist(p, value, n), pivot);
+  // a NaN pivot has every number on its left, as in knn
+  auto search_left = sort_less(value[j], p[j]);
+  auto k = next_dim_dyn(j, n);
+  if (search_left)
+    knn_dyn(x, first, pivot, value, k, Q, bucket);
+  else
+    knn_dyn(x, pivot + 1, last, value, k, Q, bucket);
+  if (nan_last(scalar_dist(value[j], p[j])) <= Q.max_key())
+  {
+    if (search_left)
+      knn_dyn(x, pivot + 1, last, value, k, Q, bucket);
+    else
+      knn_dyn(x, first, pivot, value, k, Q, bucket);
+  }
+  else KDTOOLS_STAT(subtrees_pruned);
+}
+
+
+template <typename T>
+bool row_dominates(const T* a, const T* b, size_t ncol)
+{
+  return row_none_less(b, a, ncol) && !row_none_less(a, b, ncol);
+}
+
+template <typename T>
+void skyline_add_dyn(const dyn_rows<T>& x, vector<size_t>& S, size_t i)
+{
+  auto n = x.ncol();
+  for (size_t k = 0; k != S.size(); ++k)
+    if (row_dominates(x.row(S[k]), x.row(i), n))
+    {
+      std::swap(S[k], S[0]);
+      return;
+    }
+  S.erase(std::remove_if(begin(S), end(S), [&](size_t s){
+    return row_dominates(x.row(i), x.row(s), n);
+  }), end(S));
+  S.push_back(i);
+}
+
+template <typename T>
+void kd_skyline_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+                    size_t j, typename std::remove_const<T>::type* corner,
+                    vector<size_t>& S, size_t bucket = 1)
+{
+  auto n = x.ncol();
+  for (auto s : S)
+    if (row_dominates<const T>(x.row(s), corner, n))
+    {
+      KDTOOLS_STAT(subtrees_pruned);
+      return;
+    }
+  if (last - first <= leaf_size(bucket))
+  {
+    KDTOOLS_STAT_ADD(points_scanned, last - first);
+    for (; first != last; ++first) skyline_add_dyn(x, S, first);
+    return;
+  }
+  KDTOOLS_STAT(nodes_visited);
+  auto k = next_dim_dyn(j, n);
+  auto pivot = find_pivot_dyn(x, first, last, j);
+  kd_skyline_dyn(x, first, pivot, k, corner, S, bucket);
+  skyline_add_dyn(x, S, pivot);
+  auto c = corner[j];
+  if (c < x.row(pivot)[j]) corner[j] = x.row(pivot)[j];
+  kd_skyline_dyn(x, pivot + 1, last, k, corner, S, bucket);
+  corner[j] = c;
+}
+
+template <typename T>
+void kd_skyline_threaded_dyn(const dyn_rows<T>& x, size_t first, size_t last,
+                             size_t j,
+                             vector<typename std::remove_const<T>::type> corner,
+                             vector<size_t>& S,
+                             size_t bucket, int max_threads,
+                             int thread_depth = 1)
+{
+  if (last - first <= leaf_size(bucket) || (1 << thread_depth) > max_threads)
+    return kd_skyline_dyn(x, first, last, j, corner.data(), S, bucket);
+  auto k = next_dim_dyn(j, x.ncol());
+  auto pivot = find_pivot_dyn(x, first, last, j);
+  auto right = corner;
+  if (right[j] < x.row(pivot)[j]) right[j] = x.row(pivot)[j];
+  vector<size_t> R;
+  thread t([&]{
+    kd_skyline_threaded_dyn(x, pivot + 1, last, k, right, R, bucket,
+                            max_threads, thread_depth + 1);
+  });
+  kd_skyline_threaded_dyn(x, first, pivot, k, corner, S, bucket,
+                          max_threads, thread_depth + 1);
+  t.join();
+  skyline_add_dyn(x, S, pivot);
+  for (auto i : R) skyline_add_dyn(x, S, i);
+}
+
+// Adaptive layouts split each partition at its middle element along the
+// axis of widest spread and record that axis at the pivot position. Left
+// elements are not greater than the pivot on the axis and right elements
+// are not less. Rows are accessed with operator[] so the same code serves
+// std::array tuples and dyn_rows.
+
+template <typename Iter>
+struct iter_rows
+{
+  using value_type = iter_value_t<Iter>;
+  Iter m_first;
+  size_t m_size;
+  iter_rows(Iter first, Iter last) :
+    m_first(first), m_size(distance(first, last)) {}
+  const value_type& row(size_t i) const
+  {
+    return m_first[i];
+  }
+  size_t size() const
+  {
+    return m_size;
+  }
+  size_t ncol() const
+  {
+    return ndim<value_type>::value;
+  }
+};
+
+template <typename Row, typename Value>
+bool axis_within(const Row& x, const Value& lower, const Value& upper,
+                 size_t ncol)
+{
+  for (size_t j = 0; j != ncol; ++j)
+    if (x[j] < lower[j] || !(x[j] < upper[j])) return false;
+  return true;
+}
+
+template <typename Row, typename Value>
+bool axis_equal(const Row& x, const Value& value, size_t ncol)
+{
+  for (size_t j = 0; j != ncol; ++j)
+    if (x[j] < value[j] || value[j] < x[j]) return false;
+  return true;
+}
+
+template <typename Row, typename Value>
+double axis_l2dist(const Row& x, const Value& value, size_t ncol)
+{
+  KDTOOLS_STAT(distance_evals);
+  double ssq = 0;
+  for (size_t j = 0; j != ncol; ++j)
+    ssq += std::pow(scalar_diff(value[j], x[j]), 2);
+  return std::sqrt(ssq);
+}
+
+template <typename Iter, typename Proj>
+size_t widest_axis(Iter first, Iter last, Proj proj, size_t ncol)
+{
+  using T = iter_value_t<Iter>;
+  size_t res = 0;
+  double spread = -1;
+  for (size_t j = 0; j != ncol; ++j)
+  {
+    auto r = std::minmax_element(first, last, [&](const T& a, const T& b){
+      return proj(a)[j] < proj(b)[j];
+    });
+    auto s = scalar_diff(proj(*r.second)[j], proj(*r.first)[j]);
+    if (s > spread)
+    {
+      spread = s;
+      res = j;
+    }
+  }
+  return res;
+}
+
+template <typename Iter, typename Proj>
+void kd_sort_adaptive(Iter first, Iter last, Proj proj, size_t ncol,
+                      std::uint8_t* axes,
+                      int max_threads = 1,
+                      int thread_depth = 1,
+                      size_t bucket = 1)
+{
+  using T = iter_value_t<Iter>;
+  if (static_cast<size_t>(distance(first, last)) > bucket)
+  {
+    KDTOOLS_STAT_DEPTH_AT(thread_depth);
+    KDTOOLS_STAT(sort_partitions);
+    auto j = widest_axis(first, last, proj, ncol);
+    auto pivot = middle_of(first, last);
+    nth_element(first, pivot, last, [&](const T& a, const T& b){
+      return sort_less(proj(a)[j], proj(b)[j]);
+    });
+    auto m = distance(first, pivot);
+    axes[m] = static_cast<std::uint8_t>(j);
+    if ((1 << thread_depth) <= max_threads)
+    {
+      thread t(kd_sort_adaptive<Iter, Proj>, next(pivot), last, proj, ncol,
+               axes + m + 1, max_threads, thread_depth + 1, bucket);
+      kd_sort_adaptive(first, pivot, proj, ncol, axes,
+                       max_threads, thread_depth + 1, bucket);
+      t.join();
+    }
+    else
+    {
+      kd_sort_adaptive(next(pivot), last, proj, ncol, axes + m + 1,
+                       1, thread_depth, bucket);
+      kd_sort_adaptive(first, pivot, proj, ncol, axes,
+                       1, thread_depth, bucket);
+    }
+  }
+}
+
+template <typename Rows>
+bool check_partition_adaptive(const Rows& x, const std::uint8_t* axes,
+                              size_t first, size_t pivot, size_t last)
+{
+  auto j = axes[pivot];
+  if (!(j < x.ncol())) return false;
+  auto p = x.row(pivot)[j];
+  for (auto i = first; i != pivot; ++i)
+    if (sort_less(p, x.row(i)[j])) return false;
+  for (auto i = pivot + 1; i != last; ++i)
+    if (sort_less(x.row(i)[j], p)) return false;
+  return true;
+}
+
+template <typename Rows>
+bool kd_is_sorted_adaptive(const Rows& x, const std::uint8_t* axes,
+                           size_t first, size_t last, size_t bucket,
+                           size_t levels = all_levels)
+{
+  if (levels == 0 || last - first <= bucket) return true;
+  auto pivot = first + (last - first) / 2;
+  if (!check_partition_adaptive(x, axes, first, pivot, last)) return false;
+  return kd_is_sorted_adaptive(x, axes, first, pivot, bucket, levels - 1) &&
+    kd_is_sorted_adaptive(x, axes, pivot + 1, last, bucket, levels - 1);
+}
+
+template <typename Rows>
+bool kd_is_sorted_adaptive_threaded(const Rows& x, const std::uint8_t* axes,
+                                    size_t first, size_t last, size_t bucket,
+                                    size_t levels, std::atomic<bool>& failed,
+                                    int max_threads, int thread_depth = 1)
+{
+  if (failed.load(std::memory_order_relaxed)) return false;
+  if (levels == 0 || last - first <= bucket) return true;
+  auto pivot = first + (last - first) / 2;
+  if (!check_partition_adaptive(x, axes, first, pivot, last))
+  {
+    failed = true;
+    return false;
+  }
+  auto depth = thread_depth;
+  if ((1 << thread_depth) <= max_threads)
+  {
+    bool right = true;
+    thread t([&]{
+      right = kd_is_sorted_adaptive_threaded(x, axes, pivot + 1, last, bucket,
+                                             levels - 1, failed, max_threads,
+                                             depth + 1);
+    });
+    auto left = kd_is_sorted_adaptive_threaded(x, axes, first, pivot, bucket,
+                                               levels - 1, failed, max_threads,
+                                               depth + 1);
+    t.join();
+    return left && right;
+  }
+  return kd_is_sorted_adaptive_threaded(x, axes, first, pivot, bucket,
+                                        levels - 1, failed, max_threads,
+                                        depth) &&
+    kd_is_sorted_adaptive_threaded(x, axes, pivot + 1, last, bucket,
+                                   levels - 1, failed, max_threads, depth);
+}
+
+template <typename Rows, typename Value>
+bool kd_binary_search_adaptive(const Rows& x, const std::uint8_t* axes,
+                               size_t first, size_t last,
+                               const Value& value, size_t bucket)
+{
+  auto n = x.ncol();
+  if (last - first > bucket)
+  {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = first + (last - first) / 2;
+    auto j = axes[pivot];
+    auto&& p = x.row(pivot);
+    if (axis_equal(p, value, n)) return true;
+    return (!(p[j] < value[j]) &&
+            kd_binary_search_adaptive(x, axes, first, pivot, value, bucket)) ||
+      (!(value[j] < p[j]) &&
+       kd_binary_search_adaptive(x, axes, pivot + 1, last, value, bucket));
+  }
+  KDTOOLS_STAT_ADD(points_scanned, last - first);
+  for (; first != last; ++first)
+    if (axis_equal(x.row(first), value, n)) return true;
+  return false;
+}
+
+template <typename Rows, typename Value, typename Emit>
+void kd_range_query_adaptive(const Rows& x, const std::uint8_t* axes,
+                             size_t first, size_t last,
+                             const Value& lower, const Value& upper,
+                             Emit& emit, size_t bucket)
+{
+  auto n = x.ncol();
+  if (last - first > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = first + (last - first) / 2;
+    auto j = axes[pivot];
+    auto&& p = x.row(pivot);
+    if (axis_within(p, lower, upper, n)) emit(pivot);
+    if (!(p[j] < lower[j])) // search left
+      kd_range_query_adaptive(x, axes, first, pivot, lower, upper,
+                              emit, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (p[j] < upper[j]) // search right
+      kd_range_query_adaptive(x, axes, pivot + 1, last, lower, upper,
+                              emit, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, last - first);
+    for (; first != last; ++first)
+      if (axis_within(x.row(first), lower, upper, n)) emit(first);
+  }
+}
+
+template <typename Rows, typename Value, typename Emit>
+void kd_radius_query_adaptive(const Rows& x, const std::uint8_t* axes,
+                              size_t first, size_t last,
+                              const Value& value, double radius,
+                              Emit& emit, size_t bucket)
+{
+  auto n = x.ncol();
+  if (last - first > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = first + (last - first) / 2;
+    auto j = axes[pivot];
+    auto&& p = x.row(pivot);
+    if (axis_l2dist(p, value, n) <= radius) emit(pivot);
+    if (!(scalar_diff(value[j], p[j]) > radius)) // search left, also of NaN
+      kd_radius_query_adaptive(x, axes, first, pivot, value, radius,
+                               emit, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (scalar_diff(p[j], value[j]) <= radius) // search right
+      kd_radius_query_adaptive(x, axes, pivot + 1, last, value, radius,
+                               emit, bucket);
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, last - first);
+    for (; first != last; ++first)
+      if (axis_l2dist(x.row(first), value, n) <= radius) emit(first);
+  }
+}
+
+template <typename Rows, typename Value, typename QType>
+void knn_adaptive(const Rows& x, const std::uint8_t* axes,
+                  size_t first, size_t last,
+                  const Value& value, QType& Q, size_t bucket)
+{
+  auto n = x.ncol();
+  if (last - first <= bucket)
+  {
+    KDTOOLS_STAT_ADD(points_scanned, last - first);
+    for (; first != last; ++first)
+      Q.add(axis_l2dist(x.row(first), value, n), first);
+    return;
+  }
+  KDTOOLS_STAT(nodes_visited);
+  auto pivot = first + (last - first) / 2;
+  auto j = axes[pivot];
+  auto&& p = x.row(pivot);
+  Q.add(axis_l2dist(p, value, n), pivot);
+  // a NaN pivot has every number on its left, as in knn
+  auto search_left = sort_less(value[j], p[j]);
+  if (search_left)
+    knn_adaptive(x, axes, first, pivot, value, Q, bucket);
+  else
+    knn_adaptive(x, axes, pivot + 1, last, value, Q, bucket);
+  if (nan_last(scalar_dist(value[j], p[j])) <= Q.max_key())
+  {
+    if (search_left)
+      knn_adaptive(x, axes, pivot + 1, last, value, Q, bucket);
+    else
+      knn_adaptive(x, axes, first, pivot, value, Q, bucket);
+  }
+  else KDTOOLS_STAT(subtrees_pruned);
+}
+
+// Convex polytope queries. The polytope is the intersection of m
+// half-spaces a.x <= b, the coefficients of each held in a row of a.
+// Each subtree is searched with its cell, the box bounded by the pivots
+// above it, and the constraints that cut that cell. A cell outside any
+// constraint is skipped and one inside all of them is emitted whole,
+// less any rows holding NaN, which are never inside.
+
+template <typename Row>
+bool row_has_nan(const Row& x, size_t ncol)
+{
+  for (size_t j = 0; j != ncol; ++j)
+    if (x[j] != x[j]) return true;
+  return false;
+}
+
+// Returns -1 if the cell lies outside a.x <= b, 1 if inside, else 0
+inline int cell_side(const double* a, double b, const double* cell,
+                     size_t ncol)
+{
+  double lo = 0, hi = 0;
+  for (size_t j = 0; j != ncol; ++j)
+  {
+    if (0 < a[j])
+    {
+      lo += a[j] * cell[j];
+      hi += a[j] * cell[ncol + j];
+    }
+    if (a[j] < 0)
+    {
+      lo += a[j] * cell[ncol + j];
+      hi += a[j] * cell[j];
+    }
+  }
+  if (b < lo) return -1;
+  return hi <= b ? 1 : 0;
+}
+
+template <typename Row>
+bool in_polytope(const Row& x, const double* a, const double* b,
+                 const size_t* act, size_t nact, size_t ncol)
+{
+  if (row_has_nan(x, ncol)) return false;
+  for (size_t k = 0; k != nact; ++k)
+  {
+    auto ak = a + act[k] * ncol;
+    double s = 0;
+    for (size_t j = 0; j != ncol; ++j)
+      if (ak[j] != 0) s += ak[j] * x[j];
+    if (!(s <= b[act[k]])) return false;
+  }
+  return true;
+}
+
+// The constraints cutting a child's cell are written after the parent's
+// in act, which needs room for m per level
+template <typename Rows, typename Emit>
+void kd_polytope_query(const Rows& x, const std::uint8_t* axes,
+                       size_t first, size_t last, size_t j,
+                       const double* a, const double* b, double* cell,
+                       size_t* act, size_t nact, Emit& emit, size_t bucket)
+{
+  auto n = x.ncol();
+  auto cut = act + nact;
+  size_t ncut = 0;
+  for (size_t k = 0; k != nact; ++k)
+  {
+    auto side = cell_side(a + act[k] * n, b[act[k]], cell, n);
+    if (side < 0)
+    {
+      KDTOOLS_STAT(subtrees_pruned);
+      return;
+    }
+    if (side == 0) cut[ncut++] = act[k];
+  }
+  if (ncut == 0)
+  {
+    for (; first != last; ++first)
+      if (!row_has_nan(x.row(first), n)) emit(first);
+    return;
+  }
+  if (last - first > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = first + (last - first) / 2;
+    auto i = axes ? axes[pivot] : j;
+    auto&& p = x.row(pivot);
+    if (in_polytope(p, a, b, cut, ncut, n)) emit(pivot);
+    auto k = next_dim_dyn(j, n);
+    double split = p[i], bound = cell[n + i];
+    cell[n + i] = split;
+    kd_polytope_query(x, axes, first, pivot, k, a, b, cell,
+                      cut, ncut, emit, bucket);
+    cell[n + i] = bound;
+    bound = cell[i];
+    cell[i] = split;
+    kd_polytope_query(x, axes, pivot + 1, last, k, a, b, cell,
+                      cut, ncut, emit, bucket);
+    cell[i] = bound;
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, last - first);
+    for (; first != last; ++first)
+      if (in_polytope(x.row(first), a, b, cut, ncut, n)) emit(first);
+  }
+}
+
+template <typename Rows, typename Emit>
+void kd_polytope_query(const Rows& x, const std::uint8_t* axes,
+                       const double* a, const double* b, size_t m,
+                       Emit& emit, size_t bucket)
+{
+  auto n = x.ncol();
+  vector<double> cell(2 * n, numeric_limits<double>::infinity());
+  for (size_t j = 0; j != n; ++j) cell[j] = -cell[j];
+  size_t levels = 2;
+  for (auto s = x.size(); s > 1; s /= 2) ++levels;
+  vector<size_t> act(m * levels);
+  for (size_t k = 0; k != m; ++k) act[k] = k;
+  kd_polytope_query(x, axes, 0, x.size(), 0, a, b, cell.data(),
+                    act.data(), m, emit, bucket);
+}
+
+// Range summaries. Subtrees down to the leaf size keep the summary of
+// their weights, the children of node k at 2k + 1 and 2k + 2. A query
+// passes down the cell of each subtree, the box bounded by the data and
+// the pivots above it, and takes the stored summary of any cell inside
+// the query box. Points holding NaN are left out of every summary.
+
+inline size_t summary_slots(size_t n, size_t bucket)
+{
+  size_t slots = 1;
+  for (; n > leaf_size(bucket); n /= 2) slots = 2 * slots + 1;
+  return slots;
+}
+
+template <typename Rows>
+kd_summary build_summaries(const Rows& x, size_t first, size_t last,
+                           const double* w, kd_summary* nodes, size_t k,
+                           size_t bucket)
+{
+  auto n = x.ncol();
+  kd_summary s;
+  if (last - first > leaf_size(bucket)) {
+    auto pivot = first + (last - first) / 2;
+    s = build_summaries(x, first, pivot, w, nodes, 2 * k + 1, bucket);
+    s.add(build_summaries(x, pivot + 1, last, w, nodes, 2 * k + 2, bucket));
+    if (!row_has_nan(x.row(pivot), n)) s.add(w[pivot]);
+  } else {
+    for (; first != last; ++first)
+      if (!row_has_nan(x.row(first), n)) s.add(w[first]);
+  }
+  return nodes[k] = s;
+}
+
+template <typename Rows>
+kd_summary_tree kd_summarize(const Rows& x, const double* w, size_t bucket)
+{
+  auto n = x.ncol();
+  kd_summary_tree t;
+  t.m_size = x.size();
+  t.m_ncol = n;
+  t.m_bucket = bucket;
+  t.m_nodes.resize(summary_slots(x.size(), bucket));
+  build_summaries(x, 0, x.size(), w, t.m_nodes.data(), 0, bucket);
+  t.m_bounds.assign(2 * n, numeric_limits<double>::infinity());
+  for (size_t j = 0; j != n; ++j) t.m_bounds[n + j] = -t.m_bounds[j];
+  for (size_t i = 0; i != x.size(); ++i)
+  {
+    auto&& p = x.row(i);
+    if (row_has_nan(p, n)) continue;
+    for (size_t j = 0; j != n; ++j)
+    {
+      if (p[j] < t.m_bounds[j]) t.m_bounds[j] = p[j];
+      if (t.m_bounds[n + j] < p[j]) t.m_bounds[n + j] = p[j];
+    }
+  }
+  return t;
+}
+
+template <typename Value>
+bool cell_within(const double* cell, const Value& lower, const Value& upper,
+                 size_t ncol)
+{
+  for (size_t j = 0; j != ncol; ++j)
+    if (cell[j] < lower[j] || !(cell[ncol + j] < upper[j])) return false;
+  return true;
+}
+
+template <typename Rows, typename Value>
+void kd_range_summary(const Rows& x, size_t first, size_t last, size_t j,
+                      const double* w, const kd_summary* nodes, size_t k,
+                      const Value& lower, const Value& upper, double* cell,
+                      kd_summary& res, size_t bucket)
+{
+  auto n = x.ncol();
+  if (cell_within(cell, lower, upper, n))
+  {
+    res.add(nodes[k]);
+    return;
+  }
+  if (last - first > leaf_size(bucket)) {
+    KDTOOLS_STAT(nodes_visited);
+    auto pivot = first + (last - first) / 2;
+    auto i = next_dim_dyn(j, n);
+    auto&& p = x.row(pivot);
+    if (axis_within(p, lower, upper, n)) res.add(w[pivot]);
+    double split = p[j];
+    if (!(p[j] < lower[j])) // search left
+    {
+      auto bound = cell[n + j];
+      cell[n + j] = split;
+      kd_range_summary(x, first, pivot, i, w, nodes, 2 * k + 1,
+                       lower, upper, cell, res, bucket);
+      cell[n + j] = bound;
+    }
+    else KDTOOLS_STAT(subtrees_pruned);
+    if (p[j] < upper[j]) // search right
+    {
+      auto bound = cell[j];
+      cell[j] = split;
+      kd_range_summary(x, pivot + 1, last, i, w, nodes, 2 * k + 2,
+                       lower, upper, cell, res, bucket);
+      cell[j] = bound;
+    }
+    else KDTOOLS_STAT(subtrees_pruned);
+  } else {
+    KDTOOLS_STAT_ADD(points_scanned, last - first);
+    for (; first != last; ++first)
+      if (axis_within(x.row(first), lower, upper, n)) res.add(w[first]);
+  }
+}
+
+template <typename Rows, typename Value>
+kd_summary kd_range_summary(const Rows& x, const double* w,
+                            const kd_summary_tree& t,
+                            const Value& lower, const Value& upper)
+{
+  kd_summary res;
+  auto cell = t.m_bounds;
+  kd_range_summary(x, 0, x.size(), 0, w, t.m_nodes.data(), 0,
+                   lower, upper, cell.data(), res, t.m_bucket);
+  return res;
+}
+
+// Dual-tree kernel density estimation. Both ranges are split as kd_sort
+// splits them, with the bounding box of every subtree down to the leaf
+// size kept in heap order; the boxes are exact whatever the order, which
+// only affects speed. A query subtree carries a list of reference subtrees
+// whose kernel values still vary too much across the pair to be replaced
+// by their midpoint. The errors of the pairs replaced so far never exceed
+// their share of rel_err times a lower bound on the sums of the query
+// subtree, so each sum is within rel_err of the exact value.
+
+constexpr size_t kde_leaf = 32;
+
+struct kde_node
+{
+  size_t first, last, k;
+  size_t size() const
+  {
+    return last - first;
+  }
+};
+
+// Rows holding NaN are left out of the boxes and counts; a subtree of
+// such rows alone has an empty box and a count of zero.
+template <typename Rows>
+size_t build_kde_boxes(const Rows& x, size_t first, size_t last, size_t k,
+                       double* boxes, size_t* counts)
+{
+  auto n = x.ncol();
+  auto box = boxes + 2 * n * k;
+  for (size_t j = 0; j != n; ++j)
+  {
+    box[j] = numeric_limits<double>::infinity();
+    box[n + j] = -numeric_limits<double>::infinity();
+  }
+  auto grow = [&](const double* other){
+    for (size_t j = 0; j != n; ++j)
+    {
+      if (other[j] < box[j]) box[j] = other[j];
+      if (box[n + j] < other[n + j]) box[n + j] = other[n + j];
+    }
+  };
+  size_t count = 0;
+  auto add = [&](size_t i){
+    auto&& p = x.row(i);
+    if (row_has_nan(p, n)) return;
+    ++count;
+    for (size_t j = 0; j != n; ++j)
+    {
+      double v = p[j];
+      if (v < box[j]) box[j] = v;
+      if (box[n + j] < v) box[n + j] = v;
+    }
+  };
+  if (last - first > kde_leaf)
+  {
+    auto pivot = first + (last - first) / 2;
+    count += build_kde_boxes(x, first, pivot, 2 * k + 1, boxes, counts);
+    count += build_kde_boxes(x, pivot + 1, last, 2 * k + 2, boxes, counts);
+    grow(boxes + 2 * n * (2 * k + 1));
+    grow(boxes + 2 * n * (2 * k + 2));
+    add(pivot);
+  }
+  else for (; first != last; ++first) add(first);
+  return counts[k] = count;
+}
+
+template <typename Rows>
+struct kde_tree
+{
+  const Rows& m_rows;
+  vector<double> m_boxes;
+  vector<size_t> m_counts;
+  kde_tree(const Rows& x) : m_rows(x)
+  {
+    size_t slots = 1;
+    for (auto n = x.size(); n > kde_leaf; n /= 2) slots = 2 * slots + 1;
+    m_boxes.resize(2 * x.ncol() * slots);
+    m_counts.resize(slots);
+    build_kde_boxes(x, 0, x.size(), 0, m_boxes.data(), m_counts.data());
+  }
+  kde_node root() const
+  {
+    return {0, m_rows.size(), 0};
+  }
+  bool is_leaf(const kde_node& a) const
+  {
+    return a.k == no_node || a.size() <= kde_leaf;
+  }
+  // Left subtree, right subtree and the pivot on its own
+  array<kde_node, 3> split(const kde_node& a) const
+  {
+    auto pivot = a.first + a.size() / 2;
+    return {{{a.first, pivot, 2 * a.k + 1},
+             {pivot + 1, a.last, 2 * a.k + 2},
+             {pivot, pivot + 1, no_node}}};
+  }
+  // Number of rows without NaN
+  size_t count(const kde_node& a) const
+  {
+    if (a.k != no_node) return m_counts[a.k];
+    return a.size() && !row_has_nan(m_rows.row(a.first), m_rows.ncol());
+  }
+  // Single rows have no stored box and use buf
+  const double* box(const kde_node& a, double* buf) const
+  {
+    auto n = m_rows.ncol();
+    if (a.k != no_node) return m_boxes.data() + 2 * n * a.k;
+    auto&& p = m_rows.row(a.first);
+    auto empty = row_has_nan(p, n);
+    for (size_t j = 0; j != n; ++j)
+    {
+      buf[j] = empty ? numeric_limits<double>::infinity() : p[j];
+      buf[n + j] = empty ? -numeric_limits<double>::infinity() : p[j];
+    }
+    return buf;
+  }
+};
+
+// Kernel of a squared distance, unnormalized so that it is one at zero
+struct kde_kernel
+{
+  kernel_type m_type;
+  double m_h2;
+  double operator()(double d2) const
+  {
+    if (!(d2 >= 0)) return 0;
+    if (m_type == kernel_type::gaussian) return std::exp(-0.5 * d2 / m_h2);
+    return d2 < m_h2 ? 1 - d2 / m_h2 : 0;
+  }
+  // Sum of kernel values at q over m rows stored contiguously in r
+  double sum(const double* q, const double* r, size_t m, size_t ncol) const
+  {
+    double s = 0;
+    auto c = 1 / m_h2;
+    for (size_t i = 0; i != m; ++i, r += ncol)
+    {
+      double d2 = 0;
+      for (size_t j = 0; j != ncol; ++j)
+      {
+        double d = q[j] - r[j];
+        d2 += d * d;
+      }
+      if (m_type == kernel_type::gaussian) s += std::exp(-0.5 * c * d2);
+      else if (d2 < m_h2) s += 1 - c * d2;
+    }
+    return s;
+  }
+  // Scales a sum over n points in ncol dimensions to a density
+  double scale(size_t n, size_t ncol) const
+  {
+    auto d = static_cast<double>(ncol);
+    auto hd = std::pow(m_h2, d / 2);
+    if (m_type == kernel_type::gaussian)
+      return 1 / (n * hd * std::pow(2 * pi, d / 2));
+    auto vol = std::pow(pi, d / 2) / std::tgamma(d / 2 + 1);
+    return (d + 2) / (2 * vol * n * hd);
+  }
+};
+
+inline void box_dist2(const double* a, const double* b, size_t ncol,
+                      double& near, double& far)
+{
+  near = far = 0;
+  for (size_t j = 0; j != ncol; ++j)
+  {
+    auto lo = std::max(a[j] - b[ncol + j], b[j] - a[ncol + j]),
+      hi = std::max(a[ncol + j] - b[j], b[ncol + j] - a[j]);
+    if (lo > 0) near += lo * lo;
+    far += hi * hi;
+  }
+}
+
+// Sums of kernel values at the queries under Q, written to out. Pruned
+// pairs add their midpoint estimate to carry, their lower bound to
+// carry_lo, their error bound to used and their size to pruned for every
+// query under Q. A pair is pruned while used stays within tol * lower *
+// pruned (tol is rel_err / n), so far pairs with negligible error leave
+// budget for nearer ones; lower only grows as boxes shrink.
+template <typename QRows, typename RRows>
+void kde_dual(const kde_tree<QRows>& qt, const kde_tree<RRows>& rt,
+              kde_node Q, vector<kde_node> refs, double carry,
+              double carry_lo, double used, size_t pruned,
+              const kde_kernel& K, double tol, double* out,
+              int max_threads, int thread_depth)
+{
+  auto n = qt.m_rows.ncol();
+  vector<double> qbuf(2 * n), rbuf(2 * n);
+  auto qbox = qt.box(Q, qbuf.data());
+  vector<double> kmin(refs.size()), kmax(refs.size());
+  vector<kde_node> split;
+  for (;;)
+  {
+    auto lower = carry_lo;
+    kmin.resize(refs.size());
+    kmax.resize(refs.size());
+    for (size_t i = 0; i != refs.size(); ++i)
+    {
+      double near, far;
+      box_dist2(qbox, rt.box(refs[i], rbuf.data()), n, near, far);
+      kmax[i] = K(near);
+      kmin[i] = K(far);
+      lower += rt.count(refs[i]) * kmin[i];
+    }
+    size_t m = 0;
+    for (size_t i = 0; i != refs.size(); ++i)
+    {
+      auto size = rt.count(refs[i]);
+      auto e = used + size * (kmax[i] - kmin[i]) / 2;
+      if (e <= tol * lower * (pruned + size))
+      {
+        KDTOOLS_STAT(subtrees_pruned);
+        carry += size * (kmax[i] + kmin[i]) / 2;
+        carry_lo += size * kmin[i];
+        used = e;
+        pruned += size;
+      }
+      else refs[m++] = refs[i];
+    }
+    refs.resize(m);
+    auto qleaf = qt.is_leaf(Q), expanded = false;
+    split.clear();
+    for (auto& R : refs)
+      if (!rt.is_leaf(R) && (qleaf || R.size() >= Q.size()))
+      {
+        KDTOOLS_STAT(nodes_visited);
+        for (auto& c : rt.split(R)) if (rt.count(c)) split.push_back(c);
+        expanded = true;
+      }
+      else split.push_back(R);
+    if (!expanded) break;
+    refs.swap(split);
+  }
+  if (refs.empty())
+  {
+    for (auto i = Q.first; i != Q.last; ++i) out[i] = carry;
+    return;
+  }
+  if (qt.is_leaf(Q))
+  {
+    // Flat copies keep the inner loop free of row access and NaN checks
+    vector<double> flat, q(n);
+    for (auto& R : refs)
+      for (auto r = R.first; r != R.last; ++r)
+      {
+        auto&& p = rt.m_rows.row(r);
+        if (row_has_nan(p, n)) continue;
+        for (size_t j = 0; j != n; ++j) flat.push_back(p[j]);
+      }
+    auto m = flat.size() / std::max<size_t>(n, 1);
+    for (auto i = Q.first; i != Q.last; ++i)
+    {
+      KDTOOLS_STAT_ADD(points_scanned, m);
+      auto&& p = qt.m_rows.row(i);
+      for (size_t j = 0; j != n; ++j) q[j] = p[j];
+      out[i] = carry + K.sum(q.data(), flat.data(), m, n);
+    }
+    return;
+  }
+  KDTOOLS_STAT(nodes_visited);
+  auto c = qt.split(Q);
+  if (c[0].size() && (1 << thread_depth) <= max_threads)
+  {
+    thread t([&]{
+      kde_dual(qt, rt, c[0], refs, carry, carry_lo, used, pruned, K, tol,
+               out, max_threads, thread_depth + 1);
+    });
+    kde_dual(qt, rt, c[1], refs, carry, carry_lo, used, pruned, K, tol,
+             out, max_threads, thread_depth + 1);
+    kde_dual(qt, rt, c[2], refs, carry, carry_lo, used, pruned, K, tol,
+             out, max_threads, thread_depth + 1);
+    t.join();
+  }
+  else
+    for (auto& child : c)
+      if (child.size())
+        kde_dual(qt, rt, child, refs, carry, carry_lo, used, pruned, K,
+                 tol, out, max_threads, thread_depth + 1);
+}
+
+template <typename RRows, typename QRows>
+void kd_density(const RRows& x, const QRows& q, double* out,
+                double bandwidth, kernel_type kernel, double rel_err,
+                int max_threads)
+{
+  if (q.size() == 0) return;
+  kde_tree<RRows> rt(x);
+  kde_kernel K{kernel, bandwidth * bandwidth};
+  // n counts the rows without NaN, which are the only ones summed
+  auto n = rt.count(rt.root());
+  double scale = 0;
+  if (n == 0) std::fill(out, out + q.size(), 0.0);
+  else
+  {
+    kde_tree<QRows> qt(q);
+    kde_dual(qt, rt, qt.root(), vector<kde_node>(1, rt.root()), 0, 0, 0, 0,
+             K, rel_err / n, out, max_threads, 1);
+    scale = K.scale(n, x.ncol());
+  }
+  for (size_t i = 0; i != q.size(); ++i)
+    out[i] = row_has_nan(q.row(i), x.ncol()) ?
+      numeric_limits<double>::quiet_NaN() : out[i] * scale;
+}
+
+// Lock-free union-find. Roots are linked under the smaller index, so the
+// sets found do not depend on the order of the unions.
+struct atomic_forest
+{
+  vector<std::atomic<size_t>> m_parent;
+  atomic_forest(size_t n) : m_parent(n)
+  {
+    for (size_t i = 0; i != n; ++i) m_parent[i].store(i);
+  }
+  size_t find(size_t i)
+  {
+    for (;;)
+    {
+      auto p = m_parent[i].load();
+      if (p == i) return i;
+      auto g = m_parent[p].load();
+      if (g != p) m_parent[i].compare_exchange_weak(p, g);
+      i = g;
+    }
+  }
+  void unite(size_t a, size_t b)
+  {
+    for (;;)
+    {
+      a = find(a);
+      b = find(b);
+      if (a == b) return;
+      if (a < b) std::swap(a, b);
+      auto expected = a;
+      if (m_parent[a].compare_exchange_strong(expected, b)) return;
+    }
+  }
+};
+
+constexpr size_t dbscan_block = 256;
+
+// Calls f(i, buf) for each i in [0, n), handing out blocks of rows to
+// threads as they finish; buf is a scratch vector owned by the thread
+template <typename F>
+void for_blocks(size_t n, int max_threads, F f)
+{
+  auto nblocks = (n + dbscan_block - 1) / dbscan_block;
+  auto nthreads = std::max<size_t>(
+    std::min<size_t>(max_threads > 1 ? max_threads : 1, nblocks), 1);
+  std::atomic<size_t> next_block(0);
+  for_chunks(nthreads, nthreads, [&](size_t, size_t, size_t){
+    vector<size_t> buf;
+    for (;;)
+    {
+      auto first = next_block.fetch_add(1) * dbscan_block;
+      if (first >= n) return;
+      auto last = std::min(first + dbscan_block, n);
+      for (auto i = first; i != last; ++i) f(i, buf);
+    }
+  });
+}
+
+// Core(i, m) tells whether row i has at least m rows within eps, itself
+// included, and Near(i, buf) appends those rows to buf. Core rows within
+// eps of one another share a cluster; other rows within eps of a core row
+// join the cluster of the first such row, and the rest are noise. Labels
+// are 0 for noise and count clusters from 1 in order of first appearance.
+template <typename Core, typename Near>
+vector<size_t> dbscan(size_t n, size_t min_pts, Core is_core, Near near,
+                      int max_threads)
+{
+  vector<size_t> labels(n, 0);
+  if (n == 0) return labels;
+  min_pts = std::max<size_t>(min_pts, 1);
+  vector<char> core(n);
+  for_blocks(n, max_threads, [&](size_t i, vector<size_t>&){
+    core[i] = is_core(i, min_pts);
+  });
+  atomic_forest forest(n);
+  vector<std::atomic<size_t>> owner(n);
+  for (auto& o : owner) o.store(no_node);
+  for_blocks(n, max_threads, [&](size_t i, vector<size_t>& buf){
+    if (!core[i]) return;
+    buf.clear();
+    near(i, buf);
+    for (auto j : buf)
+      if (core[j])
+      {
+        if (j < i) forest.unite(i, j);
+      }
+      else
+      {
+        auto o = owner[j].load();
+        while (i < o && !owner[j].compare_exchange_weak(o, i)) {}
+      }
+  });
+  vector<size_t> ids(n, 0);
+  size_t nclusters = 0;
+  for (size_t i = 0; i != n; ++i)
+  {
+    auto c = core[i] ? i : owner[i].load();
+    if (c == no_node) continue;
+    auto r = forest.find(c);
+    if (ids[r] == 0) ids[r] = ++nclusters;
+    labels[i] = ids[r];
+  }
+  return labels;
+}
+
+template <typename Iter>
+vector<size_t> kd_dbscan(Iter first, Iter last, double eps, size_t min_pts,
+                         size_t bucket, int max_threads)
+{
+  auto is_core = [&](size_t i, size_t m){
+    size_t count = 0;
+    auto f = [&](Iter){ return ++count < m; };
+    kd_radius_visit<0>(first, last, *next(first, i), eps, f, bucket);
+    return count >= m;
+  };
+  auto near = [&](size_t i, vector<size_t>& buf){
+    auto f = [&](Iter it){ buf.push_back(distance(first, it)); };
+    kd_radius_visit<0>(first, last, *next(first, i), eps, f, bucket);
+  };
+  return dbscan(static_cast<size_t>(distance(first, last)), min_pts,
+                is_core, near, max_threads);
+}
+
+template <typename T>
+vector<size_t> kd_dbscan(const dyn_rows<T>& x, double eps, size_t min_pts,
+                         size_t bucket, int max_threads)
+{
+  auto near = [&](size_t i, vector<size_t>& buf){
+    auto outp = back_inserter(buf);
+    kd_radius_query_dyn(x, 0, x.size(), x.row(i), eps, 0, outp, bucket);
+  };
+  auto is_core = [&](size_t i, size_t m){
+    size_t count = 0;
+    auto f = [&](size_t){ return ++count < m; };
+    kd_radius_visit_dyn(x, 0, x.size(), x.row(i), eps, 0, f, bucket);
+    return count >= m;
+  };
+  return dbscan(x.size(), min_pts, is_core, near, max_threads);
+}
+
+// Filtering k-means (Kanungo et al. 2002). Each subtree of the kd-sorted
+// range stores the bounding box, sum and count of its rows without NaN,
+// in heap order. A subtree carries the centers that may be closest to
+// some point in its box; a center is dropped when the one closest to the
+// box midpoint is at least as close at the box corner furthest along the
+// line between them, and a subtree left with one center is assigned to it
+// whole. Subtrees near the root sum into their own accumulators whether or
+// not a thread takes them, so the centers do not depend on max_threads.
+
+constexpr size_t kmeans_leaf = 16;
+constexpr int kmeans_split_depth = 4;
+
+template <typename Rows>
+struct kmeans_tree
+{
+  const Rows& m_rows;
+  vector<double> m_boxes, m_sums;
+  vector<size_t> m_counts;
+  kmeans_tree(const Rows& x, int max_threads) : m_rows(x)
+  {
+    size_t slots = 1;
+    for (auto n = x.size(); n > kmeans_leaf; n /= 2) slots = 2 * slots + 1;
+    m_boxes.resize(2 * x.ncol() * slots);
+    m_sums.resize(x.ncol() * slots);
+    m_counts.resize(slots);
+    build(0, x.size(), 0, max_threads, 1);
+  }
+  void build(size_t first, size_t last, size_t k, int max_threads,
+             int thread_depth)
+  {
+    auto n = m_rows.ncol();
+    auto box = &m_boxes[2 * n * k];
+    auto sum = &m_sums[n * k];
+    auto& count = m_counts[k];
+    for (size_t j = 0; j != n; ++j)
+    {
+      box[j] = numeric_limits<double>::infinity();
+      box[n + j] = -numeric_limits<double>::infinity();
+    }
+    auto add_row = [&](size_t i){
+      auto&& p = m_rows.row(i);
+      if (row_has_nan(p, n)) return;
+      for (size_t j = 0; j != n; ++j)
+      {
+        double v = p[j];
+        box[j] = std::min(box[j], v);
+        box[n + j] = std::max(box[n + j], v);
+        sum[j] += v;
+      }
+      ++count;
+    };
+    auto add_node = [&](size_t c){
+      if (m_counts[c] == 0) return;
+      auto cbox = &m_boxes[2 * n * c];
+      auto csum = &m_sums[n * c];
+      for (size_t j = 0; j != n; ++j)
+      {
+        box[j] = std::min(box[j], cbox[j]);
+        box[n + j] = std::max(box[n + j], cbox[n + j]);
+        sum[j] += csum[j];
+      }
+      count += m_counts[c];
+    };
+    if (last - first > kmeans_leaf)
+    {
+      auto pivot = first + (last - first) / 2;
+      if ((1 << thread_depth) <= max_threads)
+      {
+        thread t([&]{
+          build(first, pivot, 2 * k + 1, max_threads, thread_depth + 1);
+        });
+        build(pivot + 1, last, 2 * k + 2, max_threads, thread_depth + 1);
+        t.join();
+      }
+      else
+      {
+        build(first, pivot, 2 * k + 1, max_threads, thread_depth + 1);
+        build(pivot + 1, last, 2 * k + 2, max_threads, thread_depth + 1);
+      }
+      add_node(2 * k + 1);
+      add_node(2 * k + 2);
+      add_row(pivot);
+    }
+    else for (auto i = first; i != last; ++i) add_row(i);
+  }
+};
+
+struct kmeans_acc
+{
+  size_t m_ncol;
+  vector<double> m_sums;
+  vector<size_t> m_counts;
+  size_t m_evals = 0;
+  kmeans_acc(size_t k, size_t ncol)
+    : m_ncol(ncol), m_sums(k * ncol), m_counts(k) {}
+  void add(size_t c, const double* sum, size_t count)
+  {
+    for (size_t j = 0; j != m_ncol; ++j) m_sums[c * m_ncol + j] += sum[j];
+    m_counts[c] += count;
+  }
+  void merge(const kmeans_acc& other)
+  {
+    for (size_t i = 0; i != m_sums.size(); ++i) m_sums[i] += other.m_sums[i];
+    for (size_t i = 0; i != m_counts.size(); ++i)
+      m_counts[i] += other.m_counts[i];
+    m_evals += other.m_evals;
+  }
+};
+
+// Assigns the rows of subtree k to their nearest centers, writing labels
+// when labels is not null
+template <typename Rows>
+void kmeans_filter(const kmeans_tree<Rows>& t, size_t first, size_t last,
+                   size_t k, const double* centers, vector<size_t> cands,
+                   kmeans_acc& acc, size_t* labels, int max_threads,
+                   int depth)
+{
+  auto n = t.m_rows.ncol();
+  if (t.m_counts[k] == 0)
+  {
+    if (labels) std::fill(labels + first, labels + last, no_node);
+    return;
+  }
+  auto box = &t.m_boxes[2 * n * k];
+  if (cands.size() > 1)
+  {
+    size_t best = cands[0];
+    auto best_d2 = numeric_limits<double>::infinity();
+    for (auto c : cands)
+    {
+      double d2 = 0;
+      for (size_t j = 0; j != n; ++j)
+      {
+        double d = centers[c * n + j] - (box[j] + box[n + j]) / 2;
+        d2 += d * d;
+      }
+      if (d2 < best_d2)
+      {
+        best = c;
+        best_d2 = d2;
+      }
+    }
+    acc.m_evals += cands.size();
+    size_t m = 0;
+    for (auto c : cands)
+    {
+      if (c == best)
+      {
+        cands[m++] = c;
+        continue;
+      }
+      double dc = 0, db = 0;
+      for (size_t j = 0; j != n; ++j)
+      {
+        auto zc = centers[c * n + j], zb = centers[best * n + j];
+        auto v = zc > zb ? box[n + j] : box[j];
+        dc += (zc - v) * (zc - v);
+        db += (zb - v) * (zb - v);
+      }
+      acc.m_evals += 2;
+      // a tie keeps c when it is listed first, as assign picks the first
+      if (dc < db || (dc == db && c < best)) cands[m++] = c;
+    }
+    cands.resize(m);
+  }
+  if (cands.size() == 1)
+  {
+    acc.add(cands[0], &t.m_sums[n * k], t.m_counts[k]);
+    if (labels)
+      for (auto i = first; i != last; ++i)
+        labels[i] = row_has_nan(t.m_rows.row(i), n) ? no_node : cands[0];
+    return;
+  }
+  auto assign = [&](size_t i){
+    auto&& p = t.m_rows.row(i);
+    if (row_has_nan(p, n))
+    {
+      if (labels) labels[i] = no_node;
+      return;
+    }
+    size_t best = cands[0];
+    auto best_d2 = numeric_limits<double>::infinity();
+    for (auto c : cands)
+    {
+      double d2 = 0;
+      for (size_t j = 0; j != n; ++j)
+      {
+        double d = centers[c * n + j] - p[j];
+        d2 += d * d;
+      }
+      if (d2 < best_d2)
+      {
+        best = c;
+        best_d2 = d2;
+      }
+    }
+    acc.m_evals += cands.size();
+    for (size_t j = 0; j != n; ++j) acc.m_sums[best * n + j] += p[j];
+    ++acc.m_counts[best];
+    if (labels) labels[i] = best;
+  };
+  if (last - first <= kmeans_leaf)
+  {
+    for (auto i = first; i != last; ++i) assign(i);
+    return;
+  }
+  auto pivot = first + (last - first) / 2;
+  if (depth > kmeans_split_depth)
+  {
+    kmeans_filter(t, first, pivot, 2 * k + 1, centers, cands, acc, labels,
+                  max_threads, depth + 1);
+    assign(pivot);
+    kmeans_filter(t, pivot + 1, last, 2 * k + 2, centers, cands, acc,
+                  labels, max_threads, depth + 1);
+    return;
+  }
+  kmeans_acc left(acc.m_counts.size(), n);
+  auto run_left = [&]{
+    kmeans_filter(t, first, pivot, 2 * k + 1, centers, cands, left, labels,
+                  max_threads, depth + 1);
+  };
+  thread th;
+  if ((1 << depth) <= max_threads) th = thread(run_left);
+  else run_left();
+  assign(pivot);
+  kmeans_filter(t, pivot + 1, last, 2 * k + 2, centers, cands, acc, labels,
+                max_threads, depth + 1);
+  if (th.joinable()) th.join();
+  acc.merge(left);
+}
+
+// Iterates from the k initial centers until no center moves or max_iter
+// iterations, then labels the rows with the final centers
+template <typename Rows>
+kd_kmeans_result kd_kmeans(const Rows& x, const double* init, size_t k,
+                           size_t max_iter, int max_threads)
+{
+  auto n = x.ncol();
+  kd_kmeans_result res;
+  res.centers.assign(init, init + k * n);
+  res.sizes.assign(k, 0);
+  res.labels.assign(x.size(), no_node);
+  if (k == 0 || x.size() == 0) return res;
+  kmeans_tree<Rows> t(x, max_threads);
+  vector<size_t> all(k);
+  std::iota(begin(all), end(all), size_t(0));
+  while (res.iterations < max_iter)
+  {
+    kmeans_acc acc(k, n);
+    kmeans_filter(t, 0, x.size(), 0, res.centers.data(), all, acc, nullptr,
+                  max_threads, 1);
+    ++res.iterations;
+    res.distance_evals.push_back(acc.m_evals);
+    auto next = res.centers;
+    for (size_t c = 0; c != k; ++c)
+      if (acc.m_counts[c])
+        for (size_t j = 0; j != n; ++j)
+          next[c * n + j] = acc.m_sums[c * n + j] / acc.m_counts[c];
+    if (next == res.centers)
+    {
+      res.converged = true;
+      break;
+    }
+    res.centers.swap(next);
+  }
+  kmeans_acc acc(k, n);
+  kmeans_filter(t, 0, x.size(), 0, res.centers.data(), all, acc,
+                res.labels.data(), max_threads, 1);
+  res.sizes = acc.m_counts;
+  return res;
+}
+
+} // namespace detail
+
+namespace utils {
+
+using detail::all_less;
+using detail::none_less;
+using detail::within;
+
+using detail::middle_of;
+using detail::find_pivot;
+
+using detail::is_last;
+using detail::is_not_last;
+using detail::incr_wrap;
+using detail::next_dim;
+
+using detail::kd_less;
+using detail::less_nth;
+using detail::equal_nth;
+using detail::pred_nth;
+using detail::dist_nth;
+using detail::kd_compare;
+using detail::make_kd_compare;
+
+using detail::l2dist;
+using detail::sum_of_squares;
+
+using detail::l2dist_periodic;
+using detail::within_periodic;
+using detail::set_unbounded;
+using detail::geo_dist;
+
+} // namespace utils
+
+template <typename Iter>
+struct query_context
+{
+  using value_type = detail::iter_value_t<Iter>;
+  detail::n_best<Iter> m_best;
+  std::vector<value_type> m_results;
+  query_context(size_t n = 0) : m_best(n) {}
+  void reserve(size_t n)
+  {
+    m_best.reset(n);
+    m_results.reserve(n);
+  }
+  const std::vector<value_type>& results() const
+  {
+    return m_results;
+  }
+};
+
+// Pivot index over a kd-sorted range. The range must not be modified
+// while the index is in use. With boxes set, the index also stores the
+// bounding box of each node's subrange so that queries can skip or accept
+// whole subtrees; this helps most on clustered data.
+template <typename Iter>
+struct kd_index
+{
+  Iter m_first, m_last;
+  size_t m_bucket;
+  std::vector<detail::index_node> m_nodes;
+  std::vector<double> m_boxes;
+  kd_index(Iter first, Iter last, bucket_size b = bucket_size(),
+           bool boxes = false)
+    : m_first(first), m_last(last), m_bucket(b.value)
+  {
+    detail::build_index<0>(first, first, last, m_nodes, m_bucket);
+    m_nodes = detail::veb_layout(m_nodes);
+    if (boxes && !m_nodes.empty())
+    {
+      constexpr auto N = ndim<detail::iter_value_t<Iter>>::value;
+      m_boxes.resize(2 * N * m_nodes.size());
+      detail::build_boxes(m_nodes.data(), 0, first, first, last,
+                          m_boxes.data(), m_boxes.data());
+    }
+  }
+  const detail::index_node* nodes() const
+  {
+    return m_nodes.data();
+  }
+  const double* boxes() const
+  {
+    return m_boxes.empty() ? nullptr : m_boxes.data();
+  }
+};
+
+// Exact-match index mapping each distinct tuple to the offsets of its
+// copies. The range need not be kd-sorted, but must not be modified while
+// the index is in use.
+template <typename Iter>
+struct kd_hash_index
+{
+  Iter m_first;
+  std::vector<detail::hash_slot> m_slots;
+  std::vector<size_t> m_offsets;
+  kd_hash_index(Iter first, Iter last) : m_first(first)
+  {
+    detail::build_hash(first, last, m_slots, m_offsets);
+  }
+};
+
+// Curve ordering of a range together with its keys. Construction sorts the
+// range, which must not be modified while the index is in use. The grid
+// spans the data unless bounds are given; indices built with the same
+// bounds and curve have comparable keys, so their ranges can be merged.
+// Range queries on 16 or more dimensions scan the whole range.
+template <typename Iter>
+struct curve_index
+{
+  Iter m_first, m_last;
+  curve_type m_curve;
+  detail::curve_grid m_grid;
+  std::vector<std::uint64_t> m_keys;
+  curve_index(Iter first, Iter last, curve_type c = curve_type::hilbert,
+              int max_threads = 1)
+    : m_first(first), m_last(last), m_curve(c),
+      m_grid(detail::make_grid(first, last))
+  {
+    m_keys = detail::curve_sort(first, last, m_grid, c, max_threads);
+  }
+  template <typename TupleType>
+  curve_index(Iter first, Iter last,
+              const TupleType& lower, const TupleType& upper,
+              curve_type c = curve_type::hilbert, int max_threads = 1)
+    : m_first(first), m_last(last), m_curve(c),
+      m_grid(detail::bounds_grid(lower, upper))
+  {
+    m_keys = detail::curve_sort(first, last, m_grid, c, max_threads);
+  }
+  template <typename TupleType>
+  std::uint64_t key(const TupleType& x) const
+  {
+    std::vector<std::uint32_t> cells(m_grid.m_ndim);
+    detail::tuple_cells(m_grid, x, cells.data());
+    return detail::curve_key(m_grid, m_curve, cells.data());
+  }
+};
+
+template <typename Iter>
+void lex_sort(Iter first, Iter last)
+{
+  std::sort(first, last, utils::kd_less<0>());
+}
+
+template <typename Iter, typename Compare>
+void lex_sort(Iter first, Iter last, const Compare& comp)
+{
+  std::sort(first, last, utils::make_kd_compare<0>(comp));
+}
+
+template <typename Iter>
+void lex_sort_threaded(Iter first, Iter last,
+                       int max_threads = std::thread::hardware_concurrency())
+{
+  if (max_threads < 2) return lex_sort(first, last);
+  std::vector<detail::iter_value_t<Iter>> buf(std::distance(first, last));
+  detail::lex_sort_threaded(first, last, std::begin(buf),
+                            utils::kd_less<0>(), max_threads);
+}
+
+template <typename Iter, typename Compare>
+void lex_sort_threaded(Iter first, Iter last, const Compare& comp,
+                       int max_threads = std::thread::hardware_concurrency())
+{
+  if (max_threads < 2) return lex_sort(first, last, comp);
+  std::vector<detail::iter_value_t<Iter>> buf(std::distance(first, last));
+  detail::lex_sort_threaded(first, last, std::begin(buf),
+                            utils::make_kd_compare<0>(comp), max_threads);
+}
+
+template <typename Iter>
+void kd_sort(Iter first, Iter last, bucket_size b = bucket_size())
+{
+  detail::kd_sort<0>(first, last, b.value);
+}
+
+// A finite levels checks only the partitions nearest the root
+template <typename Iter>
+bool kd_is_sorted(Iter first, Iter last, bucket_size b = bucket_size(),
+                  size_t levels = detail::all_levels)
+{
+  return detail::kd_is_sorted<0>(first, last, b.value, levels);
+}
+
+template <typename Iter>
+bool kd_is_sorted_threaded(Iter first, Iter last,
+                           bucket_size b = bucket_size(),
+                           size_t levels = detail::all_levels)
+{
+  std::atomic<bool> failed(false);
+  return detail::kd_is_sorted_threaded<0>(first, last, b.value, levels, failed,
+                                          std::thread::hardware_concurrency());
+}
+
+template <typename Iter>
+bool kd_is_sorted_threaded(Iter first, Iter last, int max_threads,
+                           bucket_size b = bucket_size(),
+                           size_t levels = detail::all_levels)
+{
+  std::atomic<bool> failed(false);
+  return detail::kd_is_sorted_threaded<0>(first, last, b.value, levels, failed,
+                                          max_threads);
+}
+
+template <typename Iter, typename Compare>
+void kd_sort(Iter first, Iter last, const Compare& comp)
+{
+  detail::kd_sort<0>(first, last, comp);
+}
+
+template <typename Iter, typename Compare>
+bool kd_is_sorted(Iter first, Iter last, const Compare& comp)
+{
+  return detail::kd_is_sorted<0>(first, last, comp);
+}
+
+template <typename Iter>
+void kd_sort_threaded(Iter first, Iter last, bucket_size b = bucket_size())
+{
+  detail::kd_sort_threaded<0>(first, last,
+                              std::thread::hardware_concurrency(), 1, b.value);
+}
+
+template <typename Iter>
+void kd_sort_threaded(Iter first, Iter last, int max_threads,
+                      bucket_size b = bucket_size())
+{
+  detail::kd_sort_threaded<0>(first, last, max_threads, 1, b.value);
+}
+
+template <typename Iter, typename Value>
+Iter kd_lower_bound(Iter first, Iter last, const Value& value,
+                    bucket_size b = bucket_size())
+{
+  return detail::kd_lower_bound<0>(first, last, value, b.value);
+}
+
+template <typename Iter, typename Value>
+Iter kd_upper_bound(Iter first, Iter last, const Value& value,
+                    bucket_size b = bucket_size())
+{
+  return detail::kd_upper_bound<0>(first, last, value, b.value);
+}
+
+template <typename Iter, typename TupleType>
+bool kd_binary_search(Iter first, Iter last, const TupleType& value,
+                      bucket_size b = bucket_size())
+{
+  first = detail::kd_lower_bound<0>(first, last, value, b.value);
+  return first != last && utils::none_less(value, *first);
+}
+
+template <typename Iter, typename Value>
+std::pair<Iter, Iter> kd_equal_range(Iter first, Iter last, const Value& value,
+                                     bucket_size b = bucket_size())
+{
+  return std::make_pair(detail::kd_lower_bound<0>(first, last, value, b.value),
+                        detail::kd_upper_bound<0>(first, last, value, b.value));
+}
+
+template <typename Iter, typename TupleType>
+Iter kd_nearest_neighbor(Iter first, Iter last, const TupleType& value,
+                         bucket_size b = bucket_size())
+{
+  return detail::kd_nearest_neighbor<0>(first, last, value, b.value);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_range_query(Iter first, Iter last,
+                    const TupleType& lower,
+                    const TupleType& upper,
+                    OutIter outp, bucket_size b = bucket_size())
+{
+  detail::kd_range_query<0>(first, last, lower, upper, outp, b.value);
+}
+
+// Copies the points satisfying a.x <= b, where a holds m rows of
+// coefficients, one per dimension; points holding NaN never do. The
+// tuples must be indexable.
+template <typename Iter, typename OutIter>
+void kd_polytope_query(Iter first, Iter last,
+                       const double* a, const double* b, size_t m,
+                       OutIter outp, bucket_size bkt = bucket_size())
+{
+  detail::iter_rows<Iter> x(first, last);
+  auto emit = [&](size_t i){ *outp++ = first[i]; };
+  detail::kd_polytope_query(x, nullptr, a, b, m, emit, bkt.value);
+}
+
+// Summarizes weights aligned with a kd-sorted range for kd_range_summary,
+// which must be given the same range and weights
+template <typename Iter>
+kd_summary_tree kd_summarize(Iter first, Iter last, const double* weights,
+                             bucket_size b = bucket_size())
+{
+  detail::iter_rows<Iter> x(first, last);
+  return detail::kd_summarize(x, weights, b.value);
+}
+
+template <typename Iter, typename TupleType>
+kd_summary kd_range_summary(Iter first, Iter last, const double* weights,
+                            const kd_summary_tree& tree,
+                            const TupleType& lower,
+                            const TupleType& upper)
+{
+  detail::iter_rows<Iter> x(first, last);
+  return detail::kd_range_summary(x, weights, tree, lower, upper);
+}
+
+// Writes the kernel density of the points in [first, last) at each query
+// to outp. Both ranges should be kd-sorted for speed; each density is
+// within rel_err of the exact value, relative to it.
+template <typename Iter, typename QIter, typename OutIter>
+void kd_density(Iter first, Iter last, QIter qfirst, QIter qlast,
+                double bandwidth, OutIter outp,
+                kernel_type kernel = kernel_type::gaussian,
+                double rel_err = 0)
+{
+  detail::iter_rows<Iter> x(first, last);
+  detail::iter_rows<QIter> q(qfirst, qlast);
+  std::vector<double> res(q.size());
+  detail::kd_density(x, q, res.data(), bandwidth, kernel, rel_err, 1);
+  std::copy(res.begin(), res.end(), outp);
+}
+
+template <typename Iter, typename QIter, typename OutIter>
+void kd_density_threaded(Iter first, Iter last, QIter qfirst, QIter qlast,
+                         double bandwidth, OutIter outp,
+                         kernel_type kernel = kernel_type::gaussian,
+                         double rel_err = 0,
+                         int max_threads = std::thread::hardware_concurrency())
+{
+  detail::iter_rows<Iter> x(first, last);
+  detail::iter_rows<QIter> q(qfirst, qlast);
+  std::vector<double> res(q.size());
+  detail::kd_density(x, q, res.data(), bandwidth, kernel, rel_err,
+                     max_threads);
+  std::copy(res.begin(), res.end(), outp);
+}
+
+// Writes the DBSCAN cluster of each point in the kd-sorted range to outp:
+// 0 for noise, then clusters numbered from 1 in order of first appearance.
+// A point is core when at least min_pts points, itself included, lie
+// within eps of it.
+template <typename Iter, typename OutIter>
+void kd_dbscan(Iter first, Iter last, double eps, size_t min_pts,
+               OutIter outp, bucket_size b = bucket_size())
+{
+  auto res = detail::kd_dbscan(first, last, eps, min_pts, b.value, 1);
+  std::copy(res.begin(), res.end(), outp);
+}
+
+template <typename Iter, typename OutIter>
+void kd_dbscan_threaded(Iter first, Iter last, double eps, size_t min_pts,
+                        OutIter outp, bucket_size b = bucket_size())
+{
+  auto res = detail::kd_dbscan(first, last, eps, min_pts, b.value,
+                               std::thread::hardware_concurrency());
+  std::copy(res.begin(), res.end(), outp);
+}
+
+template <typename Iter, typename OutIter>
+void kd_dbscan_threaded(Iter first, Iter last, double eps, size_t min_pts,
+                        OutIter outp, int max_threads,
+                        bucket_size b = bucket_size())
+{
+  auto res = detail::kd_dbscan(first, last, eps, min_pts, b.value,
+                               max_threads);
+  std::copy(res.begin(), res.end(), outp);
+}
+
+// Lloyd's k-means from k initial centers, stored as consecutive rows of
+// the range's width. The range should be kd-sorted for speed; the labels
+// are in range order, with the largest size_t for rows containing NaN.
+template <typename Iter>
+kd_kmeans_result kd_kmeans(Iter first, Iter last, const double* centers,
+                           size_t k, size_t max_iter = 10)
+{
+  detail::iter_rows<Iter> x(first, last);
+  return detail::kd_kmeans(x, centers, k, max_iter, 1);
+}
+
+template <typename Iter>
+kd_kmeans_result kd_kmeans_threaded(Iter first, Iter last,
+                                    const double* centers, size_t k,
+                                    size_t max_iter = 10,
+                                    int max_threads =
+                                      std::thread::hardware_concurrency())
+{
+  detail::iter_rows<Iter> x(first, last);
+  return detail::kd_kmeans(x, centers, k, max_iter, max_threads);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_nearest_neighbors(Iter first, Iter last,
+                          const TupleType& value,
+                          size_t n, OutIter outp,
+                          bucket_size b = bucket_size())
+{
+  detail::n_best<Iter> Q(detail::clamp_size(first, last, n));
+  detail::knn<0>(first, last, value, Q, b.value);
+  Q.copy_to(outp);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_radius_query(Iter first, Iter last,
+                     const TupleType& value,
+                     double radius,
+                     OutIter outp, bucket_size b = bucket_size())
+{
+  detail::kd_radius_query<0>(first, last, value, radius, outp, b.value);
+}
+
+// The visit functions call f with an iterator to each point found and
+// return false if f stopped the search by returning false. Nearest
+// neighbors are visited in order of increasing distance, rows with NaN
+// last.
+template <typename Iter,
+          typename TupleType,
+          typename Visitor>
+bool kd_range_visit(Iter first, Iter last,
+                    const TupleType& lower,
+                    const TupleType& upper,
+                    Visitor f, bucket_size b = bucket_size())
+{
+  return detail::kd_range_visit<0>(first, last, lower, upper, f, b.value);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename Visitor>
+bool kd_radius_visit(Iter first, Iter last,
+                     const TupleType& value,
+                     double radius,
+                     Visitor f, bucket_size b = bucket_size())
+{
+  return detail::kd_radius_visit<0>(first, last, value, radius, f, b.value);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename Visitor>
+bool kd_nearest_visit(Iter first, Iter last,
+                      const TupleType& value,
+                      Visitor f, bucket_size b = bucket_size())
+{
+  return detail::kd_nearest_visit(first, last, value, f, b.value);
+}
+
+template <typename Iter, typename TupleType>
+bool kd_any_in_range(Iter first, Iter last,
+                     const TupleType& lower,
+                     const TupleType& upper,
+                     bucket_size b = bucket_size())
+{
+  return !kd_range_visit(first, last, lower, upper,
+                         [](Iter){ return false; }, b);
+}
+
+template <typename Iter, typename TupleType>
+const std::vector<typename query_context<Iter>::value_type>&
+kd_range_query(Iter first, Iter last,
+               const TupleType& lower,
+               const TupleType& upper,
+               query_context<Iter>& context,
+               bucket_size b = bucket_size())
+{
+  context.m_results.clear();
+  auto outp = std::back_inserter(context.m_results);
+  detail::kd_range_query<0>(first, last, lower, upper, outp, b.value);
+  return context.m_results;
+}
+
+template <typename Iter, typename TupleType>
+const std::vector<typename query_context<Iter>::value_type>&
+kd_radius_query(Iter first, Iter last,
+                const TupleType& value,
+                double radius,
+                query_context<Iter>& context,
+                bucket_size b = bucket_size())
+{
+  context.m_results.clear();
+  auto outp = std::back_inserter(context.m_results);
+  detail::kd_radius_query<0>(first, last, value, radius, outp, b.value);
+  return context.m_results;
+}
+
+template <typename Iter, typename TupleType>
+const std::vector<typename query_context<Iter>::value_type>&
+kd_nearest_neighbors(Iter first, Iter last,
+                     const TupleType& value,
+                     size_t n, query_context<Iter>& context,
+                     bucket_size b = bucket_size())
+{
+  context.m_results.clear();
+  context.m_best.reset(detail::clamp_size(first, last, n));
+  detail::knn<0>(first, last, value, context.m_best, b.value);
+  context.m_best.copy_to(std::back_inserter(context.m_results));
+  return context.m_results;
+}
+
+template <typename Iter, typename TupleType>
+Iter kd_nearest_neighbor(const kd_index<Iter>& index, const TupleType& value)
+{
+  return detail::kd_nearest_neighbor_index<0>(index.nodes(), 0,
+                                              index.m_first, index.m_first,
+                                              index.m_last, value,
+                                              index.m_bucket);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_range_query(const kd_index<Iter>& index,
+                    const TupleType& lower,
+                    const TupleType& upper,
+                    OutIter outp)
+{
+  auto q = detail::coords(lower, upper);
+  detail::kd_range_query_index<0>(index.nodes(), index.boxes(), q.data(), 0,
+                                  index.m_first, index.m_first, index.m_last,
+                                  lower, upper, outp, index.m_bucket);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_radius_query(const kd_index<Iter>& index,
+                     const TupleType& value,
+                     double radius,
+                     OutIter outp)
+{
+  auto q = detail::coords(value);
+  detail::kd_radius_query_index<0>(index.nodes(), index.boxes(), q.data(), 0,
+                                   index.m_first, index.m_first, index.m_last,
+                                   value, radius, outp, index.m_bucket);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_nearest_neighbors(const kd_index<Iter>& index,
+                          const TupleType& value,
+                          size_t n, OutIter outp)
+{
+  detail::n_best<Iter> Q(detail::clamp_size(index.m_first, index.m_last, n));
+  auto q = detail::coords(value);
+  detail::knn_index<0>(index.nodes(), index.boxes(), q.data(), 0,
+                       index.m_first, index.m_first, index.m_last,
+                       value, Q, index.m_bucket);
+  Q.copy_to(outp);
+}
+
+template <typename Iter, typename TupleType>
+bool kd_binary_search(const kd_index<Iter>& index, const TupleType& value)
+{
+  return detail::kd_binary_search_index<0>(index.nodes(), 0,
+                                           index.m_first, index.m_first,
+                                           index.m_last, value,
+                                           index.m_bucket);
+}
+
+template <typename Iter, typename TupleType>
+bool kd_binary_search(const kd_hash_index<Iter>& index,
+                      const TupleType& value)
+{
+  auto r = detail::find_hash(index.m_slots, index.m_offsets,
+                             index.m_first, value);
+  return r.first != r.second;
+}
+
+// Returns the ascending offsets from index.m_first of all copies of value
+template <typename Iter, typename TupleType>
+std::pair<const size_t*, const size_t*>
+kd_equal_range(const kd_hash_index<Iter>& index, const TupleType& value)
+{
+  return detail::find_hash(index.m_slots, index.m_offsets,
+                           index.m_first, value);
+}
+
+template <typename Iter>
+void curve_sort(Iter first, Iter last, curve_type c = curve_type::hilbert)
+{
+  detail::curve_sort(first, last, detail::make_grid(first, last), c, 1);
+}
+
+template <typename Iter>
+void curve_sort_threaded(Iter first, Iter last,
+                         curve_type c = curve_type::hilbert,
+                         int max_threads = std::thread::hardware_concurrency())
+{
+  detail::curve_sort(first, last, detail::make_grid(first, last), c,
+                     max_threads);
+}
+
+template <typename Iter>
+std::vector<size_t>
+curve_order_threaded(Iter first, Iter last,
+                     curve_type c = curve_type::hilbert,
+                     int max_threads = std::thread::hardware_concurrency())
+{
+  auto e = detail::curve_sort_keys(first, last, detail::make_grid(first, last),
+                                   c, max_threads);
+  std::vector<size_t> res(e.size());
+  for (size_t i = 0; i != e.size(); ++i) res[i] = e[i].index;
+  return res;
+}
+
+template <typename Iter>
+std::vector<size_t> curve_order(Iter first, Iter last,
+                                curve_type c = curve_type::hilbert)
+{
+  return curve_order_threaded(first, last, c, 1);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void curve_range_query(const curve_index<Iter>& index,
+                       const TupleType& lower,
+                       const TupleType& upper,
+                       OutIter outp)
+{
+  auto& g = index.m_grid;
+  std::vector<std::uint32_t> lo(g.m_ndim), hi(g.m_ndim);
+  detail::tuple_cells(g, lower, lo.data());
+  detail::tuple_cells(g, upper, hi.data());
+  detail::curve_scan(g, index.m_curve, index.m_keys, lo.data(), hi.data(),
+                     [&](size_t i){
+                       auto it = std::next(index.m_first, i);
+                       if (detail::within(*it, lower, upper)) *outp++ = *it;
+                     });
+}
+
+// Neighbors along the curve bound the search radius, which is then
+// searched as a box that shrinks as closer points are found
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void curve_nearest_neighbors(const curve_index<Iter>& index,
+                             const TupleType& value,
+                             size_t n, OutIter outp)
+{
+  auto first = index.m_first;
+  auto& keys = index.m_keys;
+  auto& g = index.m_grid;
+  n = detail::clamp_size(first, index.m_last, n);
+  if (n == 0) return;
+  detail::n_best<Iter> Q(n);
+  auto m = keys.size();
+  auto pos = static_cast<size_t>(
+    std::lower_bound(std::begin(keys), std::end(keys), index.key(value)) -
+      std::begin(keys));
+  auto a = pos < n ? 0 : pos - n, b = m - pos < n ? m : pos + n;
+  for (auto i = a; i != b; ++i)
+  {
+    auto it = std::next(first, i);
+    Q.add(detail::l2dist(*it, value), it);
+  }
+  auto r = Q.max_key();
+  std::vector<std::uint32_t> lo(g.m_ndim), hi(g.m_ndim);
+  auto f = [&](size_t j, double x){
+    if (j >= g.m_ndim) return;
+    lo[j] = g.cell(j, x - r);
+    hi[j] = g.cell(j, x + r);
+  };
+  detail::each_coord_<0>()(value, f);
+  detail::curve_scan(g, index.m_curve, keys, lo.data(), hi.data(),
+                     [&](size_t i){
+                       if (a <= i && i < b) return;
+                       auto it = std::next(first, i);
+                       Q.add(detail::l2dist(*it, value), it);
+                       if (!(Q.max_key() < r)) return;
+                       r = Q.max_key();
+                       detail::each_coord_<0>()(value, f);
+                     });
+  Q.copy_to(outp);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_nearest_neighbors_periodic(Iter first, Iter last,
+                                   const TupleType& value,
+                                   size_t n,
+                                   const TupleType& box,
+                                   OutIter outp,
+                                   bucket_size b = bucket_size())
+{
+  TupleType lower, upper;
+  utils::set_unbounded(lower, upper);
+  detail::n_best<Iter> Q(detail::clamp_size(first, last, n));
+  detail::periodic_metric<TupleType> metric(box);
+  detail::knn_metric<0>(first, last, value, metric, lower, upper, Q, b.value);
+  Q.copy_to(outp);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_range_query_periodic(Iter first, Iter last,
+                             const TupleType& lower,
+                             const TupleType& upper,
+                             const TupleType& box,
+                             OutIter outp,
+                             bucket_size b = bucket_size())
+{
+  TupleType cell_lower, cell_upper;
+  utils::set_unbounded(cell_lower, cell_upper);
+  detail::kd_range_query_periodic<0>(first, last, lower, upper, box,
+                                     cell_lower, cell_upper, outp, b.value);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_radius_query_periodic(Iter first, Iter last,
+                              const TupleType& value,
+                              double radius,
+                              const TupleType& box,
+                              OutIter outp,
+                              bucket_size b = bucket_size())
+{
+  TupleType lower, upper;
+  utils::set_unbounded(lower, upper);
+  detail::periodic_metric<TupleType> metric(box);
+  detail::kd_radius_query_metric<0>(first, last, value, radius, metric,
+                                    lower, upper, outp, b.value);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_nearest_neighbors_geo(Iter first, Iter last,
+                              const TupleType& value,
+                              size_t n, OutIter outp,
+                              bucket_size b = bucket_size())
+{
+  TupleType lower, upper;
+  utils::set_unbounded(lower, upper);
+  detail::n_best<Iter> Q(detail::clamp_size(first, last, n));
+  detail::knn_metric<0>(first, last, value, detail::geo_metric(),
+                        lower, upper, Q, b.value);
+  Q.copy_to(outp);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_radius_query_geo(Iter first, Iter last,
+                         const TupleType& value,
+                         double radius,
+                         OutIter outp,
+                         bucket_size b = bucket_size())
+{
+  TupleType lower, upper;
+  utils::set_unbounded(lower, upper);
+  detail::kd_radius_query_metric<0>(first, last, value, radius,
+                                    detail::geo_metric(),
+                                    lower, upper, outp, b.value);
+}
+
+// Writes the points of a kd-sorted range not dominated by any other,
+// preferring smaller values in every dimension
+template <typename Iter, typename OutIter>
+void kd_skyline(Iter first, Iter last, OutIter outp,
+                bucket_size b = bucket_size())
+{
+  using TupleType = typename std::remove_cv<typename std::remove_pointer<
+    detail::iter_value_t<Iter>>::type>::type;
+  TupleType corner, upper;
+  utils::set_unbounded(corner, upper);
+  std::vector<Iter> S;
+  detail::kd_skyline<0>(first, last, corner, S, b.value);
+  for (auto it : S) *outp++ = *it;
+}
+
+template <typename Iter, typename OutIter>
+void kd_skyline_threaded(Iter first, Iter last, OutIter outp,
+                         int max_threads, bucket_size b = bucket_size())
+{
+  using TupleType = typename std::remove_cv<typename std::remove_pointer<
+    detail::iter_value_t<Iter>>::type>::type;
+  TupleType corner, upper;
+  utils::set_unbounded(corner, upper);
+  std::vector<Iter> S;
+  detail::kd_skyline_threaded<0>(first, last, corner, S, b.value,
+                                 max_threads);
+  for (auto it : S) *outp++ = *it;
+}
+
+template <typename Iter, typename OutIter>
+void kd_skyline_threaded(Iter first, Iter last, OutIter outp,
+                         bucket_size b = bucket_size())
+{
+  kd_skyline_threaded(first, last, outp, std::thread::hardware_concurrency(),
+                      b);
+}
+
+using detail::dyn_rows;
+
+template <typename T>
+std::vector<size_t> kd_order(const dyn_rows<T>& x,
+                             bucket_size b = bucket_size())
+{
+  std::vector<size_t> res(x.size());
+  std::iota(begin(res), end(res), 0);
+  detail::kd_sort_dyn(begin(res), end(res), x.row(0), x.ncol(), 0, b.value);
+  return res;
+}
+
+template <typename T>
+std::vector<size_t> kd_order_threaded(const dyn_rows<T>& x,
+                                      bucket_size b = bucket_size())
+{
+  std::vector<size_t> res(x.size());
+  std::iota(begin(res), end(res), 0);
+  detail::kd_sort_threaded_dyn(begin(res), end(res), x.row(0), x.ncol(), 0,
+                               std::thread::hardware_concurrency(), 1,
+                               b.value);
+  return res;
+}
+
+template <typename T>
+void kd_sort(const dyn_rows<T>& x, bucket_size b = bucket_size())
+{
+  detail::permute_rows(x, kd_order(x, b));
+}
+
+template <typename T>
+void kd_sort_threaded(const dyn_rows<T>& x, bucket_size b = bucket_size())
+{
+  detail::permute_rows(x, kd_order_threaded(x, b));
+}
+
+template <typename T>
+std::vector<size_t> curve_order(const dyn_rows<T>& x,
+                                curve_type c = curve_type::hilbert)
+{
+  return detail::curve_order_dyn(x, c, 1);
+}
+
+template <typename T>
+std::vector<size_t>
+curve_order_threaded(const dyn_rows<T>& x,
+                     curve_type c = curve_type::hilbert,
+                     int max_threads = std::thread::hardware_concurrency())
+{
+  return detail::curve_order_dyn(x, c, max_threads);
+}
+
+template <typename T>
+void curve_sort(const dyn_rows<T>& x, curve_type c = curve_type::hilbert)
+{
+  detail::permute_rows(x, detail::curve_order_dyn(x, c, 1));
+}
+
+template <typename T>
+void curve_sort_threaded(const dyn_rows<T>& x,
+                         curve_type c = curve_type::hilbert,
+                         int max_threads = std::thread::hardware_concurrency())
+{
+  detail::permute_rows(x, detail::curve_order_dyn(x, c, max_threads));
+}
+
+template <typename T>
+void lex_sort(const dyn_rows<T>& x)
+{
+  std::vector<size_t> order(x.size());
+  std::iota(begin(order), end(order), 0);
+  std::sort(begin(order), end(order),
+            detail::row_less<T>(x.row(0), x.ncol(), 0));
+  detail::permute_rows(x, order);
+}
+
+template <typename T>
+void lex_sort_threaded(const dyn_rows<T>& x,
+                       int max_threads = std::thread::hardware_concurrency())
+{
+  if (max_threads < 2) return lex_sort(x);
+  std::vector<size_t> order(x.size()), buf(x.size());
+  std::iota(begin(order), end(order), 0);
+  detail::lex_sort_threaded(begin(order), end(order), begin(buf),
+                            detail::row_less<T>(x.row(0), x.ncol(), 0),
+                            max_threads);
+  detail::permute_rows(x, order);
+}
+
+template <typename T>
+bool kd_is_sorted(const dyn_rows<T>& x, bucket_size b = bucket_size(),
+                  size_t levels = detail::all_levels)
+{
+  return detail::kd_is_sorted_dyn(x, 0, x.size(), 0, b.value, levels);
+}
+
+template <typename T>
+bool kd_is_sorted_threaded(const dyn_rows<T>& x,
+                           bucket_size b = bucket_size(),
+                           size_t levels = detail::all_levels)
+{
+  std::atomic<bool> failed(false);
+  return detail::kd_is_sorted_threaded_dyn(x, 0, x.size(), 0, b.value, levels,
+                                           failed,
+                                           std::thread::hardware_concurrency());
+}
+
+template <typename T>
+size_t kd_lower_bound(const dyn_rows<T>& x, const T* value,
+                      bucket_size b = bucket_size())
+{
+  return detail::kd_lower_bound_dyn(x, 0, x.size(), value, 0, b.value);
+}
+
+template <typename T>
+size_t kd_upper_bound(const dyn_rows<T>& x, const T* value,
+                      bucket_size b = bucket_size())
+{
+  return detail::kd_upper_bound_dyn(x, 0, x.size(), value, 0, b.value);
+}
+
+template <typename T>
+bool kd_binary_search(const dyn_rows<T>& x, const T* value,
+                      bucket_size b = bucket_size())
+{
+  auto i = kd_lower_bound(x, value, b);
+  return i != x.size() && detail::row_none_less(value, x.row(i), x.ncol());
+}
+
+template <typename T>
+size_t kd_nearest_neighbor(const dyn_rows<T>& x, const T* value,
+                           bucket_size b = bucket_size())
+{
+  return detail::kd_nearest_neighbor_dyn(x, 0, x.size(), value, 0, b.value);
+}
+
+template <typename T, typename OutIter>
+void kd_range_query(const dyn_rows<T>& x,
+                    const T* lower, const T* upper,
+                    OutIter outp, bucket_size b = bucket_size())
+{
+  detail::kd_range_query_dyn(x, 0, x.size(), lower, upper, 0, outp, b.value);
+}
+
+template <typename T, typename OutIter>
+void kd_radius_query(const dyn_rows<T>& x,
+                     const T* value, double radius,
+                     OutIter outp, bucket_size b = bucket_size())
+{
+  detail::kd_radius_query_dyn(x, 0, x.size(), value, radius, 0, outp,
+                              b.value);
+}
+
+template <typename T, typename OutIter>
+void kd_polytope_query(const dyn_rows<T>& x,
+                       const double* a, const double* b, size_t m,
+                       OutIter outp, bucket_size bkt = bucket_size())
+{
+  auto emit = [&](size_t i){ *outp++ = i; };
+  detail::kd_polytope_query(x, nullptr, a, b, m, emit, bkt.value);
+}
+
+template <typename T>
+kd_summary_tree kd_summarize(const dyn_rows<T>& x, const double* weights,
+                             bucket_size b = bucket_size())
+{
+  return detail::kd_summarize(x, weights, b.value);
+}
+
+template <typename T>
+kd_summary kd_range_summary(const dyn_rows<T>& x, const double* weights,
+                            const kd_summary_tree& tree,
+                            const T* lower, const T* upper)
+{
+  return detail::kd_range_summary(x, weights, tree, lower, upper);
+}
+
+template <typename T, typename OutIter>
+void kd_density(const dyn_rows<T>& x, const dyn_rows<T>& q,
+                double bandwidth, OutIter outp,
+                kernel_type kernel = kernel_type::gaussian,
+                double rel_err = 0)
+{
+  std::vector<double> res(q.size());
+  detail::kd_density(x, q, res.data(), bandwidth, kernel, rel_err, 1);
+  std::copy(res.begin(), res.end(), outp);
+}
+
+template <typename T, typename OutIter>
+void kd_density_threaded(const dyn_rows<T>& x, const dyn_rows<T>& q,
+                         double bandwidth, OutIter outp,
+                         kernel_type kernel = kernel_type::gaussian,
+                         double rel_err = 0,
+                         int max_threads = std::thread::hardware_concurrency())
+{
+  std::vector<double> res(q.size());
+  detail::kd_density(x, q, res.data(), bandwidth, kernel, rel_err,
+                     max_threads);
+  std::copy(res.begin(), res.end(), outp);
+}
+
+template <typename T, typename OutIter>
+void kd_dbscan(const dyn_rows<T>& x, double eps, size_t min_pts,
+               OutIter outp, bucket_size b = bucket_size())
+{
+  auto res = detail::kd_dbscan(x, eps, min_pts, b.value, 1);
+  std::copy(res.begin(), res.end(), outp);
+}
+
+template <typename T, typename OutIter>
+void kd_dbscan_threaded(const dyn_rows<T>& x, double eps, size_t min_pts,
+                        OutIter outp, bucket_size b = bucket_size())
+{
+  auto res = detail::kd_dbscan(x, eps, min_pts, b.value,
+                               std::thread::hardware_concurrency());
+  std::copy(res.begin(), res.end(), outp);
+}
+
+template <typename T, typename OutIter>
+void kd_dbscan_threaded(const dyn_rows<T>& x, double eps, size_t min_pts,
+                        OutIter outp, int max_threads,
+                        bucket_size b = bucket_size())
+{
+  auto res = detail::kd_dbscan(x, eps, min_pts, b.value, max_threads);
+  std::copy(res.begin(), res.end(), outp);
+}
+
+template <typename T>
+kd_kmeans_result kd_kmeans(const dyn_rows<T>& x, const double* centers,
+                           size_t k, size_t max_iter = 10)
+{
+  return detail::kd_kmeans(x, centers, k, max_iter, 1);
+}
+
+template <typename T>
+kd_kmeans_result kd_kmeans_threaded(const dyn_rows<T>& x,
+                                    const double* centers, size_t k,
+                                    size_t max_iter = 10,
+                                    int max_threads =
+                                      std::thread::hardware_concurrency())
+{
+  return detail::kd_kmeans(x, centers, k, max_iter, max_threads);
+}
+
+template <typename T, typename OutIter>
+void kd_skyline(const dyn_rows<T>& x, OutIter outp,
+                bucket_size b = bucket_size())
+{
+  using U = typename std::remove_const<T>::type;
+  std::vector<U> corner(x.ncol(), detail::lowest_value<U>());
+  std::vector<size_t> S;
+  detail::kd_skyline_dyn(x, 0, x.size(), 0, corner.data(), S, b.value);
+  std::copy(begin(S), end(S), outp);
+}
+
+template <typename T, typename OutIter>
+void kd_skyline_threaded(const dyn_rows<T>& x, OutIter outp, int max_threads,
+                         bucket_size b = bucket_size())
+{
+  using U = typename std::remove_const<T>::type;
+  std::vector<U> corner(x.ncol(), detail::lowest_value<U>());
+  std::vector<size_t> S;
+  detail::kd_skyline_threaded_dyn(x, 0, x.size(), 0, corner, S, b.value,
+                                  max_threads);
+  std::copy(begin(S), end(S), outp);
+}
+
+template <typename T, typename OutIter>
+void kd_skyline_threaded(const dyn_rows<T>& x, OutIter outp,
+                         bucket_size b = bucket_size())
+{
+  kd_skyline_threaded(x, outp, std::thread::hardware_concurrency(), b);
+}
+
+template <typename T, typename OutIter>
+void kd_nearest_neighbors(const dyn_rows<T>& x,
+                          const T* value, size_t n,
+                          OutIter outp, bucket_size b = bucket_size())
+{
+  detail::n_best<size_t> Q(n < x.size() ? n : x.size());
+  detail::knn_dyn(x, 0, x.size(), value, 0, Q, b.value);
+  Q.copy_iters_to(outp);
+}
+
+// Adaptive layouts record the split axis of each partition, one byte per
+// element; pass the returned axes to the matching _adaptive queries. Tuples
+// are indexed with operator[] and may have at most 256 dimensions.
+
+template <typename Iter>
+std::vector<std::uint8_t> kd_sort_adaptive(Iter first, Iter last,
+                                           bucket_size b = bucket_size())
+{
+  using T = detail::iter_value_t<Iter>;
+  static_assert(ndim<T>::value <= 256, "too many dimensions");
+  std::vector<std::uint8_t> axes(std::distance(first, last));
+  detail::kd_sort_adaptive(first, last,
+                           [](const T& x) -> const T& { return x; },
+                           ndim<T>::value, axes.data(), 1, 1, b.value);
+  return axes;
+}
+
+template <typename Iter>
+std::vector<std::uint8_t>
+kd_sort_adaptive_threaded(Iter first, Iter last, bucket_size b = bucket_size())
+{
+  using T = detail::iter_value_t<Iter>;
+  static_assert(ndim<T>::value <= 256, "too many dimensions");
+  std::vector<std::uint8_t> axes(std::distance(first, last));
+  detail::kd_sort_adaptive(first, last,
+                           [](const T& x) -> const T& { return x; },
+                           ndim<T>::value, axes.data(),
+                           std::thread::hardware_concurrency(), 1, b.value);
+  return axes;
+}
+
+template <typename Iter>
+bool kd_is_sorted_adaptive(Iter first, Iter last,
+                           const std::uint8_t* axes,
+                           bucket_size b = bucket_size(),
+                           size_t levels = detail::all_levels)
+{
+  detail::iter_rows<Iter> x(first, last);
+  return detail::kd_is_sorted_adaptive(x, axes, 0, x.size(), b.value, levels);
+}
+
+template <typename Iter>
+bool kd_is_sorted_adaptive_threaded(Iter first, Iter last,
+                                    const std::uint8_t* axes,
+                                    bucket_size b = bucket_size(),
+                                    size_t levels = detail::all_levels)
+{
+  detail::iter_rows<Iter> x(first, last);
+  std::atomic<bool> failed(false);
+  return detail::kd_is_sorted_adaptive_threaded(
+    x, axes, 0, x.size(), b.value, levels, failed,
+    std::thread::hardware_concurrency());
+}
+
+template <typename Iter, typename TupleType>
+bool kd_binary_search_adaptive(Iter first, Iter last,
+                               const std::uint8_t* axes,
+                               const TupleType& value,
+                               bucket_size b = bucket_size())
+{
+  detail::iter_rows<Iter> x(first, last);
+  return detail::kd_binary_search_adaptive(x, axes, 0, x.size(),
+                                           value, b.value);
+}
+
+template <typename Iter, typename TupleType>
+Iter kd_nearest_neighbor_adaptive(Iter first, Iter last,
+                                  const std::uint8_t* axes,
+                                  const TupleType& value,
+                                  bucket_size b = bucket_size())
+{
+  detail::iter_rows<Iter> x(first, last);
+  detail::n_best<size_t> Q(x.size() == 0 ? 0 : 1);
+  detail::knn_adaptive(x, axes, 0, x.size(), value, Q, b.value);
+  auto i = x.size();
+  Q.copy_iters_to(&i);
+  return std::next(first, i);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_nearest_neighbors_adaptive(Iter first, Iter last,
+                                   const std::uint8_t* axes,
+                                   const TupleType& value,
+                                   size_t n, OutIter outp,
+                                   bucket_size b = bucket_size())
+{
+  detail::iter_rows<Iter> x(first, last);
+  detail::n_best<size_t> Q(n < x.size() ? n : x.size());
+  detail::knn_adaptive(x, axes, 0, x.size(), value, Q, b.value);
+  Q.drain_to(outp, [&](size_t i){ return first[i]; });
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_range_query_adaptive(Iter first, Iter last,
+                             const std::uint8_t* axes,
+                             const TupleType& lower,
+                             const TupleType& upper,
+                             OutIter outp, bucket_size b = bucket_size())
+{
+  detail::iter_rows<Iter> x(first, last);
+  auto emit = [&](size_t i){ *outp++ = first[i]; };
+  detail::kd_range_query_adaptive(x, axes, 0, x.size(),
+                                  lower, upper, emit, b.value);
+}
+
+template <typename Iter,
+          typename TupleType,
+          typename OutIter>
+void kd_radius_query_adaptive(Iter first, Iter last,
+                              const std::uint8_t* axes,
+                              const TupleType& value,
+                              double radius,
+                              OutIter outp, bucket_size b = bucket_size())
+{
+  detail::iter_rows<Iter> x(first, last);
+  auto emit = [&](size_t i){ *outp++ = first[i]; };
+  detail::kd_radius_query_adaptive(x, axes, 0, x.size(),
+                                   value, radius, emit, b.value);
+}
+
+template <typename Iter, typename OutIter>
+void kd_polytope_query_adaptive(Iter first, Iter last,
+                                const std::uint8_t* axes,
+                                const double* a, const double* b, size_t m,
+                                OutIter outp, bucket_size bkt = bucket_size())
+{
+  detail::iter_rows<Iter> x(first, last);
+  auto emit = [&](size_t i){ *outp++ = first[i]; };
+  detail::kd_polytope_query(x, axes, a, b, m, emit, bkt.value);
+}
+
+template <typename T>
+std::vector<std::uint8_t> kd_sort_adaptive(const dyn_rows<T>& x,
+                                           bucket_size b = bucket_size())
+{
+  std::vector<size_t> order(x.size());
+  std::iota(begin(order), end(order), 0);
+  std::vector<std::uint8_t> axes(x.size());
+  detail::kd_sort_adaptive(begin(order), end(order),
+                           [&](size_t i){ return x.row(i); },
+                           x.ncol(), axes.data(), 1, 1, b.value);
+  detail::permute_rows(x, order);
+  return axes;
+}
+
+template <typename T>
+std::vector<std::uint8_t>
+kd_sort_adaptive_threaded(const dyn_rows<T>& x, bucket_size b = bucket_size())
+{
+  std::vector<size_t> order(x.size());
+  std::iota(begin(order), end(order), 0);
+  std::vector<std::uint8_t> axes(x.size());
+  detail::kd_sort_adaptive(begin(order), end(order),
+                           [&](size_t i){ return x.row(i); },
+                           x.ncol(), axes.data(),
+                           std::thread::hardware_concurrency(), 1, b.value);
+  detail::permute_rows(x, order);
+  return axes;
+}
+
+template <typename T>
+bool kd_is_sorted_adaptive(const dyn_rows<T>& x,
+                           const std::uint8_t* axes,
+                           bucket_size b = bucket_size(),
+                           size_t levels = detail::all_levels)
+{
+  return detail::kd_is_sorted_adaptive(x, axes, 0, x.size(), b.value, levels);
+}
+
+template <typename T>
+bool kd_is_sorted_adaptive_threaded(const dyn_rows<T>& x,
+                                    const std::uint8_t* axes,
+                                    bucket_size b = bucket_size(),
+                                    size_t levels = detail::all_levels)
+{
+  std::atomic<bool> failed(false);
+  return detail::kd_is_sorted_adaptive_threaded(
+    x, axes, 0, x.size(), b.value, levels, failed,
+    std::thread::hardware_concurrency());
+}
+
+template <typename T>
+bool kd_binary_search_adaptive(const dyn_rows<T>& x,
+                               const std::uint8_t* axes,
+                               const T* value,
+                               bucket_size b = bucket_size())
+{
+  return detail::kd_binary_search_adaptive(x, axes, 0, x.size(),
+                                           value, b.value);
+}
+
+template <typename T>
+size_t kd_nearest_neighbor_adaptive(const dyn_rows<T>& x,
+                                    const std::uint8_t* axes,
+                                    const T* value,
+                                    bucket_size b = bucket_size())
+{
+  detail::n_best<size_t> Q(x.size() == 0 ? 0 : 1);
+  detail::knn_adaptive(x, axes, 0, x.size(), value, Q, b.value);
+  auto i = x.size();
+  Q.copy_iters_to(&i);
+  return i;
+}
+
+template <typename T, typename OutIter>
+void kd_nearest_neighbors_adaptive(const dyn_rows<T>& x,
+                                   const std::uint8_t* axes,
+                                   const T* value, size_t n,
+                                   OutIter outp, bucket_size b = bucket_size())
+{
+  detail::n_best<size_t> Q(n < x.size() ? n : x.size());
+  detail::knn_adaptive(x, axes, 0, x.size(), value, Q, b.value);
+  Q.copy_iters_to(outp);
+}
+
+template <typename T, typename OutIter>
+void kd_range_query_adaptive(const dyn_rows<T>& x,
+                             const std::uint8_t* axes,
+                             const T* lower, const T* upper,
+                             OutIter outp, bucket_size b = bucket_size())
+{
+  auto emit = [&](size_t i){ *outp++ = i; };
+  detail::kd_range_query_adaptive(x, axes, 0, x.size(),
+                                  lower, upper, emit, b.value);
+}
+
+template <typename T, typename OutIter>
+void kd_radius_query_adaptive(const dyn_rows<T>& x,
+                              const std::uint8_t* axes,
+                              const T* value, double radius,
+                              OutIter outp, bucket_size b = bucket_size())
+{
+  auto emit = [&](size_t i){ *outp++ = i; };
+  detail::kd_radius_query_adaptive(x, axes, 0, x.size(),
+                                   value, radius, emit, b.value);
+}
+
+template <typename T, typename OutIter>
+void kd_polytope_query_adaptive(const dyn_rows<T>& x,
+                                const std::uint8_t* axes,
+                                const double* a, const double* b, size_t m,
+                                OutIter outp, bucket_size bkt = bucket_size())
+{
+  auto emit = [&](size_t i){ *outp++ = i; };
+  detail::kd_polytope_query(x, axes, a, b, m, emit, bkt.value);
+}
+
+constexpr bool kd_stats_enabled()
+{
+#ifdef KDTOOLS_ENABLE_STATS
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Counters accumulated by the calling thread since its last flush
+inline kd_stats kd_stats_local()
+{
+#ifdef KDTOOLS_ENABLE_STATS
+  return detail::local_stats();
+#else
+  return kd_stats();
+#endif
+}
+
+// Moves the calling thread's counters into the cumulative total and
+// returns them; bracket a query with two flushes to get its counts
+inline kd_stats kd_stats_flush()
+{
+#ifdef KDTOOLS_ENABLE_STATS
+  auto& s = detail::local_stats();
+  auto res = s;
+  detail::global_stats().merge(s);
+  s = kd_stats();
+  return res;
+#else
+  return kd_stats();
+#endif
+}
+
+// Cumulative counters from exited threads, previous flushes and the
+// calling thread
+inline kd_stats kd_stats_total()
+{
+#ifdef KDTOOLS_ENABLE_STATS
+  auto res = detail::global_stats().total();
+  res += detail::local_stats();
+  return res;
+#else
+  return kd_stats();
+#endif
+}
+
+inline void kd_stats_reset()
+{
+#ifdef KDTOOLS_ENABLE_STATS
+  detail::local_stats() = kd_stats();
+  detail::global_stats().reset();
+#endif
 }
 
 } // namespace kdtools
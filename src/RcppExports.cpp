@@ -42,38 +42,43 @@ BEGIN_RCPP
 END_RCPP
 }
 // kd_sort_
-List kd_sort_(List x, bool inplace, bool parallel);
-RcppExport SEXP _kdtools_kd_sort_(SEXP xSEXP, SEXP inplaceSEXP, SEXP parallelSEXP) {
+List kd_sort_(List x, bool inplace, bool parallel, int bucket_size, bool adaptive);
+RcppExport SEXP _kdtools_kd_sort_(SEXP xSEXP, SEXP inplaceSEXP, SEXP parallelSEXP, SEXP bucket_sizeSEXP, SEXP adaptiveSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< List >::type x(xSEXP);
     Rcpp::traits::input_parameter< bool >::type inplace(inplaceSEXP);
     Rcpp::traits::input_parameter< bool >::type parallel(parallelSEXP);
-    rcpp_result_gen = Rcpp::wrap(kd_sort_(x, inplace, parallel));
+    Rcpp::traits::input_parameter< int >::type bucket_size(bucket_sizeSEXP);
+    Rcpp::traits::input_parameter< bool >::type adaptive(adaptiveSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_sort_(x, inplace, parallel, bucket_size, adaptive));
     return rcpp_result_gen;
 END_RCPP
 }
 // kd_is_sorted_
-bool kd_is_sorted_(List x);
-RcppExport SEXP _kdtools_kd_is_sorted_(SEXP xSEXP) {
+bool kd_is_sorted_(List x, bool parallel, double levels);
+RcppExport SEXP _kdtools_kd_is_sorted_(SEXP xSEXP, SEXP parallelSEXP, SEXP levelsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< List >::type x(xSEXP);
-    rcpp_result_gen = Rcpp::wrap(kd_is_sorted_(x));
+    Rcpp::traits::input_parameter< bool >::type parallel(parallelSEXP);
+    Rcpp::traits::input_parameter< double >::type levels(levelsSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_is_sorted_(x, parallel, levels));
     return rcpp_result_gen;
 END_RCPP
 }
 // lex_sort_
-List lex_sort_(List x, bool inplace);
-RcppExport SEXP _kdtools_lex_sort_(SEXP xSEXP, SEXP inplaceSEXP) {
+List lex_sort_(List x, bool inplace, bool parallel);
+RcppExport SEXP _kdtools_lex_sort_(SEXP xSEXP, SEXP inplaceSEXP, SEXP parallelSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< List >::type x(xSEXP);
     Rcpp::traits::input_parameter< bool >::type inplace(inplaceSEXP);
-    rcpp_result_gen = Rcpp::wrap(lex_sort_(x, inplace));
+    Rcpp::traits::input_parameter< bool >::type parallel(parallelSEXP);
+    rcpp_result_gen = Rcpp::wrap(lex_sort_(x, inplace, parallel));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -163,14 +168,226 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// kd_radius_query_
+List kd_radius_query_(List x, NumericVector value, double radius);
+RcppExport SEXP _kdtools_kd_radius_query_(SEXP xSEXP, SEXP valueSEXP, SEXP radiusSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type value(valueSEXP);
+    Rcpp::traits::input_parameter< double >::type radius(radiusSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_radius_query_(x, value, radius));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_polytope_query_
+List kd_polytope_query_(List x, NumericMatrix A, NumericVector b);
+RcppExport SEXP _kdtools_kd_polytope_query_(SEXP xSEXP, SEXP ASEXP, SEXP bSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type A(ASEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type b(bSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_polytope_query_(x, A, b));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_summarize_
+SEXP kd_summarize_(List x, NumericVector w);
+RcppExport SEXP _kdtools_kd_summarize_(SEXP xSEXP, SEXP wSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type w(wSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_summarize_(x, w));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_range_summary_
+NumericVector kd_range_summary_(List x, NumericVector w, SEXP tree, NumericVector lower, NumericVector upper);
+RcppExport SEXP _kdtools_kd_range_summary_(SEXP xSEXP, SEXP wSEXP, SEXP treeSEXP, SEXP lowerSEXP, SEXP upperSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type w(wSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type tree(treeSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type lower(lowerSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type upper(upperSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_range_summary_(x, w, tree, lower, upper));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_density_
+NumericVector kd_density_(List x, List at, double bandwidth, bool gaussian, double rel_err, bool parallel);
+RcppExport SEXP _kdtools_kd_density_(SEXP xSEXP, SEXP atSEXP, SEXP bandwidthSEXP, SEXP gaussianSEXP, SEXP rel_errSEXP, SEXP parallelSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< List >::type at(atSEXP);
+    Rcpp::traits::input_parameter< double >::type bandwidth(bandwidthSEXP);
+    Rcpp::traits::input_parameter< bool >::type gaussian(gaussianSEXP);
+    Rcpp::traits::input_parameter< double >::type rel_err(rel_errSEXP);
+    Rcpp::traits::input_parameter< bool >::type parallel(parallelSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_density_(x, at, bandwidth, gaussian, rel_err, parallel));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_dbscan_
+IntegerVector kd_dbscan_(List x, double eps, int min_pts, bool parallel);
+RcppExport SEXP _kdtools_kd_dbscan_(SEXP xSEXP, SEXP epsSEXP, SEXP min_ptsSEXP, SEXP parallelSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< double >::type eps(epsSEXP);
+    Rcpp::traits::input_parameter< int >::type min_pts(min_ptsSEXP);
+    Rcpp::traits::input_parameter< bool >::type parallel(parallelSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_dbscan_(x, eps, min_pts, parallel));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_kmeans_
+List kd_kmeans_(List x, NumericMatrix centers, int iter_max, bool parallel);
+RcppExport SEXP _kdtools_kd_kmeans_(SEXP xSEXP, SEXP centersSEXP, SEXP iter_maxSEXP, SEXP parallelSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericMatrix >::type centers(centersSEXP);
+    Rcpp::traits::input_parameter< int >::type iter_max(iter_maxSEXP);
+    Rcpp::traits::input_parameter< bool >::type parallel(parallelSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_kmeans_(x, centers, iter_max, parallel));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_nearest_neighbors_periodic_
+List kd_nearest_neighbors_periodic_(List x, NumericVector value, int n, NumericVector box);
+RcppExport SEXP _kdtools_kd_nearest_neighbors_periodic_(SEXP xSEXP, SEXP valueSEXP, SEXP nSEXP, SEXP boxSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type value(valueSEXP);
+    Rcpp::traits::input_parameter< int >::type n(nSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type box(boxSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_nearest_neighbors_periodic_(x, value, n, box));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_range_query_periodic_
+List kd_range_query_periodic_(List x, NumericVector lower, NumericVector upper, NumericVector box);
+RcppExport SEXP _kdtools_kd_range_query_periodic_(SEXP xSEXP, SEXP lowerSEXP, SEXP upperSEXP, SEXP boxSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type lower(lowerSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type upper(upperSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type box(boxSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_range_query_periodic_(x, lower, upper, box));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_radius_query_periodic_
+List kd_radius_query_periodic_(List x, NumericVector value, double radius, NumericVector box);
+RcppExport SEXP _kdtools_kd_radius_query_periodic_(SEXP xSEXP, SEXP valueSEXP, SEXP radiusSEXP, SEXP boxSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type value(valueSEXP);
+    Rcpp::traits::input_parameter< double >::type radius(radiusSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type box(boxSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_radius_query_periodic_(x, value, radius, box));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_nearest_neighbors_geo_
+List kd_nearest_neighbors_geo_(List x, NumericVector value, int n);
+RcppExport SEXP _kdtools_kd_nearest_neighbors_geo_(SEXP xSEXP, SEXP valueSEXP, SEXP nSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type value(valueSEXP);
+    Rcpp::traits::input_parameter< int >::type n(nSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_nearest_neighbors_geo_(x, value, n));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_radius_query_geo_
+List kd_radius_query_geo_(List x, NumericVector value, double radius);
+RcppExport SEXP _kdtools_kd_radius_query_geo_(SEXP xSEXP, SEXP valueSEXP, SEXP radiusSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type value(valueSEXP);
+    Rcpp::traits::input_parameter< double >::type radius(radiusSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_radius_query_geo_(x, value, radius));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_skyline_
+List kd_skyline_(List x, bool parallel, int max_threads);
+RcppExport SEXP _kdtools_kd_skyline_(SEXP xSEXP, SEXP parallelSEXP, SEXP max_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< bool >::type parallel(parallelSEXP);
+    Rcpp::traits::input_parameter< int >::type max_threads(max_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_skyline_(x, parallel, max_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// curve_order_
+IntegerVector curve_order_(List x, bool hilbert, bool parallel);
+RcppExport SEXP _kdtools_curve_order_(SEXP xSEXP, SEXP hilbertSEXP, SEXP parallelSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< List >::type x(xSEXP);
+    Rcpp::traits::input_parameter< bool >::type hilbert(hilbertSEXP);
+    Rcpp::traits::input_parameter< bool >::type parallel(parallelSEXP);
+    rcpp_result_gen = Rcpp::wrap(curve_order_(x, hilbert, parallel));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_stats
+NumericVector kd_stats(bool reset);
+RcppExport SEXP _kdtools_kd_stats(SEXP resetSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< bool >::type reset(resetSEXP);
+    rcpp_result_gen = Rcpp::wrap(kd_stats(reset));
+    return rcpp_result_gen;
+END_RCPP
+}
+// kd_stats_enabled
+bool kd_stats_enabled();
+RcppExport SEXP _kdtools_kd_stats_enabled() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(kd_stats_enabled());
+    return rcpp_result_gen;
+END_RCPP
+}
 
 static const R_CallMethodDef CallEntries[] = {
     {"_kdtools_matrix_to_tuples", (DL_FUNC) &_kdtools_matrix_to_tuples, 1},
     {"_kdtools_tuples_to_matrix", (DL_FUNC) &_kdtools_tuples_to_matrix, 1},
     {"_kdtools_tuples_to_matrix_rows", (DL_FUNC) &_kdtools_tuples_to_matrix_rows, 3},
-    {"_kdtools_kd_sort_", (DL_FUNC) &_kdtools_kd_sort_, 3},
-    {"_kdtools_kd_is_sorted_", (DL_FUNC) &_kdtools_kd_is_sorted_, 1},
-    {"_kdtools_lex_sort_", (DL_FUNC) &_kdtools_lex_sort_, 2},
+    {"_kdtools_kd_sort_", (DL_FUNC) &_kdtools_kd_sort_, 5},
+    {"_kdtools_kd_is_sorted_", (DL_FUNC) &_kdtools_kd_is_sorted_, 3},
+    {"_kdtools_lex_sort_", (DL_FUNC) &_kdtools_lex_sort_, 3},
     {"_kdtools_kd_lower_bound_", (DL_FUNC) &_kdtools_kd_lower_bound_, 2},
     {"_kdtools_kd_upper_bound_", (DL_FUNC) &_kdtools_kd_upper_bound_, 2},
     {"_kdtools_kd_range_query_", (DL_FUNC) &_kdtools_kd_range_query_, 3},
@@ -178,6 +395,22 @@ static const R_CallMethodDef CallEntries[] = {
     {"_kdtools_kd_binary_search_", (DL_FUNC) &_kdtools_kd_binary_search_, 2},
     {"_kdtools_kd_nearest_neighbors_", (DL_FUNC) &_kdtools_kd_nearest_neighbors_, 3},
     {"_kdtools_kd_order_", (DL_FUNC) &_kdtools_kd_order_, 2},
+    {"_kdtools_kd_radius_query_", (DL_FUNC) &_kdtools_kd_radius_query_, 3},
+    {"_kdtools_kd_polytope_query_", (DL_FUNC) &_kdtools_kd_polytope_query_, 3},
+    {"_kdtools_kd_summarize_", (DL_FUNC) &_kdtools_kd_summarize_, 2},
+    {"_kdtools_kd_range_summary_", (DL_FUNC) &_kdtools_kd_range_summary_, 5},
+    {"_kdtools_kd_density_", (DL_FUNC) &_kdtools_kd_density_, 6},
+    {"_kdtools_kd_dbscan_", (DL_FUNC) &_kdtools_kd_dbscan_, 4},
+    {"_kdtools_kd_kmeans_", (DL_FUNC) &_kdtools_kd_kmeans_, 4},
+    {"_kdtools_kd_nearest_neighbors_periodic_", (DL_FUNC) &_kdtools_kd_nearest_neighbors_periodic_, 4},
+    {"_kdtools_kd_range_query_periodic_", (DL_FUNC) &_kdtools_kd_range_query_periodic_, 4},
+    {"_kdtools_kd_radius_query_periodic_", (DL_FUNC) &_kdtools_kd_radius_query_periodic_, 4},
+    {"_kdtools_kd_nearest_neighbors_geo_", (DL_FUNC) &_kdtools_kd_nearest_neighbors_geo_, 3},
+    {"_kdtools_kd_radius_query_geo_", (DL_FUNC) &_kdtools_kd_radius_query_geo_, 3},
+    {"_kdtools_kd_skyline_", (DL_FUNC) &_kdtools_kd_skyline_, 3},
+    {"_kdtools_curve_order_", (DL_FUNC) &_kdtools_curve_order_, 3},
+    {"_kdtools_kd_stats", (DL_FUNC) &_kdtools_kd_stats, 1},
+    {"_kdtools_kd_stats_enabled", (DL_FUNC) &_kdtools_kd_stats_enabled, 0},
     {NULL, NULL, 0}
 };
 
@@ -21,6 +21,7 @@
 // [[Rcpp::export]]
 List matrix_to_tuples(const NumericMatrix& x)
 {
+  if (x.ncol() < 1) stop("Invalid dimensions");
   switch(x.ncol())
   {
   case 1: return matrix_to_tuples_<1>(x);
@@ -32,7 +33,7 @@ List matrix_to_tuples(const NumericMatrix& x)
   case 7: return matrix_to_tuples_<7>(x);
   case 8: return matrix_to_tuples_<8>(x);
   case 9: return matrix_to_tuples_<9>(x);
-  default: stop("Invalid dimensions");
+  default: return matrix_to_tuples_dyn(x);
   }
 }
 
@@ -54,7 +55,7 @@ NumericMatrix tuples_to_matrix(List x)
   case 7: return tuples_to_matrix_<7>(x);
   case 8: return tuples_to_matrix_<8>(x);
   case 9: return tuples_to_matrix_<9>(x);
-  default: stop("Invalid dimensions");
+  default: return tuples_to_matrix_dyn(x, arrayvec_dim(x));
   }
 }
 
@@ -74,6 +75,6 @@ NumericMatrix tuples_to_matrix_rows(List x, int a, int b)
   case 7: return tuples_to_matrix_<7>(x, a, b);
   case 8: return tuples_to_matrix_<8>(x, a, b);
   case 9: return tuples_to_matrix_<9>(x, a, b);
-  default: stop("Invalid dimensions");
+  default: return tuples_to_matrix_dyn(x, arrayvec_dim(x), a, b);
   }
 }
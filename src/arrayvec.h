@@ -5,6 +5,7 @@
 using Rcpp::NumericVector;
 using Rcpp::IntegerVector;
 using Rcpp::NumericMatrix;
+using Rcpp::RawVector;
 using Rcpp::stop;
 using Rcpp::XPtr;
 using Rcpp::List;
@@ -24,14 +25,70 @@ using std::vector;
 #include <string>
 using std::string;
 
+#include <thread>
+using std::thread;
+
 #include <iterator>
 using std::back_inserter;
 using std::distance;
 using std::begin;
 using std::end;
 
-#include <strider.h>
-using strider::make_strided;
+// Transposes rows [first, last) between a column-major matrix with leading
+// dimension ld and packed rows of nc values. Work proceeds in tiles of up
+// to 128 rows by 16 columns so that only a few column streams are live at
+// once, which matters for wide runtime-dimension data.
+const size_t tile_rows = 128, tile_cols = 16;
+
+inline
+void cols_to_rows(const double* cols, size_t ld, double* rows, size_t nc,
+                  size_t first, size_t last)
+{
+  for (auto r = first; r < last; r += tile_rows)
+  {
+    auto re = std::min(last, r + tile_rows);
+    for (size_t c = 0; c < nc; c += tile_cols)
+    {
+      auto ce = std::min(nc, c + tile_cols);
+      for (auto i = r; i != re; ++i)
+        for (auto j = c; j != ce; ++j)
+          rows[i * nc + j] = cols[j * ld + i];
+    }
+  }
+}
+
+inline
+void rows_to_cols(const double* rows, double* cols, size_t ld, size_t nc,
+                  size_t first, size_t last)
+{
+  for (auto r = first; r < last; r += tile_rows)
+  {
+    auto re = std::min(last, r + tile_rows);
+    for (size_t c = 0; c < nc; c += tile_cols)
+    {
+      auto ce = std::min(nc, c + tile_cols);
+      for (auto i = r; i != re; ++i)
+        for (auto j = c; j != ce; ++j)
+          cols[j * ld + i] = rows[i * nc + j];
+    }
+  }
+}
+
+// Splits nr rows into contiguous chunks, one per hardware thread, when
+// there are enough of them to be worth it
+template <typename Fun>
+void for_row_chunks(size_t nr, Fun f)
+{
+  const size_t min_rows = 1 << 16;
+  size_t nt = std::min<size_t>(thread::hardware_concurrency(), nr / min_rows);
+  if (nt < 2) return f(0, nr);
+  vector<thread> workers;
+  auto chunk = (nr + nt - 1) / nt;
+  for (size_t a = chunk; a < nr; a += chunk)
+    workers.emplace_back(f, a, std::min(nr, a + chunk));
+  f(0, chunk);
+  for (auto& t : workers) t.join();
+}
 
 template <size_t I>
 using vec_type = array<double, I>;
@@ -46,32 +103,74 @@ XPtr<T> make_xptr(T* x)
 }
 
 template <size_t I>
-List wrap_ptr(const XPtr<arrayvec<I>>& q)
+List wrap_ptr(const XPtr<arrayvec<I>>& q, int bucket = 1,
+              RawVector axes = RawVector())
 {
   List res;
   res["xptr"] = wrap(q);
   res["nrow"] = q->size();
   res["ncol"] = I;
+  res["bucket_size"] = bucket;
+  res["split_axes"] = axes;
   res.attr("class") = "arrayvec";
   return res;
 }
 
+inline
+int arrayvec_bucket(const List& x)
+{
+  return x.containsElementNamed("bucket_size") ?
+    as<int>(x["bucket_size"]) : 1;
+}
+
+inline
+bool arrayvec_adaptive(const List& x)
+{
+  return x.containsElementNamed("split_axes") &&
+    Rf_length(x["split_axes"]) > 0;
+}
+
+inline
+int matrix_bucket(const NumericMatrix& x)
+{
+  return x.hasAttribute("bucket_size") ? as<int>(x.attr("bucket_size")) : 1;
+}
+
+inline
+RawVector matrix_axes(const NumericMatrix& x)
+{
+  return x.hasAttribute("split_axes") ?
+    as<RawVector>(x.attr("split_axes")) : RawVector();
+}
+
+inline
+void set_matrix_layout(NumericMatrix& res, const List& x)
+{
+  auto bucket = arrayvec_bucket(x);
+  if (bucket > 1) res.attr("bucket_size") = bucket;
+  if (arrayvec_adaptive(x))
+    res.attr("split_axes") = as<RawVector>(x["split_axes"]);
+}
+
+template <size_t I>
+double* row_data(arrayvec<I>& x)
+{
+  static_assert(sizeof(vec_type<I>) == I * sizeof(double),
+                "arrayvec rows must be packed");
+  return x.empty() ? nullptr : x.front().data();
+}
+
 template <size_t I>
 List matrix_to_tuples_(const NumericMatrix& x)
 {
-  auto nr = x.nrow();
-  auto p = make_xptr(new arrayvec<I>);
-  p->reserve(nr);
-  auto oi = back_inserter(*p);
-  transform(begin(x), begin(x) + nr, oi,
-            [&](const double& v)
-            {
-              vec_type<I> a;
-              auto i = make_strided(&v, nr);
-              copy(i, i + I, begin(a));
-              return a;
-            });
-  return wrap_ptr(p);
+  size_t nr = x.nrow();
+  auto p = make_xptr(new arrayvec<I>(nr));
+  auto cols = begin(x);
+  auto rows = row_data(*p);
+  for_row_chunks(nr, [=](size_t a, size_t b) {
+    cols_to_rows(cols, nr, rows, I, a, b);
+  });
+  return wrap_ptr(p, matrix_bucket(x), matrix_axes(x));
 }
 
 template <size_t I, typename T>
@@ -81,36 +180,87 @@ XPtr<arrayvec<I>> get_ptr(const T& x)
 }
 
 template <size_t I>
-NumericMatrix tuples_to_matrix_(List x)
+NumericMatrix tuples_to_matrix_(List x, size_t a, size_t b)
 {
   auto p = get_ptr<I>(x);
-  NumericMatrix res(p->size(), I);
-  transform(begin(*p), end(*p), begin(res), begin(res),
-            [&](const array<double, I>& a, double& v)
-            {
-              auto i = make_strided(&v, p->size());
-              copy(begin(a), end(a), i);
-              return v;
-            });
+  if (b < a || p->size() < b + 1) stop("Invalid range");
+  auto nr = b - a + 1;
+  NumericMatrix res = Rcpp::no_init(nr, I);
+  auto rows = row_data(*p) + a * I;
+  auto cols = begin(res);
+  for_row_chunks(nr, [=](size_t u, size_t v) {
+    rows_to_cols(rows, cols, nr, I, u, v);
+  });
   return res;
 }
 
 template <size_t I>
-NumericMatrix tuples_to_matrix_(List x, size_t a, size_t b)
+NumericMatrix tuples_to_matrix_(List x)
+{
+  auto n = get_ptr<I>(x)->size();
+  if (n == 0) return NumericMatrix(0, I);
+  auto res = tuples_to_matrix_<I>(x, 0, n - 1);
+  set_matrix_layout(res, x);
+  return res;
+}
+
+using arrayvec_dyn = vector<double>;
+
+inline
+List wrap_ptr(const XPtr<arrayvec_dyn>& q, size_t ncol, int bucket = 1,
+              RawVector axes = RawVector())
+{
+  List res;
+  res["xptr"] = wrap(q);
+  res["nrow"] = q->size() / ncol;
+  res["ncol"] = ncol;
+  res["bucket_size"] = bucket;
+  res["split_axes"] = axes;
+  res.attr("class") = "arrayvec";
+  return res;
+}
+
+template <typename T>
+XPtr<arrayvec_dyn> get_dyn_ptr(const T& x)
+{
+  return as<XPtr<arrayvec_dyn>>(x["xptr"]);
+}
+
+inline
+List matrix_to_tuples_dyn(const NumericMatrix& x)
+{
+  size_t nr = x.nrow(), nc = x.ncol();
+  auto p = make_xptr(new arrayvec_dyn(nr * nc));
+  auto cols = begin(x);
+  auto rows = p->data();
+  for_row_chunks(nr, [=](size_t a, size_t b) {
+    cols_to_rows(cols, nr, rows, nc, a, b);
+  });
+  return wrap_ptr(p, nc, matrix_bucket(x), matrix_axes(x));
+}
+
+inline
+NumericMatrix tuples_to_matrix_dyn(List x, size_t nc, size_t a, size_t b)
 {
+  auto p = get_dyn_ptr(x);
+  if (b < a || p->size() / nc < b + 1) stop("Invalid range");
   auto nr = b - a + 1;
-  auto p = get_ptr<I>(x);
-  if (b < a || p->size() < b + 1) stop("Invalid range");
-  NumericMatrix res(nr, I);
-  auto begin_ = begin(*p) + a,
-       end_ = begin(*p) + b + 1;
-  transform(begin_, end_, begin(res), begin(res),
-            [&](const array<double, I>& u, double& v)
-            {
-              auto i = make_strided(&v, nr);
-              copy(begin(u), end(u), i);
-              return v;
-            });
+  NumericMatrix res = Rcpp::no_init(nr, nc);
+  auto rows = p->data() + a * nc;
+  auto cols = begin(res);
+  for_row_chunks(nr, [=](size_t u, size_t v) {
+    rows_to_cols(rows, cols, nr, nc, u, v);
+  });
+  return res;
+}
+
+inline
+NumericMatrix tuples_to_matrix_dyn(List x, size_t nc)
+{
+  auto nr = get_dyn_ptr(x)->size() / nc;
+  if (nr == 0) return NumericMatrix(0, nc);
+  auto res = tuples_to_matrix_dyn(x, nc, 0, nr - 1);
+  set_matrix_layout(res, x);
   return res;
 }
 
@@ -124,6 +274,14 @@ vec_type<I> vec_to_array(const NumericVector& x)
   return y;
 }
 
+inline
+vector<double> vec_to_dyn(const NumericVector& x, size_t nc)
+{
+  if (size_t(x.length()) != nc)
+    stop("Invalid dimensions for value");
+  return vector<double>(begin(x), end(x));
+}
+
 inline
 int arrayvec_dim(const List& x)
 {
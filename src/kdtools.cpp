@@ -2,91 +2,215 @@
 #include "kdtools.h"
 using namespace kdtools;
 
+inline
+dyn_rows<double> get_rows(const XPtr<arrayvec_dyn>& p, size_t nc)
+{
+  return dyn_rows<double>(p->data(), p->size() / nc, nc);
+}
+
+inline
+bucket_size get_bucket(const List& x)
+{
+  return bucket_size(arrayvec_bucket(x));
+}
+
+inline
+int get_threads(int max_threads)
+{
+  if (max_threads < 0) stop("Invalid max_threads");
+  if (max_threads == 0) return std::thread::hardware_concurrency();
+  return max_threads;
+}
+
+inline
+const std::uint8_t* get_axes(const List& x, size_t n)
+{
+  RawVector a = x["split_axes"];
+  if (size_t(a.size()) != n ||
+      (n != 0 && *std::max_element(a.begin(), a.end()) >= arrayvec_dim(x)))
+    stop("Invalid split axes");
+  return a.begin();
+}
+
+inline
+void require_standard(const List& x)
+{
+  if (arrayvec_adaptive(x))
+    stop("Not supported for arrayvecs sorted with adaptive = TRUE");
+}
+
+inline
+List copy_rows(const XPtr<arrayvec_dyn>& p, size_t nc,
+               const vector<size_t>& idx)
+{
+  auto q = make_xptr(new arrayvec_dyn);
+  q->reserve(idx.size() * nc);
+  for (auto i : idx)
+    q->insert(end(*q), begin(*p) + i * nc, begin(*p) + (i + 1) * nc);
+  return wrap_ptr(q, nc);
+}
+
 template <size_t I>
-List kd_sort__(List x, bool inplace, bool parallel)
+List kd_sort__(List x, bool inplace, bool parallel, int bucket,
+               bool adaptive)
 {
   auto p = get_ptr<I>(x);
-  if (inplace) {
-    if (parallel) kd_sort_threaded(begin(*p), end(*p));
-    else kd_sort(begin(*p), end(*p));
-    return x;
-  } else {
-    auto q = make_xptr(new arrayvec<I>(*p));
-    if (parallel) kd_sort_threaded(begin(*q), end(*q));
-    else kd_sort(begin(*q), end(*q));
-    return wrap_ptr(q);
+  auto b = bucket_size(bucket);
+  if (!inplace) p = make_xptr(new arrayvec<I>(*p));
+  RawVector axes;
+  if (adaptive) {
+    auto a = parallel ?
+      kd_sort_adaptive_threaded(begin(*p), end(*p), b) :
+      kd_sort_adaptive(begin(*p), end(*p), b);
+    axes = RawVector(begin(a), end(a));
   }
+  else if (parallel) kd_sort_threaded(begin(*p), end(*p), b);
+  else kd_sort(begin(*p), end(*p), b);
+  if (!inplace) return wrap_ptr(p, int(b.value), axes);
+  x["bucket_size"] = int(b.value);
+  x["split_axes"] = axes;
+  return x;
+}
+
+List kd_sort_dyn__(List x, bool inplace, bool parallel, int bucket,
+                   bool adaptive)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto b = bucket_size(bucket);
+  if (!inplace) p = make_xptr(new arrayvec_dyn(*p));
+  auto r = get_rows(p, nc);
+  RawVector axes;
+  if (adaptive) {
+    if (nc > 256) stop("Adaptive sorting supports at most 256 columns");
+    auto a = parallel ?
+      kd_sort_adaptive_threaded(r, b) : kd_sort_adaptive(r, b);
+    axes = RawVector(begin(a), end(a));
+  }
+  else if (parallel) kd_sort_threaded(r, b);
+  else kd_sort(r, b);
+  if (!inplace) return wrap_ptr(p, nc, int(b.value), axes);
+  x["bucket_size"] = int(b.value);
+  x["split_axes"] = axes;
+  return x;
 }
 
 // [[Rcpp::export]]
-List kd_sort_(List x, bool inplace = false, bool parallel = false)
+List kd_sort_(List x, bool inplace = false, bool parallel = false,
+              int bucket_size = 1, bool adaptive = false)
 {
+  if (bucket_size < 1) stop("Bucket size must be positive");
   switch(arrayvec_dim(x)) {
-  case 1: return kd_sort__<1>(x, inplace, parallel);
-  case 2: return kd_sort__<2>(x, inplace, parallel);
-  case 3: return kd_sort__<3>(x, inplace, parallel);
-  case 4: return kd_sort__<4>(x, inplace, parallel);
-  case 5: return kd_sort__<5>(x, inplace, parallel);
-  case 6: return kd_sort__<6>(x, inplace, parallel);
-  case 7: return kd_sort__<7>(x, inplace, parallel);
-  case 8: return kd_sort__<8>(x, inplace, parallel);
-  case 9: return kd_sort__<9>(x, inplace, parallel);
-  default: stop("Invalid dimensions");
+  case 1: return kd_sort__<1>(x, inplace, parallel, bucket_size, adaptive);
+  case 2: return kd_sort__<2>(x, inplace, parallel, bucket_size, adaptive);
+  case 3: return kd_sort__<3>(x, inplace, parallel, bucket_size, adaptive);
+  case 4: return kd_sort__<4>(x, inplace, parallel, bucket_size, adaptive);
+  case 5: return kd_sort__<5>(x, inplace, parallel, bucket_size, adaptive);
+  case 6: return kd_sort__<6>(x, inplace, parallel, bucket_size, adaptive);
+  case 7: return kd_sort__<7>(x, inplace, parallel, bucket_size, adaptive);
+  case 8: return kd_sort__<8>(x, inplace, parallel, bucket_size, adaptive);
+  case 9: return kd_sort__<9>(x, inplace, parallel, bucket_size, adaptive);
+  default: return kd_sort_dyn__(x, inplace, parallel, bucket_size, adaptive);
   }
 }
 
+inline
+size_t get_levels(double levels)
+{
+  if (std::isnan(levels) || levels < 0) stop("Invalid number of levels");
+  if (std::isinf(levels)) return std::numeric_limits<size_t>::max();
+  return size_t(levels);
+}
+
 template <size_t I>
-bool kd_is_sorted__(List x)
+bool kd_is_sorted__(List x, bool parallel, size_t levels)
 {
   auto p = get_ptr<I>(x);
-  return kd_is_sorted(begin(*p), end(*p));
+  auto b = get_bucket(x);
+  if (arrayvec_adaptive(x)) {
+    auto axes = get_axes(x, p->size());
+    return parallel ?
+      kd_is_sorted_adaptive_threaded(begin(*p), end(*p), axes, b, levels) :
+      kd_is_sorted_adaptive(begin(*p), end(*p), axes, b, levels);
+  }
+  return parallel ?
+    kd_is_sorted_threaded(begin(*p), end(*p), b, levels) :
+    kd_is_sorted(begin(*p), end(*p), b, levels);
+}
+
+bool kd_is_sorted_dyn__(List x, bool parallel, size_t levels)
+{
+  auto r = get_rows(get_dyn_ptr(x), arrayvec_dim(x));
+  auto b = get_bucket(x);
+  if (arrayvec_adaptive(x)) {
+    auto axes = get_axes(x, r.size());
+    return parallel ?
+      kd_is_sorted_adaptive_threaded(r, axes, b, levels) :
+      kd_is_sorted_adaptive(r, axes, b, levels);
+  }
+  return parallel ?
+    kd_is_sorted_threaded(r, b, levels) : kd_is_sorted(r, b, levels);
 }
 
 // [[Rcpp::export]]
-bool kd_is_sorted_(List x)
+bool kd_is_sorted_(List x, bool parallel = false, double levels = R_PosInf)
 {
+  auto lv = get_levels(levels);
   switch(arrayvec_dim(x)) {
-  case 1: return kd_is_sorted__<1>(x);
-  case 2: return kd_is_sorted__<2>(x);
-  case 3: return kd_is_sorted__<3>(x);
-  case 4: return kd_is_sorted__<4>(x);
-  case 5: return kd_is_sorted__<5>(x);
-  case 6: return kd_is_sorted__<6>(x);
-  case 7: return kd_is_sorted__<7>(x);
-  case 8: return kd_is_sorted__<8>(x);
-  case 9: return kd_is_sorted__<9>(x);
-  default: stop("Invalid dimensions");
+  case 1: return kd_is_sorted__<1>(x, parallel, lv);
+  case 2: return kd_is_sorted__<2>(x, parallel, lv);
+  case 3: return kd_is_sorted__<3>(x, parallel, lv);
+  case 4: return kd_is_sorted__<4>(x, parallel, lv);
+  case 5: return kd_is_sorted__<5>(x, parallel, lv);
+  case 6: return kd_is_sorted__<6>(x, parallel, lv);
+  case 7: return kd_is_sorted__<7>(x, parallel, lv);
+  case 8: return kd_is_sorted__<8>(x, parallel, lv);
+  case 9: return kd_is_sorted__<9>(x, parallel, lv);
+  default: return kd_is_sorted_dyn__(x, parallel, lv);
   }
 }
 
 template <size_t I>
-List lex_sort__(List x, bool inplace)
+List lex_sort__(List x, bool inplace, bool parallel)
 {
   auto p = get_ptr<I>(x);
-  if (inplace) {
-    lex_sort(begin(*p), end(*p));
-    return x;
-  } else {
-    auto q = make_xptr(new arrayvec<I>(*p));
-    lex_sort(begin(*q), end(*q));
-    return wrap_ptr(q);
-  }
+  if (!inplace) p = make_xptr(new arrayvec<I>(*p));
+  if (parallel) lex_sort_threaded(begin(*p), end(*p));
+  else lex_sort(begin(*p), end(*p));
+  if (!inplace) return wrap_ptr(p);
+  x["bucket_size"] = 1;
+  x["split_axes"] = RawVector();
+  return x;
+}
+
+List lex_sort_dyn__(List x, bool inplace, bool parallel)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  if (!inplace) p = make_xptr(new arrayvec_dyn(*p));
+  auto r = get_rows(p, nc);
+  if (parallel) lex_sort_threaded(r);
+  else lex_sort(r);
+  if (!inplace) return wrap_ptr(p, nc);
+  x["bucket_size"] = 1;
+  x["split_axes"] = RawVector();
+  return x;
 }
 
 // [[Rcpp::export]]
-List lex_sort_(List x, bool inplace = false)
+List lex_sort_(List x, bool inplace = false, bool parallel = false)
 {
   switch(arrayvec_dim(x)) {
-  case 1: return lex_sort__<1>(x, inplace);
-  case 2: return lex_sort__<2>(x, inplace);
-  case 3: return lex_sort__<3>(x, inplace);
-  case 4: return lex_sort__<4>(x, inplace);
-  case 5: return lex_sort__<5>(x, inplace);
-  case 6: return lex_sort__<6>(x, inplace);
-  case 7: return lex_sort__<7>(x, inplace);
-  case 8: return lex_sort__<8>(x, inplace);
-  case 9: return lex_sort__<9>(x, inplace);
-  default: stop("Invalid dimensions");
+  case 1: return lex_sort__<1>(x, inplace, parallel);
+  case 2: return lex_sort__<2>(x, inplace, parallel);
+  case 3: return lex_sort__<3>(x, inplace, parallel);
+  case 4: return lex_sort__<4>(x, inplace, parallel);
+  case 5: return lex_sort__<5>(x, inplace, parallel);
+  case 6: return lex_sort__<6>(x, inplace, parallel);
+  case 7: return lex_sort__<7>(x, inplace, parallel);
+  case 8: return lex_sort__<8>(x, inplace, parallel);
+  case 9: return lex_sort__<9>(x, inplace, parallel);
+  default: return lex_sort_dyn__(x, inplace, parallel);
   }
 }
 
@@ -95,14 +219,26 @@ int kd_lower_bound__(List x, NumericVector v)
 {
   auto p = get_ptr<I>(x);
   auto w = vec_to_array<I>(v);
-  auto lv = kd_lower_bound(begin(*p), end(*p), w);
+  auto lv = kd_lower_bound(begin(*p), end(*p), w, get_bucket(x));
   if (lv == end(*p)) return NA_INTEGER;
   return distance(begin(*p), lv) + 1;
 }
 
+int kd_lower_bound_dyn__(List x, NumericVector v)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto w = vec_to_dyn(v, nc);
+  auto r = get_rows(p, nc);
+  auto lv = kd_lower_bound(r, w.data(), get_bucket(x));
+  if (lv == r.size()) return NA_INTEGER;
+  return lv + 1;
+}
+
 // [[Rcpp::export]]
 int kd_lower_bound_(List x, NumericVector value)
 {
+  require_standard(x);
   switch(arrayvec_dim(x)) {
   case 1: return kd_lower_bound__<1>(x, value);
   case 2: return kd_lower_bound__<2>(x, value);
@@ -113,7 +249,7 @@ int kd_lower_bound_(List x, NumericVector value)
   case 7: return kd_lower_bound__<7>(x, value);
   case 8: return kd_lower_bound__<8>(x, value);
   case 9: return kd_lower_bound__<9>(x, value);
-  default: stop("Invalid dimensions");
+  default: return kd_lower_bound_dyn__(x, value);
   }
 }
 
@@ -123,14 +259,26 @@ int kd_upper_bound__(List x, NumericVector v)
   auto p = get_ptr<I>(x);
   array<double, I> w;
   w = vec_to_array<I>(v);
-  auto lv = kd_upper_bound(begin(*p), end(*p), w);
+  auto lv = kd_upper_bound(begin(*p), end(*p), w, get_bucket(x));
   if (lv == end(*p)) return NA_INTEGER;
   return distance(begin(*p), lv) + 1;
 }
 
+int kd_upper_bound_dyn__(List x, NumericVector v)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto w = vec_to_dyn(v, nc);
+  auto r = get_rows(p, nc);
+  auto lv = kd_upper_bound(r, w.data(), get_bucket(x));
+  if (lv == r.size()) return NA_INTEGER;
+  return lv + 1;
+}
+
 // [[Rcpp::export]]
 int kd_upper_bound_(List x, NumericVector value)
 {
+  require_standard(x);
   switch(arrayvec_dim(x)) {
   case 1: return kd_upper_bound__<1>(x, value);
   case 2: return kd_upper_bound__<2>(x, value);
@@ -141,7 +289,7 @@ int kd_upper_bound_(List x, NumericVector value)
   case 7: return kd_upper_bound__<7>(x, value);
   case 8: return kd_upper_bound__<8>(x, value);
   case 9: return kd_upper_bound__<9>(x, value);
-  default: stop("Invalid dimensions");
+  default: return kd_upper_bound_dyn__(x, value);
   }
 }
 
@@ -153,10 +301,29 @@ List kd_range_query__(List x, NumericVector lower, NumericVector upper)
   auto oi = back_inserter(*q);
   auto l = vec_to_array<I>(lower),
     u = vec_to_array<I>(upper);
-  kd_range_query(begin(*p), end(*p), l, u, oi);
+  if (arrayvec_adaptive(x))
+    kd_range_query_adaptive(begin(*p), end(*p), get_axes(x, p->size()),
+                            l, u, oi, get_bucket(x));
+  else kd_range_query(begin(*p), end(*p), l, u, oi, get_bucket(x));
   return wrap_ptr(q);
 }
 
+List kd_range_query_dyn__(List x, NumericVector lower, NumericVector upper)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto l = vec_to_dyn(lower, nc),
+    u = vec_to_dyn(upper, nc);
+  auto r = get_rows(p, nc);
+  vector<size_t> idx;
+  if (arrayvec_adaptive(x))
+    kd_range_query_adaptive(r, get_axes(x, r.size()), l.data(), u.data(),
+                            back_inserter(idx), get_bucket(x));
+  else kd_range_query(r, l.data(), u.data(), back_inserter(idx),
+                      get_bucket(x));
+  return copy_rows(p, nc, idx);
+}
+
 // [[Rcpp::export]]
 List kd_range_query_(List x, NumericVector lower, NumericVector upper)
 {
@@ -170,7 +337,7 @@ List kd_range_query_(List x, NumericVector lower, NumericVector upper)
   case 7: return kd_range_query__<7>(x, lower, upper);
   case 8: return kd_range_query__<8>(x, lower, upper);
   case 9: return kd_range_query__<9>(x, lower, upper);
-  default: stop("Invalid dimensions");
+  default: return kd_range_query_dyn__(x, lower, upper);
   }
 }
 
@@ -179,11 +346,28 @@ int kd_nearest_neighbor__(List x, NumericVector v)
 {
   auto p = get_ptr<I>(x);
   auto w = vec_to_array<I>(v);
-  auto nn = kd_nearest_neighbor(begin(*p), end(*p), w);
+  auto nn = arrayvec_adaptive(x) ?
+    kd_nearest_neighbor_adaptive(begin(*p), end(*p), get_axes(x, p->size()),
+                                 w, get_bucket(x)) :
+    kd_nearest_neighbor(begin(*p), end(*p), w, get_bucket(x));
   if (nn >= end(*p)) stop("Search failed");
   return distance(begin(*p), nn) + 1;
 }
 
+int kd_nearest_neighbor_dyn__(List x, NumericVector v)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto w = vec_to_dyn(v, nc);
+  auto r = get_rows(p, nc);
+  auto nn = arrayvec_adaptive(x) ?
+    kd_nearest_neighbor_adaptive(r, get_axes(x, r.size()), w.data(),
+                                 get_bucket(x)) :
+    kd_nearest_neighbor(r, w.data(), get_bucket(x));
+  if (nn >= r.size()) stop("Search failed");
+  return nn + 1;
+}
+
 // [[Rcpp::export]]
 int kd_nearest_neighbor_(List x, NumericVector value)
 {
@@ -197,7 +381,7 @@ int kd_nearest_neighbor_(List x, NumericVector value)
   case 7: return kd_nearest_neighbor__<7>(x, value);
   case 8: return kd_nearest_neighbor__<8>(x, value);
   case 9: return kd_nearest_neighbor__<9>(x, value);
-  default: stop("Invalid dimensions");
+  default: return kd_nearest_neighbor_dyn__(x, value);
   }
 }
 
@@ -206,7 +390,23 @@ bool kd_binary_search__(List x, NumericVector v)
 {
   auto p = get_ptr<I>(x);
   auto w = vec_to_array<I>(v);
-  return kd_binary_search(begin(*p), end(*p), w);
+  if (arrayvec_adaptive(x))
+    return kd_binary_search_adaptive(begin(*p), end(*p),
+                                     get_axes(x, p->size()), w,
+                                     get_bucket(x));
+  return kd_binary_search(begin(*p), end(*p), w, get_bucket(x));
+}
+
+bool kd_binary_search_dyn__(List x, NumericVector v)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto w = vec_to_dyn(v, nc);
+  auto r = get_rows(p, nc);
+  if (arrayvec_adaptive(x))
+    return kd_binary_search_adaptive(r, get_axes(x, r.size()), w.data(),
+                                     get_bucket(x));
+  return kd_binary_search(r, w.data(), get_bucket(x));
 }
 
 // [[Rcpp::export]]
@@ -222,7 +422,7 @@ bool kd_binary_search_(List x, NumericVector value)
   case 7: return kd_binary_search__<7>(x, value);
   case 8: return kd_binary_search__<8>(x, value);
   case 9: return kd_binary_search__<9>(x, value);
-  default: stop("Invalid dimensions");
+  default: return kd_binary_search_dyn__(x, value);
   }
 }
 
@@ -230,16 +430,35 @@ template <size_t I>
 List kd_nearest_neighbors__(List x, NumericVector value, int n)
 {
   auto p = get_ptr<I>(x);
-  auto q = make_xptr(new arrayvec<I>);
-  auto oi = back_inserter(*q);
   auto v = vec_to_array<I>(value);
-  kd_nearest_neighbors(begin(*p), end(*p), v, n, oi);
+  auto q = make_xptr(new arrayvec<I>);
+  if (arrayvec_adaptive(x))
+    kd_nearest_neighbors_adaptive(begin(*p), end(*p), get_axes(x, p->size()),
+                                  v, n, back_inserter(*q), get_bucket(x));
+  else kd_nearest_neighbors(begin(*p), end(*p), v, n, back_inserter(*q),
+                            get_bucket(x));
   return wrap_ptr(q);
 }
 
+List kd_nearest_neighbors_dyn__(List x, NumericVector value, int n)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto v = vec_to_dyn(value, nc);
+  auto r = get_rows(p, nc);
+  vector<size_t> idx;
+  if (arrayvec_adaptive(x))
+    kd_nearest_neighbors_adaptive(r, get_axes(x, r.size()), v.data(), n,
+                                  back_inserter(idx), get_bucket(x));
+  else kd_nearest_neighbors(r, v.data(), n, back_inserter(idx),
+                            get_bucket(x));
+  return copy_rows(p, nc, idx);
+}
+
 // [[Rcpp::export]]
 List kd_nearest_neighbors_(List x, NumericVector value, int n)
 {
+  if (n < 0) stop("Number of neighbors must be non-negative");
   switch(arrayvec_dim(x)) {
   case 1: return kd_nearest_neighbors__<1>(x, value, n);
   case 2: return kd_nearest_neighbors__<2>(x, value, n);
@@ -250,7 +469,7 @@ List kd_nearest_neighbors_(List x, NumericVector value, int n)
   case 7: return kd_nearest_neighbors__<7>(x, value, n);
   case 8: return kd_nearest_neighbors__<8>(x, value, n);
   case 9: return kd_nearest_neighbors__<9>(x, value, n);
-  default: stop("Invalid dimensions");
+  default: return kd_nearest_neighbors_dyn__(x, value, n);
   }
 }
 
@@ -271,6 +490,17 @@ IntegerVector kd_order__(List x, bool parallel)
   return res;
 }
 
+IntegerVector kd_order_dyn__(List x, bool parallel)
+{
+  auto p = get_dyn_ptr(x);
+  auto r = get_rows(p, arrayvec_dim(x));
+  auto q = parallel ? kd_order_threaded(r) : kd_order(r);
+  IntegerVector res(q.size());
+  std::transform(begin(q), end(q), begin(res),
+                 [](size_t i){ return i + 1; });
+  return res;
+}
+
 // [[Rcpp::export]]
 IntegerVector kd_order_(List x, bool parallel = false)
 {
@@ -284,7 +514,678 @@ IntegerVector kd_order_(List x, bool parallel = false)
   case 7: return kd_order__<7>(x, parallel);
   case 8: return kd_order__<8>(x, parallel);
   case 9: return kd_order__<9>(x, parallel);
+  default: return kd_order_dyn__(x, parallel);
+  }
+}
+
+
+template <size_t I>
+vec_type<I> box_to_array(const NumericVector& x)
+{
+  auto y = vec_to_array<I>(x);
+  if (std::any_of(begin(y), end(y), [](double v){ return !(v > 0); }))
+    stop("Box lengths must be positive");
+  return y;
+}
+
+template <size_t I>
+List kd_radius_query__(List x, NumericVector value, double radius)
+{
+  auto p = get_ptr<I>(x);
+  auto q = make_xptr(new arrayvec<I>);
+  auto oi = back_inserter(*q);
+  auto v = vec_to_array<I>(value);
+  if (arrayvec_adaptive(x))
+    kd_radius_query_adaptive(begin(*p), end(*p), get_axes(x, p->size()),
+                             v, radius, oi, get_bucket(x));
+  else kd_radius_query(begin(*p), end(*p), v, radius, oi, get_bucket(x));
+  return wrap_ptr(q);
+}
+
+List kd_radius_query_dyn__(List x, NumericVector value, double radius)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto v = vec_to_dyn(value, nc);
+  auto r = get_rows(p, nc);
+  vector<size_t> idx;
+  if (arrayvec_adaptive(x))
+    kd_radius_query_adaptive(r, get_axes(x, r.size()), v.data(), radius,
+                             back_inserter(idx), get_bucket(x));
+  else kd_radius_query(r, v.data(), radius, back_inserter(idx),
+                       get_bucket(x));
+  return copy_rows(p, nc, idx);
+}
+
+// [[Rcpp::export]]
+List kd_radius_query_(List x, NumericVector value, double radius)
+{
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_radius_query__<1>(x, value, radius);
+  case 2: return kd_radius_query__<2>(x, value, radius);
+  case 3: return kd_radius_query__<3>(x, value, radius);
+  case 4: return kd_radius_query__<4>(x, value, radius);
+  case 5: return kd_radius_query__<5>(x, value, radius);
+  case 6: return kd_radius_query__<6>(x, value, radius);
+  case 7: return kd_radius_query__<7>(x, value, radius);
+  case 8: return kd_radius_query__<8>(x, value, radius);
+  case 9: return kd_radius_query__<9>(x, value, radius);
+  default: return kd_radius_query_dyn__(x, value, radius);
+  }
+}
+
+// Copies the half-space coefficients into rows, one per constraint
+inline
+vector<double> polytope_rows(const NumericMatrix& A, const NumericVector& b,
+                             size_t nc)
+{
+  if (size_t(A.ncol()) != nc) stop("Invalid constraint matrix");
+  if (A.nrow() != b.size()) stop("Invalid constraint bounds");
+  vector<double> res(A.nrow() * nc);
+  for (int i = 0; i != A.nrow(); ++i)
+    for (size_t j = 0; j != nc; ++j)
+      res[i * nc + j] = A(i, j);
+  return res;
+}
+
+template <size_t I>
+List kd_polytope_query__(List x, NumericMatrix A, NumericVector b)
+{
+  auto p = get_ptr<I>(x);
+  auto q = make_xptr(new arrayvec<I>);
+  auto oi = back_inserter(*q);
+  auto a = polytope_rows(A, b, I);
+  if (arrayvec_adaptive(x))
+    kd_polytope_query_adaptive(begin(*p), end(*p), get_axes(x, p->size()),
+                               a.data(), b.begin(), b.size(), oi,
+                               get_bucket(x));
+  else kd_polytope_query(begin(*p), end(*p), a.data(), b.begin(), b.size(),
+                         oi, get_bucket(x));
+  return wrap_ptr(q);
+}
+
+List kd_polytope_query_dyn__(List x, NumericMatrix A, NumericVector b)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto a = polytope_rows(A, b, nc);
+  auto r = get_rows(p, nc);
+  vector<size_t> idx;
+  if (arrayvec_adaptive(x))
+    kd_polytope_query_adaptive(r, get_axes(x, r.size()), a.data(), b.begin(),
+                               b.size(), back_inserter(idx), get_bucket(x));
+  else kd_polytope_query(r, a.data(), b.begin(), b.size(),
+                         back_inserter(idx), get_bucket(x));
+  return copy_rows(p, nc, idx);
+}
+
+// [[Rcpp::export]]
+List kd_polytope_query_(List x, NumericMatrix A, NumericVector b)
+{
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_polytope_query__<1>(x, A, b);
+  case 2: return kd_polytope_query__<2>(x, A, b);
+  case 3: return kd_polytope_query__<3>(x, A, b);
+  case 4: return kd_polytope_query__<4>(x, A, b);
+  case 5: return kd_polytope_query__<5>(x, A, b);
+  case 6: return kd_polytope_query__<6>(x, A, b);
+  case 7: return kd_polytope_query__<7>(x, A, b);
+  case 8: return kd_polytope_query__<8>(x, A, b);
+  case 9: return kd_polytope_query__<9>(x, A, b);
+  default: return kd_polytope_query_dyn__(x, A, b);
+  }
+}
+
+inline
+void check_weights(const NumericVector& w, size_t n)
+{
+  if (size_t(w.size()) != n) stop("Expecting one weight per row");
+}
+
+inline
+const kd_summary_tree& get_tree(SEXP tree, const List& x, size_t n)
+{
+  XPtr<kd_summary_tree> t(tree);
+  if (!t.get()) stop("Invalid summary tree");
+  if (t->m_size != n || t->m_ncol != size_t(arrayvec_dim(x)) ||
+      t->m_bucket != get_bucket(x).value)
+    stop("Summary tree does not match the data");
+  return *t;
+}
+
+inline
+NumericVector summary_values(const kd_summary& s)
+{
+  auto empty = s.count == 0;
+  return NumericVector::create(
+    Rcpp::_["count"] = double(s.count),
+    Rcpp::_["sum"] = s.sum,
+    Rcpp::_["mean"] = empty ? NA_REAL : s.mean(),
+    Rcpp::_["min"] = empty ? NA_REAL : s.min,
+    Rcpp::_["max"] = empty ? NA_REAL : s.max);
+}
+
+template <size_t I>
+SEXP kd_summarize__(List x, NumericVector w)
+{
+  auto p = get_ptr<I>(x);
+  check_weights(w, p->size());
+  auto t = kd_summarize(begin(*p), end(*p), w.begin(), get_bucket(x));
+  return make_xptr(new kd_summary_tree(t));
+}
+
+SEXP kd_summarize_dyn__(List x, NumericVector w)
+{
+  auto nc = arrayvec_dim(x);
+  auto r = get_rows(get_dyn_ptr(x), nc);
+  check_weights(w, r.size());
+  auto t = kd_summarize(r, w.begin(), get_bucket(x));
+  return make_xptr(new kd_summary_tree(t));
+}
+
+// [[Rcpp::export]]
+SEXP kd_summarize_(List x, NumericVector w)
+{
+  require_standard(x);
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_summarize__<1>(x, w);
+  case 2: return kd_summarize__<2>(x, w);
+  case 3: return kd_summarize__<3>(x, w);
+  case 4: return kd_summarize__<4>(x, w);
+  case 5: return kd_summarize__<5>(x, w);
+  case 6: return kd_summarize__<6>(x, w);
+  case 7: return kd_summarize__<7>(x, w);
+  case 8: return kd_summarize__<8>(x, w);
+  case 9: return kd_summarize__<9>(x, w);
+  default: return kd_summarize_dyn__(x, w);
+  }
+}
+
+template <size_t I>
+NumericVector kd_range_summary__(List x, NumericVector w, SEXP tree,
+                                 NumericVector lower, NumericVector upper)
+{
+  auto p = get_ptr<I>(x);
+  check_weights(w, p->size());
+  auto l = vec_to_array<I>(lower),
+    u = vec_to_array<I>(upper);
+  return summary_values(kd_range_summary(begin(*p), end(*p), w.begin(),
+                                         get_tree(tree, x, p->size()), l, u));
+}
+
+NumericVector kd_range_summary_dyn__(List x, NumericVector w, SEXP tree,
+                                     NumericVector lower,
+                                     NumericVector upper)
+{
+  auto nc = arrayvec_dim(x);
+  auto r = get_rows(get_dyn_ptr(x), nc);
+  check_weights(w, r.size());
+  auto l = vec_to_dyn(lower, nc),
+    u = vec_to_dyn(upper, nc);
+  return summary_values(kd_range_summary(r, w.begin(),
+                                         get_tree(tree, x, r.size()),
+                                         l.data(), u.data()));
+}
+
+// [[Rcpp::export]]
+NumericVector kd_range_summary_(List x, NumericVector w, SEXP tree,
+                                NumericVector lower, NumericVector upper)
+{
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_range_summary__<1>(x, w, tree, lower, upper);
+  case 2: return kd_range_summary__<2>(x, w, tree, lower, upper);
+  case 3: return kd_range_summary__<3>(x, w, tree, lower, upper);
+  case 4: return kd_range_summary__<4>(x, w, tree, lower, upper);
+  case 5: return kd_range_summary__<5>(x, w, tree, lower, upper);
+  case 6: return kd_range_summary__<6>(x, w, tree, lower, upper);
+  case 7: return kd_range_summary__<7>(x, w, tree, lower, upper);
+  case 8: return kd_range_summary__<8>(x, w, tree, lower, upper);
+  case 9: return kd_range_summary__<9>(x, w, tree, lower, upper);
+  default: return kd_range_summary_dyn__(x, w, tree, lower, upper);
+  }
+}
+
+template <size_t I>
+NumericVector kd_density__(List x, List at, double bandwidth,
+                           kernel_type kernel, double rel_err,
+                           bool parallel)
+{
+  auto p = get_ptr<I>(x);
+  auto q = get_ptr<I>(at);
+  NumericVector res(q->size());
+  if (parallel)
+    kd_density_threaded(begin(*p), end(*p), begin(*q), end(*q), bandwidth,
+                        begin(res), kernel, rel_err);
+  else
+    kd_density(begin(*p), end(*p), begin(*q), end(*q), bandwidth,
+               begin(res), kernel, rel_err);
+  return res;
+}
+
+NumericVector kd_density_dyn__(List x, List at, double bandwidth,
+                               kernel_type kernel, double rel_err,
+                               bool parallel)
+{
+  auto nc = arrayvec_dim(x);
+  auto r = get_rows(get_dyn_ptr(x), nc);
+  auto q = get_rows(get_dyn_ptr(at), nc);
+  NumericVector res(q.size());
+  if (parallel)
+    kd_density_threaded(r, q, bandwidth, begin(res), kernel, rel_err);
+  else
+    kd_density(r, q, bandwidth, begin(res), kernel, rel_err);
+  return res;
+}
+
+// [[Rcpp::export]]
+NumericVector kd_density_(List x, List at, double bandwidth,
+                          bool gaussian = true, double rel_err = 1e-3,
+                          bool parallel = false)
+{
+  if (arrayvec_dim(at) != arrayvec_dim(x))
+    stop("Evaluation points must have the same number of columns");
+  if (!(bandwidth > 0)) stop("Bandwidth must be positive");
+  if (!(rel_err >= 0)) stop("Relative error must be non-negative");
+  auto k = gaussian ? kernel_type::gaussian : kernel_type::epanechnikov;
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_density__<1>(x, at, bandwidth, k, rel_err, parallel);
+  case 2: return kd_density__<2>(x, at, bandwidth, k, rel_err, parallel);
+  case 3: return kd_density__<3>(x, at, bandwidth, k, rel_err, parallel);
+  case 4: return kd_density__<4>(x, at, bandwidth, k, rel_err, parallel);
+  case 5: return kd_density__<5>(x, at, bandwidth, k, rel_err, parallel);
+  case 6: return kd_density__<6>(x, at, bandwidth, k, rel_err, parallel);
+  case 7: return kd_density__<7>(x, at, bandwidth, k, rel_err, parallel);
+  case 8: return kd_density__<8>(x, at, bandwidth, k, rel_err, parallel);
+  case 9: return kd_density__<9>(x, at, bandwidth, k, rel_err, parallel);
+  default: return kd_density_dyn__(x, at, bandwidth, k, rel_err, parallel);
+  }
+}
+
+template <size_t I>
+IntegerVector kd_dbscan__(List x, double eps, size_t min_pts, bool parallel)
+{
+  auto p = get_ptr<I>(x);
+  auto b = get_bucket(x);
+  IntegerVector res(p->size());
+  if (parallel)
+    kd_dbscan_threaded(begin(*p), end(*p), eps, min_pts, begin(res), b);
+  else
+    kd_dbscan(begin(*p), end(*p), eps, min_pts, begin(res), b);
+  return res;
+}
+
+IntegerVector kd_dbscan_dyn__(List x, double eps, size_t min_pts,
+                              bool parallel)
+{
+  auto r = get_rows(get_dyn_ptr(x), arrayvec_dim(x));
+  auto b = get_bucket(x);
+  IntegerVector res(r.size());
+  if (parallel) kd_dbscan_threaded(r, eps, min_pts, begin(res), b);
+  else kd_dbscan(r, eps, min_pts, begin(res), b);
+  return res;
+}
+
+// [[Rcpp::export]]
+IntegerVector kd_dbscan_(List x, double eps, int min_pts = 5,
+                         bool parallel = false)
+{
+  require_standard(x);
+  if (!(eps >= 0)) stop("Radius must be non-negative");
+  if (min_pts < 1) stop("Minimum number of points must be positive");
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_dbscan__<1>(x, eps, min_pts, parallel);
+  case 2: return kd_dbscan__<2>(x, eps, min_pts, parallel);
+  case 3: return kd_dbscan__<3>(x, eps, min_pts, parallel);
+  case 4: return kd_dbscan__<4>(x, eps, min_pts, parallel);
+  case 5: return kd_dbscan__<5>(x, eps, min_pts, parallel);
+  case 6: return kd_dbscan__<6>(x, eps, min_pts, parallel);
+  case 7: return kd_dbscan__<7>(x, eps, min_pts, parallel);
+  case 8: return kd_dbscan__<8>(x, eps, min_pts, parallel);
+  case 9: return kd_dbscan__<9>(x, eps, min_pts, parallel);
+  default: return kd_dbscan_dyn__(x, eps, min_pts, parallel);
+  }
+}
+
+inline
+List kmeans_values(const kd_kmeans_result& r, size_t nc)
+{
+  auto k = r.sizes.size();
+  IntegerVector cluster(r.labels.size());
+  std::transform(begin(r.labels), end(r.labels), begin(cluster),
+                 [k](size_t i){ return i < k ? int(i + 1) : NA_INTEGER; });
+  NumericMatrix centers(k, nc);
+  for (size_t i = 0; i != k; ++i)
+    for (size_t j = 0; j != nc; ++j)
+      centers(i, j) = r.centers[i * nc + j];
+  return List::create(
+    Rcpp::_["cluster"] = cluster,
+    Rcpp::_["centers"] = centers,
+    Rcpp::_["size"] = IntegerVector(begin(r.sizes), end(r.sizes)),
+    Rcpp::_["iter"] = int(r.iterations),
+    Rcpp::_["converged"] = r.converged,
+    Rcpp::_["distance_evals"] = NumericVector(begin(r.distance_evals),
+                                              end(r.distance_evals)));
+}
+
+inline
+std::vector<double> kmeans_centers(const NumericMatrix& centers, size_t nc)
+{
+  if (size_t(centers.ncol()) != nc) stop("Invalid centers");
+  size_t k = centers.nrow();
+  std::vector<double> res(k * nc);
+  for (size_t i = 0; i != k; ++i)
+    for (size_t j = 0; j != nc; ++j)
+    {
+      res[i * nc + j] = centers(i, j);
+      if (!std::isfinite(res[i * nc + j])) stop("Invalid centers");
+    }
+  return res;
+}
+
+template <size_t I>
+List kd_kmeans__(List x, NumericMatrix centers, size_t iter_max,
+                 bool parallel)
+{
+  auto p = get_ptr<I>(x);
+  auto c = kmeans_centers(centers, I);
+  size_t k = centers.nrow();
+  auto r = parallel ?
+    kd_kmeans_threaded(begin(*p), end(*p), c.data(), k, iter_max) :
+    kd_kmeans(begin(*p), end(*p), c.data(), k, iter_max);
+  return kmeans_values(r, I);
+}
+
+List kd_kmeans_dyn__(List x, NumericMatrix centers, size_t iter_max,
+                     bool parallel)
+{
+  auto nc = arrayvec_dim(x);
+  auto r = get_rows(get_dyn_ptr(x), nc);
+  auto c = kmeans_centers(centers, nc);
+  size_t k = centers.nrow();
+  auto res = parallel ?
+    kd_kmeans_threaded(r, c.data(), k, iter_max) :
+    kd_kmeans(r, c.data(), k, iter_max);
+  return kmeans_values(res, nc);
+}
+
+// [[Rcpp::export]]
+List kd_kmeans_(List x, NumericMatrix centers, int iter_max = 10,
+                bool parallel = false)
+{
+  require_standard(x);
+  if (iter_max < 1) stop("Maximum number of iterations must be positive");
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_kmeans__<1>(x, centers, iter_max, parallel);
+  case 2: return kd_kmeans__<2>(x, centers, iter_max, parallel);
+  case 3: return kd_kmeans__<3>(x, centers, iter_max, parallel);
+  case 4: return kd_kmeans__<4>(x, centers, iter_max, parallel);
+  case 5: return kd_kmeans__<5>(x, centers, iter_max, parallel);
+  case 6: return kd_kmeans__<6>(x, centers, iter_max, parallel);
+  case 7: return kd_kmeans__<7>(x, centers, iter_max, parallel);
+  case 8: return kd_kmeans__<8>(x, centers, iter_max, parallel);
+  case 9: return kd_kmeans__<9>(x, centers, iter_max, parallel);
+  default: return kd_kmeans_dyn__(x, centers, iter_max, parallel);
+  }
+}
+
+template <size_t I>
+List kd_nearest_neighbors_periodic__(List x, NumericVector value,
+                                     int n, NumericVector box)
+{
+  auto p = get_ptr<I>(x);
+  auto q = make_xptr(new arrayvec<I>);
+  auto oi = back_inserter(*q);
+  auto v = vec_to_array<I>(value);
+  auto b = box_to_array<I>(box);
+  kd_nearest_neighbors_periodic(begin(*p), end(*p), v, n, b, oi, get_bucket(x));
+  return wrap_ptr(q);
+}
+
+// [[Rcpp::export]]
+List kd_nearest_neighbors_periodic_(List x, NumericVector value,
+                                    int n, NumericVector box)
+{
+  if (n < 0) stop("Number of neighbors must be non-negative");
+  require_standard(x);
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_nearest_neighbors_periodic__<1>(x, value, n, box);
+  case 2: return kd_nearest_neighbors_periodic__<2>(x, value, n, box);
+  case 3: return kd_nearest_neighbors_periodic__<3>(x, value, n, box);
+  case 4: return kd_nearest_neighbors_periodic__<4>(x, value, n, box);
+  case 5: return kd_nearest_neighbors_periodic__<5>(x, value, n, box);
+  case 6: return kd_nearest_neighbors_periodic__<6>(x, value, n, box);
+  case 7: return kd_nearest_neighbors_periodic__<7>(x, value, n, box);
+  case 8: return kd_nearest_neighbors_periodic__<8>(x, value, n, box);
+  case 9: return kd_nearest_neighbors_periodic__<9>(x, value, n, box);
   default: stop("Invalid dimensions");
   }
 }
 
+template <size_t I>
+List kd_range_query_periodic__(List x, NumericVector lower,
+                               NumericVector upper, NumericVector box)
+{
+  auto p = get_ptr<I>(x);
+  auto q = make_xptr(new arrayvec<I>);
+  auto oi = back_inserter(*q);
+  auto l = vec_to_array<I>(lower),
+    u = vec_to_array<I>(upper);
+  auto b = box_to_array<I>(box);
+  kd_range_query_periodic(begin(*p), end(*p), l, u, b, oi, get_bucket(x));
+  return wrap_ptr(q);
+}
+
+// [[Rcpp::export]]
+List kd_range_query_periodic_(List x, NumericVector lower,
+                              NumericVector upper, NumericVector box)
+{
+  require_standard(x);
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_range_query_periodic__<1>(x, lower, upper, box);
+  case 2: return kd_range_query_periodic__<2>(x, lower, upper, box);
+  case 3: return kd_range_query_periodic__<3>(x, lower, upper, box);
+  case 4: return kd_range_query_periodic__<4>(x, lower, upper, box);
+  case 5: return kd_range_query_periodic__<5>(x, lower, upper, box);
+  case 6: return kd_range_query_periodic__<6>(x, lower, upper, box);
+  case 7: return kd_range_query_periodic__<7>(x, lower, upper, box);
+  case 8: return kd_range_query_periodic__<8>(x, lower, upper, box);
+  case 9: return kd_range_query_periodic__<9>(x, lower, upper, box);
+  default: stop("Invalid dimensions");
+  }
+}
+
+template <size_t I>
+List kd_radius_query_periodic__(List x, NumericVector value,
+                                double radius, NumericVector box)
+{
+  auto p = get_ptr<I>(x);
+  auto q = make_xptr(new arrayvec<I>);
+  auto oi = back_inserter(*q);
+  auto v = vec_to_array<I>(value);
+  auto b = box_to_array<I>(box);
+  kd_radius_query_periodic(begin(*p), end(*p), v, radius, b, oi, get_bucket(x));
+  return wrap_ptr(q);
+}
+
+// [[Rcpp::export]]
+List kd_radius_query_periodic_(List x, NumericVector value,
+                               double radius, NumericVector box)
+{
+  require_standard(x);
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_radius_query_periodic__<1>(x, value, radius, box);
+  case 2: return kd_radius_query_periodic__<2>(x, value, radius, box);
+  case 3: return kd_radius_query_periodic__<3>(x, value, radius, box);
+  case 4: return kd_radius_query_periodic__<4>(x, value, radius, box);
+  case 5: return kd_radius_query_periodic__<5>(x, value, radius, box);
+  case 6: return kd_radius_query_periodic__<6>(x, value, radius, box);
+  case 7: return kd_radius_query_periodic__<7>(x, value, radius, box);
+  case 8: return kd_radius_query_periodic__<8>(x, value, radius, box);
+  case 9: return kd_radius_query_periodic__<9>(x, value, radius, box);
+  default: stop("Invalid dimensions");
+  }
+}
+
+// [[Rcpp::export]]
+List kd_nearest_neighbors_geo_(List x, NumericVector value, int n)
+{
+  if (n < 0) stop("Number of neighbors must be non-negative");
+  if (arrayvec_dim(x) != 2)
+    stop("Expecting two columns (longitude, latitude)");
+  require_standard(x);
+  auto p = get_ptr<2>(x);
+  auto q = make_xptr(new arrayvec<2>);
+  auto oi = back_inserter(*q);
+  auto v = vec_to_array<2>(value);
+  kd_nearest_neighbors_geo(begin(*p), end(*p), v, n, oi, get_bucket(x));
+  return wrap_ptr(q);
+}
+
+// [[Rcpp::export]]
+List kd_radius_query_geo_(List x, NumericVector value, double radius)
+{
+  if (arrayvec_dim(x) != 2)
+    stop("Expecting two columns (longitude, latitude)");
+  require_standard(x);
+  auto p = get_ptr<2>(x);
+  auto q = make_xptr(new arrayvec<2>);
+  auto oi = back_inserter(*q);
+  auto v = vec_to_array<2>(value);
+  kd_radius_query_geo(begin(*p), end(*p), v, radius, oi, get_bucket(x));
+  return wrap_ptr(q);
+}
+
+template <size_t I>
+List kd_skyline__(List x, bool parallel, int max_threads)
+{
+  auto p = get_ptr<I>(x);
+  auto q = make_xptr(new arrayvec<I>);
+  auto oi = back_inserter(*q);
+  if (parallel)
+    kd_skyline_threaded(begin(*p), end(*p), oi, max_threads, get_bucket(x));
+  else kd_skyline(begin(*p), end(*p), oi, get_bucket(x));
+  return wrap_ptr(q);
+}
+
+List kd_skyline_dyn__(List x, bool parallel, int max_threads)
+{
+  auto nc = arrayvec_dim(x);
+  auto p = get_dyn_ptr(x);
+  auto r = get_rows(p, nc);
+  vector<size_t> idx;
+  if (parallel)
+    kd_skyline_threaded(r, back_inserter(idx), max_threads, get_bucket(x));
+  else kd_skyline(r, back_inserter(idx), get_bucket(x));
+  return copy_rows(p, nc, idx);
+}
+
+// [[Rcpp::export]]
+List kd_skyline_(List x, bool parallel = false, int max_threads = 0)
+{
+  require_standard(x);
+  max_threads = get_threads(max_threads);
+  switch(arrayvec_dim(x)) {
+  case 1: return kd_skyline__<1>(x, parallel, max_threads);
+  case 2: return kd_skyline__<2>(x, parallel, max_threads);
+  case 3: return kd_skyline__<3>(x, parallel, max_threads);
+  case 4: return kd_skyline__<4>(x, parallel, max_threads);
+  case 5: return kd_skyline__<5>(x, parallel, max_threads);
+  case 6: return kd_skyline__<6>(x, parallel, max_threads);
+  case 7: return kd_skyline__<7>(x, parallel, max_threads);
+  case 8: return kd_skyline__<8>(x, parallel, max_threads);
+  case 9: return kd_skyline__<9>(x, parallel, max_threads);
+  default: return kd_skyline_dyn__(x, parallel, max_threads);
+  }
+}
+
+template <size_t I>
+IntegerVector curve_order__(List x, curve_type c, bool parallel)
+{
+  auto p = get_ptr<I>(x);
+  auto q = parallel ? curve_order_threaded(begin(*p), end(*p), c) :
+    curve_order(begin(*p), end(*p), c);
+  IntegerVector res(q.size());
+  std::transform(begin(q), end(q), begin(res),
+                 [](size_t i){ return i + 1; });
+  return res;
+}
+
+IntegerVector curve_order_dyn__(List x, curve_type c, bool parallel)
+{
+  auto p = get_dyn_ptr(x);
+  auto r = get_rows(p, arrayvec_dim(x));
+  auto q = parallel ? curve_order_threaded(r, c) : curve_order(r, c);
+  IntegerVector res(q.size());
+  std::transform(begin(q), end(q), begin(res),
+                 [](size_t i){ return i + 1; });
+  return res;
+}
+
+// [[Rcpp::export]]
+IntegerVector curve_order_(List x, bool hilbert = true, bool parallel = false)
+{
+  auto c = hilbert ? curve_type::hilbert : curve_type::morton;
+  switch(arrayvec_dim(x)) {
+  case 1: return curve_order__<1>(x, c, parallel);
+  case 2: return curve_order__<2>(x, c, parallel);
+  case 3: return curve_order__<3>(x, c, parallel);
+  case 4: return curve_order__<4>(x, c, parallel);
+  case 5: return curve_order__<5>(x, c, parallel);
+  case 6: return curve_order__<6>(x, c, parallel);
+  case 7: return curve_order__<7>(x, c, parallel);
+  case 8: return curve_order__<8>(x, c, parallel);
+  case 9: return curve_order__<9>(x, c, parallel);
+  default: return curve_order_dyn__(x, c, parallel);
+  }
+}
+
+//' Search and sort instrumentation
+//'
+//' @param reset if true, zero the counters after reading them
+//'
+//' @details When kdtools is compiled with \code{-DKDTOOLS_ENABLE_STATS}
+//' (for example by adding it to \code{PKG_CPPFLAGS} in \code{src/Makevars}),
+//' the sorting and search routines count the tree nodes they visit, the
+//' subtrees they prune, the points they scan linearly in small subranges,
+//' the distances they compute, the partitioning steps of \code{kd_sort}
+//' and its maximum recursion depth. Counters are kept per thread and
+//' summed on read, so a call bracketed by \code{kd_stats(reset = TRUE)}
+//' gives the work done by that call. Without the flag the counters
+//' compile away and \code{kd_stats} signals an error.
+//'
+//' @return \code{kd_stats} returns a named numeric vector of counters.
+//' \code{kd_stats_enabled} returns true if counters are compiled in.
+//'
+//' @examples
+//' if (kd_stats_enabled()) {
+//'   x = kd_sort(matrix(runif(2000), 1000))
+//'   kd_stats(reset = TRUE)
+//'   kd_nearest_neighbors(x, c(0.5, 0.5), 10)
+//'   kd_stats()
+//' }
+//'
+//' @rdname stats
+//' @export
+// [[Rcpp::export]]
+NumericVector kd_stats(bool reset = false)
+{
+  if (!kdtools::kd_stats_enabled())
+    stop("kdtools was compiled without KDTOOLS_ENABLE_STATS");
+  auto s = kd_stats_total();
+  if (reset) kd_stats_reset();
+  return NumericVector::create(
+    Rcpp::_["nodes_visited"] = double(s.nodes_visited),
+    Rcpp::_["subtrees_pruned"] = double(s.subtrees_pruned),
+    Rcpp::_["points_scanned"] = double(s.points_scanned),
+    Rcpp::_["distance_evals"] = double(s.distance_evals),
+    Rcpp::_["sort_partitions"] = double(s.sort_partitions),
+    Rcpp::_["sort_max_depth"] = double(s.sort_max_depth));
+}
+
+//' @rdname stats
+//' @export
+// [[Rcpp::export]]
+bool kd_stats_enabled()
+{
+  return kdtools::kd_stats_enabled();
+}